@@ -0,0 +1,35 @@
+#
+# call/ret recursion kernel for benchvm
+#   naive recursive fibonacci of n; each leaf adds its n into fib
+#
+export mainx20
+export n
+export fib
+export recurse
+
+n:
+  word 27
+fib:
+  word 0
+mainx20:
+  load   r0, n       # r0 is the argument
+  ldimm  r2, 0       # r2 is the running sum of the leaves
+  ldimm  r6, 1       # r6 always contains 1
+  ldimm  r8, 2       # r8 always contains 2
+  call   recurse
+  store  r2, fib
+  halt
+# fib(r0) = fib(r0 - 1) + fib(r0 - 2); the argument is saved on the stack
+recurse:
+  blt    r0, r8, leaf
+  push   r0
+  subi   r0, r6
+  call   recurse
+  ldind  r0, -2(r13)
+  subi   r0, r8
+  call   recurse
+  addi   r14, r6     # drop the saved argument
+  ret
+leaf:
+  addi   r2, r0
+  ret
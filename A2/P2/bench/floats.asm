@@ -0,0 +1,97 @@
+#
+# float loop kernels for benchvm and difftest
+#   fills x and y, then repeats y[i] = y[i] + a * x[i] and z[i] = y[i] / x[i]
+#   over them, and sums z into sum
+#
+export mainx20
+export n
+export reps
+export sum
+
+n:
+  word 10000
+reps:
+  word 100
+a:
+  word 0x3f000000     # 0.5
+one:
+  word 0x3f800000     # 1.0
+step:
+  word 0x3c23d70a     # 0.01
+sum:
+  word 0
+x:
+  alloc 10000
+y:
+  alloc 10000
+z:
+  alloc 10000
+mainx20:
+  load   r1, n        # r1 is the upperbound of every loop
+  ldimm  r6, 1        # r6 always contains 1, the loop increment
+  ldimm  r11, 0       # r11 always contains 0
+  # x[i] = 1 + 0.01 * i
+  ldimm  r0, 0
+  ldaddr r2, x
+  load   r3, one
+  load   r4, step
+fill:
+  beq    r0, r1, filled
+  stind  r3, 0(r2)
+  addf   r3, r4
+  addi   r2, r6
+  addi   r0, r6
+  jmp    fill
+filled:
+  load   r7, reps
+  load   r9, a
+rep:
+  # y[i] = y[i] + a * x[i]
+  ldimm  r0, 0
+  ldaddr r2, x
+  ldaddr r8, y
+axpy:
+  beq    r0, r1, divide
+  ldind  r5, 0(r2)
+  mulf   r5, r9
+  ldind  r10, 0(r8)
+  addf   r10, r5
+  stind  r10, 0(r8)
+  addi   r2, r6
+  addi   r8, r6
+  addi   r0, r6
+  jmp    axpy
+divide:
+  # z[i] = y[i] / x[i]
+  ldimm  r0, 0
+  ldaddr r2, x
+  ldaddr r8, y
+  ldaddr r12, z
+quotient:
+  beq    r0, r1, next
+  ldind  r10, 0(r8)
+  ldind  r5, 0(r2)
+  divf   r10, r5
+  stind  r10, 0(r12)
+  addi   r2, r6
+  addi   r8, r6
+  addi   r12, r6
+  addi   r0, r6
+  jmp    quotient
+next:
+  subi   r7, r6
+  bgt    r7, r11, rep
+  # sum of z, one element after the other
+  ldimm  r0, 0
+  ldaddr r12, z
+  ldimm  r3, 0
+total:
+  beq    r0, r1, done
+  ldind  r5, 0(r12)
+  addf   r3, r5
+  addi   r12, r6
+  addi   r0, r6
+  jmp    total
+done:
+  store  r3, sum
+  halt
@@ -0,0 +1,35 @@
+#
+# cmpxchg lock contention kernel for benchvm
+#   every core adds 1 to count n times, each time under a spin lock
+#
+export mainx20
+export n
+export count
+
+n:
+  word 20000
+count:
+  word 0
+lock:
+  word -1
+mainx20:
+  load   r4, n        # r4 counts the additions down
+  ldimm  r1, 1        # r1 always contains 1
+  ldimm  r5, 0        # r5 always contains 0
+  getpid r10
+acquire:
+  ldimm  r8, -1
+  ldimm  r9, -1
+  cmpxchg r9, r10, lock
+  beq    r8, r9, add
+  jmp    acquire
+add:
+  load   r0, count
+  addi   r0, r1
+  store  r0, count
+  subi   r4, r1
+  # release
+  ldimm  r9, -1
+  store  r9, lock
+  bgt    r4, r5, acquire
+  halt
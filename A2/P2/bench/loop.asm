@@ -0,0 +1,23 @@
+#
+# long running integer loop kernel for benchvm
+#   sums n, n-1, ..., 1 into acc
+#
+export mainx20
+export n
+export acc
+
+n:
+  word 20000000
+acc:
+  word 0
+mainx20:
+  load   r0, n       # r0 is the loop counter
+  ldimm  r1, 1       # r1 always contains 1, the loop decrement
+  ldimm  r2, 0       # r2 is the running sum
+  ldimm  r4, 0       # r4 always contains 0, the loop bound
+loop:
+  addi   r2, r0
+  subi   r0, r1
+  bgt    r0, r4, loop
+  store  r2, acc
+  halt
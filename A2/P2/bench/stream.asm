@@ -0,0 +1,53 @@
+#
+# memory streaming kernel for benchvm
+#   fills src, then copies it to dst and sums it, reps times over n words
+#
+export mainx20
+export n
+export reps
+export sum
+
+n:
+  word 65536
+reps:
+  word 20
+sum:
+  word 0
+src:
+  alloc 65536
+dst:
+  alloc 65536
+mainx20:
+  load   r1, n        # r1 is the upperbound of every loop
+  load   r5, reps     # r5 counts the passes down
+  ldimm  r6, 1        # r6 always contains 1, the loop increment
+  ldimm  r11, 0       # r11 always contains 0
+  ldimm  r3, 0        # r3 is the running sum
+  # src[i] = i
+  ldimm  r0, 0
+  ldaddr r2, src
+fill:
+  beq    r0, r1, pass
+  stind  r0, 0(r2)
+  addi   r2, r6
+  addi   r0, r6
+  jmp    fill
+  # dst[i] = src[i], sum += src[i]
+pass:
+  ldimm  r0, 0
+  ldaddr r2, src
+  ldaddr r4, dst
+copy:
+  beq    r0, r1, copied
+  ldind  r7, 0(r2)
+  addi   r3, r7
+  stind  r7, 0(r4)
+  addi   r2, r6
+  addi   r4, r6
+  addi   r0, r6
+  jmp    copy
+copied:
+  subi   r5, r6
+  bgt    r5, r11, pass
+  store  r3, sum
+  halt
@@ -0,0 +1,280 @@
+#include "vmx20.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// compares the execution engines on a set of executables
+//   usage: ./benchvm [runs] [executable] ...
+//   without executables the programs in test/ and bench/ are used
+//   afterwards the first program is run as many small jobs, each in its
+//   own vm, once with execute and once on a host from a shared image, and
+//   then all in one vm that has the image reloaded into it for every job
+//
+//   ./benchvm -s [runs] runs the suite of bench/ workloads instead and
+//   prints one comma-separated line per workload, engine and number of
+//   cores, for comparing the interpreter between builds
+
+static char *defaultPrograms[] = {
+    "test/EXPECTED_main.exe",
+    "test/addf.exe",
+    "test/addi.exe",
+    "test/main42.exe",
+    "test/test_getpid.exe",
+    "test/test_lock.exe",
+    "test/test_no_lock.exe",
+    "test/test_stack_overflow.exe",
+    "bench/loop.exe",
+    "bench/calls.exe",
+    "bench/floats.exe",
+    "bench/stream.exe",
+    "bench/lock.exe",
+};
+
+static struct {
+    char *name;
+    char *program;
+    int scaling;        // also run on more cores
+} workloads[] = {
+    {"integer-loop", "bench/loop.exe", 0},
+    {"call-recursion", "bench/calls.exe", 0},
+    {"float-vector", "bench/floats.exe", 0},
+    {"memory-stream", "bench/stream.exe", 0},
+    {"lock-contention", "bench/lock.exe", 1},
+};
+
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+#define MAX_CORES 16    // scaling workloads run on 1, 2, 4, ... MAX_CORES
+#define STACK_SIZE 1000
+
+static struct {
+    int32_t engine;
+    char *name;
+} engines[] = {
+    {VMX20_ENGINE_SWITCH, "switch"},
+    {VMX20_ENGINE_THREADED, "threaded"},
+    {VMX20_ENGINE_JIT, "jit"},
+};
+
+#define NUM_ENGINES (sizeof(engines) / sizeof(engines[0]))
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// time a single execute() of the program on numProcessors cores
+//   returns seconds or -1 on error; the instructions executed are
+//   returned through the last parameter
+static double runOnce(char *filename, int32_t engine, uint32_t numProcessors,
+        uint64_t *instructions)
+{
+    int32_t err = 0;
+    void *handle = initVm(&err);
+    if (err) return -1;
+    if (!loadExecutableFile(handle, filename, &err) || !setEngine(handle, engine))
+    {
+        cleanup(handle);
+        return -1;
+    }
+    // every core gets its own stack at the top of memory
+    uint32_t initialSP[MAX_CORES];
+    int terminationStatus[MAX_CORES] = {0};
+    for (int i = 0; i < numProcessors; i++)
+    {
+        initialSP[i] = VMX20_DEFAULT_MEMORY - 1 - STACK_SIZE * i;
+    }
+    double start = now();
+    int32_t ok = execute(handle, numProcessors, initialSP, terminationStatus, 0);
+    double elapsed = now() - start;
+    if (!getInstructionCount(handle, instructions)) ok = 0;
+    cleanup(handle);
+    return ok ? elapsed : -1;
+}
+
+// fastest of runs executions; -1 if any of them failed
+static double bestOf(int runs, char *filename, int32_t engine, uint32_t numProcessors,
+        uint64_t *instructions)
+{
+    double best = -1;
+    for (int r = 0; r < runs; r++)
+    {
+        uint64_t count;
+        double t = runOnce(filename, engine, numProcessors, &count);
+        if (t < 0) return -1;
+        if (best < 0 || t < best)
+        {
+            best = t;
+            *instructions = count;
+        }
+    }
+    return best;
+}
+
+// the suite as comma-separated values
+//   scaling workloads give every core the same work, so their efficiency
+//   on n cores is the time on one core over the time on n
+static int runSuite(int runs)
+{
+    int failed = 0;
+    printf("workload,engine,cores,instructions,ms,minstr_per_s,ns_per_instr,efficiency\n");
+    for (int w = 0; w < NUM_WORKLOADS; w++)
+    {
+        for (int e = 0; e < NUM_ENGINES; e++)
+        {
+            double single = -1;
+            for (uint32_t cores = 1; cores <= (workloads[w].scaling ? MAX_CORES : 1); cores *= 2)
+            {
+                uint64_t instructions = 0;
+                double t = bestOf(runs, workloads[w].program, engines[e].engine, cores,
+                        &instructions);
+                if (t <= 0)
+                {
+                    printf("%s,%s,%u,,,,,\n", workloads[w].name, engines[e].name, cores);
+                    failed = 1;
+                    continue;
+                }
+                if (cores == 1) single = t;
+                printf("%s,%s,%u,%llu,%.3f,%.1f,%.3f,", workloads[w].name, engines[e].name,
+                        cores, (unsigned long long)instructions, t * 1e3,
+                        instructions / t / 1e6, instructions ? t * 1e9 / instructions : 0.0);
+                if (single > 0) printf("%.3f", single / t);
+                printf("\n");
+                fflush(stdout);
+            }
+        }
+    }
+    return failed;
+}
+
+#define JOBS 2000
+#define IN_FLIGHT 64    // jobs submitted to the host at a time
+
+// microseconds per job for JOBS runs of filename, each in a fresh vm
+static double jobsExecute(char *filename)
+{
+    uint32_t initialSP[1] = {0xfffff};
+    int terminationStatus[1];
+    int32_t err;
+    double start = now();
+    for (int i = 0; i < JOBS; i++)
+    {
+        void *handle = initVm(&err);
+        if (err || !loadExecutableFile(handle, filename, &err)) return -1;
+        execute(handle, 1, initialSP, terminationStatus, 0);
+        cleanup(handle);
+    }
+    return (now() - start) * 1e6 / JOBS;
+}
+
+static double jobsHost(char *filename)
+{
+    uint32_t initialSP[1] = {0xfffff};
+    int terminationStatus[1];
+    int32_t err;
+    double start = now();
+    void *image = loadImage(filename, &err);
+    void *host = initHost(0, 0, &err);
+    if (!image || !host) return -1;
+    int submitted = 0, done = 0;
+    while (done < JOBS)
+    {
+        while (submitted < JOBS && submitted - done < IN_FLIGHT)
+        {
+            void *handle = initVm(&err);
+            if (err || !loadExecutableImage(handle, image, &err)
+                    || !submitJob(host, handle, 1, initialSP)) return -1;
+            submitted++;
+        }
+        void *handle;
+        if (!waitJob(host, &handle, terminationStatus)) return -1;
+        cleanup(handle);
+        done++;
+    }
+    cleanupHost(host);
+    cleanupImage(image);
+    return (now() - start) * 1e6 / JOBS;
+}
+
+// microseconds per job for JOBS runs of filename, all in one vm
+static double jobsReload(char *filename)
+{
+    uint32_t initialSP[1] = {0xfffff};
+    int terminationStatus[1];
+    int32_t err;
+    double start = now();
+    void *image = loadImage(filename, &err);
+    void *handle = initVm(&err);
+    if (!image || err) return -1;
+    for (int i = 0; i < JOBS; i++)
+    {
+        if (!reloadExecutableImage(handle, image, &err)) return -1;
+        execute(handle, 1, initialSP, terminationStatus, 0);
+    }
+    cleanup(handle);
+    cleanupImage(image);
+    return (now() - start) * 1e6 / JOBS;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "-s") == 0)
+    {
+        int runs = argc > 2 ? atoi(argv[2]) : 3;
+        if (runs <= 0)
+        {
+            fprintf(stderr, "Usage: ./benchvm -s [runs]\n");
+            exit(1);
+        }
+        return runSuite(runs);
+    }
+    int runs = 5;
+    if (argc > 1) runs = atoi(argv[1]);
+    if (runs <= 0)
+    {
+        fprintf(stderr, "Usage: ./benchvm [runs] [executable] ...\n       ./benchvm -s [runs]\n");
+        exit(1);
+    }
+    char **programs = defaultPrograms;
+    int numPrograms = sizeof(defaultPrograms) / sizeof(defaultPrograms[0]);
+    if (argc > 2)
+    {
+        programs = &argv[2];
+        numPrograms = argc - 2;
+    }
+
+    printf("%-30s", "program (best of runs, ms)");
+    for (int e = 0; e < NUM_ENGINES; e++) printf(" %12s", engines[e].name);
+    printf(" %9s\n", "best/switch");
+    for (int p = 0; p < numPrograms; p++)
+    {
+        double best[NUM_ENGINES];
+        for (int e = 0; e < NUM_ENGINES; e++)
+        {
+            uint64_t instructions;
+            best[e] = bestOf(runs, programs[p], engines[e].engine, 1, &instructions);
+        }
+        printf("%-30s", programs[p]);
+        for (int e = 0; e < NUM_ENGINES; e++)
+        {
+            if (best[e] < 0) printf(" %12s", "failed");
+            else printf(" %12.3f", best[e] * 1e3);
+        }
+        double fastest = -1;
+        for (int e = 1; e < NUM_ENGINES; e++)
+        {
+            if (best[e] > 0 && (fastest < 0 || best[e] < fastest)) fastest = best[e];
+        }
+        if (best[0] > 0 && fastest > 0)
+            printf(" %8.2fx", best[0] / fastest);
+        printf("\n");
+    }
+
+    printf("\n%d jobs of %s (us per job)\n", JOBS, programs[0]);
+    printf("%-30s %12.1f\n", "execute", jobsExecute(programs[0]));
+    printf("%-30s %12.1f\n", "host, shared image", jobsHost(programs[0]));
+    printf("%-30s %12.1f\n", "reload into one vm", jobsReload(programs[0]));
+    return 0;
+}
@@ -0,0 +1,389 @@
+#include "vmx20.h"
+#include "vmx20_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// differential test of the execution engines
+//   usage: ./difftest [-pN] <executable> ... | -c
+//   every executable is run with the switch engine, which is the reference,
+//   and with every other engine; the termination statuses and the complete
+//   memory image afterwards must be identical. the JIT compiles every block
+//   on its first entry so that as much code as possible runs natively.
+//   "host" runs all processors on a single host worker with a short time
+//   slice, so they are switched often.
+//
+//   ./difftest -c runs checks of behaviour that can not be compared between
+//   engines instead; they look inside the vm where they have to.
+
+static struct {
+    int32_t engine;
+    char *name;
+    int host;
+} engines[] = {
+    {VMX20_ENGINE_SWITCH, "switch", 0},
+    {VMX20_ENGINE_THREADED, "threaded", 0},
+    {VMX20_ENGINE_JIT, "jit", 0},
+    {VMX20_ENGINE_THREADED, "host", 1},
+};
+
+#define NUM_ENGINES (sizeof(engines) / sizeof(engines[0]))
+#define STACK_SIZE 1000
+#define REPLAYS 50          // replays of the recording of checkReplayedLock
+
+typedef struct Result {
+    int terminationStatus[VMX20_MAX_PROCESSORS];
+    int32_t *memory;
+    uint32_t words;
+} result_t;
+
+// run filename on the given engine; returns 0 if the engine is unavailable
+static int run(char *filename, int32_t engine, int host, int processors, result_t *out)
+{
+    int32_t err = 0;
+    void *handle = initVm(&err);
+    if (err)
+    {
+        fprintf(stderr, "Failed to initialize vm.\n");
+        exit(err);
+    }
+    if (!loadExecutableFile(handle, filename, &err))
+    {
+        fprintf(stderr, "%s: failed to load (%d)\n", filename, err);
+        exit(1);
+    }
+    if (!setEngine(handle, engine))
+    {
+        cleanup(handle);
+        return 0;
+    }
+    setJitThreshold(handle, 0);
+
+    uint32_t initialSP[VMX20_MAX_PROCESSORS] = {0};
+    for (int i = 0; i < processors; i++)
+    {
+        initialSP[i] = VMX20_DEFAULT_MEMORY - 1 - STACK_SIZE * i;
+    }
+    memset(out->terminationStatus, 0, sizeof(out->terminationStatus));
+    if (host)
+    {
+        void *h = initHost(1, 1000, &err);
+        void *done;
+        if (!h || !submitJob(h, handle, processors, initialSP)
+                || !waitJob(h, &done, out->terminationStatus))
+        {
+            fprintf(stderr, "%s: job failed to run\n", filename);
+            exit(1);
+        }
+        cleanupHost(h);
+    }
+    else if (!execute(handle, processors, initialSP, out->terminationStatus, 0))
+    {
+        fprintf(stderr, "%s: processors failed to start\n", filename);
+        exit(1);
+    }
+
+    int32_t word;
+    uint32_t words = 0;
+    while (getWord(handle, words, &word)) words++;
+    out->words = words;
+    out->memory = malloc(sizeof(int32_t) * words);
+    for (uint32_t i = 0; i < words; i++) getWord(handle, i, &out->memory[i]);
+    cleanup(handle);
+    return 1;
+}
+
+// compare against the reference; returns the number of differences
+static int compare(char *filename, char *engine, int processors, result_t *ref, result_t *res)
+{
+    int failures = 0;
+    for (int i = 0; i < processors; i++)
+    {
+        if (ref->terminationStatus[i] != res->terminationStatus[i])
+        {
+            printf("%s [%s] core %d: status %d, expected %d\n", filename, engine, i,
+                    res->terminationStatus[i], ref->terminationStatus[i]);
+            failures++;
+        }
+    }
+    for (uint32_t i = 0; i < ref->words && i < res->words; i++)
+    {
+        if (ref->memory[i] != res->memory[i])
+        {
+            if (failures < 10)
+                printf("%s [%s] memory[%u]: 0x%.8x, expected 0x%.8x\n", filename, engine, i,
+                        res->memory[i], ref->memory[i]);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+static int check(char *name, int ok)
+{
+    printf("%-50s %s\n", name, ok ? "ok" : "FAIL");
+    return !ok;
+}
+
+// stores into the data of a program leave the decoded program shared with
+//   the image; only a store into its code makes the vm copy it
+static int checkSharedCode(void)
+{
+    int32_t err, word;
+    uint32_t n, acc;
+    uint32_t initialSP[1] = {VMX20_DEFAULT_MEMORY - 1};
+    int terminationStatus[1];
+    void *image = loadImage("bench/loop.exe", &err);
+    struct VM *a = initVm(&err);
+    struct VM *b = initVm(&err);
+    int ok = image && a && b && loadExecutableImage(a, image, &err)
+        && loadExecutableImage(b, image, &err)
+        && getAddress(a, "n", &n) && getAddress(a, "acc", &acc)
+        && putWord(a, n, 1000) && execute(a, 1, initialSP, terminationStatus, 0)
+        && getWord(a, acc, &word) && word == 500500;
+    ok = ok && a->codeShared && b->codeShared && a->code == b->code;
+    check("data stores keep the decoded program shared", ok);
+    // mainx20 follows acc
+    ok = ok && putWord(a, acc + 1, 0) && !a->codeShared && b->codeShared && a->code != b->code;
+    if (a) cleanup(a);
+    if (b) cleanup(b);
+    if (image) cleanupImage(image);
+    return check("a code store copies the decoded program", ok);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// two cores spin on a lock that is never released until the budget or
+//   deadline stops them; returns the seconds that took, or -1 if they were
+//   not stopped by it
+static double heldLock(uint64_t instructions, uint32_t milliseconds)
+{
+    int32_t err;
+    uint32_t count;
+    uint32_t initialSP[2] = {VMX20_DEFAULT_MEMORY - 1, VMX20_DEFAULT_MEMORY - 1 - STACK_SIZE};
+    int terminationStatus[2];
+    void *handle = initVm(&err);
+    if (err || !loadExecutableFile(handle, "test/test_lock.exe", &err)
+            || !getAddress(handle, "count", &count))
+    {
+        return -1;
+    }
+    // the lock follows count; held by a core that does not exist
+    putWord(handle, count + 1, 99);
+    setBudget(handle, instructions, milliseconds);
+    double start = now();
+    int ok = execute(handle, 2, initialSP, terminationStatus, 0)
+        && terminationStatus[0] == VMX20_BUDGET_EXCEEDED
+        && terminationStatus[1] == VMX20_BUDGET_EXCEEDED;
+    double elapsed = now() - start;
+    cleanup(handle);
+    return ok ? elapsed : -1;
+}
+
+// a loop compiled by the JIT engine runs natively, but still no further
+//   than its budget allows
+static int checkJitLoopBudget(void)
+{
+    int32_t err;
+    uint64_t budget = 100001, count = 0;
+    uint32_t initialSP[1] = {VMX20_DEFAULT_MEMORY - 1};
+    int terminationStatus[1];
+    void *handle = initVm(&err);
+    int ok = !err && loadExecutableFile(handle, "bench/loop.exe", &err)
+        && setEngine(handle, VMX20_ENGINE_JIT) && setBudget(handle, budget, 0)
+        && execute(handle, 1, initialSP, terminationStatus, 0)
+        && terminationStatus[0] == VMX20_BUDGET_EXCEEDED
+        && getInstructionCount(handle, &count) && count < budget + 3;
+    if (handle) cleanup(handle);
+    return check("a compiled loop stops within its budget", ok);
+}
+
+// two cores read the word above their stack while the execution is
+//   recorded. a guard page there would stop a core in the middle of its
+//   turn, so there is none and the word is read like any other
+static int checkRecordedGuard(void)
+{
+    int32_t err;
+    uint32_t entry;
+    uint32_t sizes[1] = {4096};
+    uint32_t initialSP[2] = {0x3efff, 0x3cfff};
+    int terminationStatus[2];
+    char recordFile[] = "/tmp/difftestXXXXXX";
+    int fd = mkstemp(recordFile);
+    void *handle = initVm(&err);
+    if (fd < 0 || err || !loadExecutableFile(handle, "test/main42.exe", &err)
+            || !getAddress(handle, "mainx20", &entry))
+    {
+        return check("a recorded execution has no guard pages", 0);
+    }
+    close(fd);
+    // ldind r0, 1(r14); halt
+    putWord(handle, entry, 0x0001e005);
+    putWord(handle, entry + 1, 0);
+    setStacks(handle, sizes, 1, 1);
+    setRecordFile(handle, recordFile);
+    int ok = execute(handle, 2, initialSP, terminationStatus, 0)
+        && terminationStatus[0] == VMX20_NORMAL_TERMINATION
+        && terminationStatus[1] == VMX20_NORMAL_TERMINATION;
+    cleanup(handle);
+    unlink(recordFile);
+    return check("a recorded execution has no guard pages", ok);
+}
+
+// a core running off a guarded stack, downwards with the endless
+//   recursion of test_stack_overflow.exe or upwards with a ret on an
+//   empty stack, faults on a guard page and stops like a checked one
+static int checkGuardPages(char *name, int overflow)
+{
+    int32_t err, lastSP;
+    uint32_t entry, last;
+    uint32_t sizes[1] = {4096};
+    uint32_t initialSP[1] = {0x3efff};
+    int terminationStatus[1];
+    void *handle = initVm(&err);
+    int ok = !err && loadExecutableFile(handle,
+            overflow ? "test/test_stack_overflow.exe" : "test/main42.exe", &err)
+        && getAddress(handle, overflow ? "lastSP" : "mainx20", overflow ? &last : &entry);
+    // ret
+    if (ok && !overflow) ok = putWord(handle, entry, 0x00000010);
+    ok = ok && setEngine(handle, VMX20_ENGINE_THREADED) && setStacks(handle, sizes, 1, 1)
+        && execute(handle, 1, initialSP, terminationStatus, 0)
+        && terminationStatus[0] == VMX20_ADDRESS_OUT_OF_RANGE;
+    // the last call made went as deep as the stack goes
+    if (ok && overflow)
+    {
+        ok = getWord(handle, last, &lastSP)
+            && lastSP >= (int32_t)(initialSP[0] + 1 - sizes[0]) && lastSP < (int32_t)initialSP[0];
+    }
+    if (handle) cleanup(handle);
+    return check(name, ok);
+}
+
+// eight cores contend for the lock of test_lock.exe while the execution is
+//   recorded; every replay of it must come out the same, however the
+//   threads of the cores happen to interleave
+static int checkReplayedLock(void)
+{
+    int32_t err;
+    uint32_t count;
+    int32_t recorded = -1, replayed;
+    uint32_t initialSP[8];
+    int terminationStatus[8];
+    char recordFile[] = "/tmp/difftestXXXXXX";
+    int fd = mkstemp(recordFile);
+    if (fd < 0) return check("replays of a contended lock do not diverge", 0);
+    close(fd);
+    for (int i = 0; i < 8; i++) initialSP[i] = VMX20_DEFAULT_MEMORY - 1 - STACK_SIZE * i;
+    int ok = 1;
+    for (int run = 0; ok && run <= REPLAYS; run++)
+    {
+        void *handle = initVm(&err);
+        ok = !err && loadExecutableFile(handle, "test/test_lock.exe", &err)
+            && getAddress(handle, "count", &count)
+            && setScheduler(handle, VMX20_SCHEDULE_THREADS, 0, 0)
+            && (run ? setReplayFile(handle, recordFile) : setRecordFile(handle, recordFile))
+            && execute(handle, 8, initialSP, terminationStatus, 0)
+            && getWord(handle, count, &replayed);
+        for (int i = 0; ok && i < 8; i++) ok = terminationStatus[i] == VMX20_NORMAL_TERMINATION;
+        if (!run) recorded = replayed;
+        ok = ok && replayed == recorded;
+        if (handle) cleanup(handle);
+    }
+    unlink(recordFile);
+    return check("replays of a contended lock do not diverge", ok);
+}
+
+// a restored vm maps its memory from the snapshot, which a new snapshot of
+//   it into the same file must not pull from under it
+static int checkSnapshotOverOwnFile(void)
+{
+    int32_t err, word, expected;
+    uint32_t entry;
+    char snapshotFile[] = "/tmp/difftestXXXXXX";
+    int fd = mkstemp(snapshotFile);
+    void *handle = initVm(&err);
+    void *restored = NULL;
+    int ok = fd >= 0 && !err && loadExecutableFile(handle, "test/main42.exe", &err)
+        && snapshotVm(handle, snapshotFile, &err)
+        && (restored = restoreVm(snapshotFile, &err)) != NULL
+        && snapshotVm(restored, snapshotFile, &err)
+        && getAddress(restored, "mainx20", &entry) && getWord(restored, entry, &word)
+        && getWord(handle, entry, &expected) && word == expected;
+    if (fd >= 0)
+    {
+        close(fd);
+        unlink(snapshotFile);
+    }
+    if (restored) cleanup(restored);
+    cleanup(handle);
+    return check("a snapshot replaces the file it was restored from", ok);
+}
+
+static int runChecks(void)
+{
+    int failures = 0;
+    failures += checkSharedCode();
+    double t = heldLock(0, 200);
+    failures += check("a deadline stops cores spinning on a lock", t >= 0 && t < 1);
+    t = heldLock(100000, 0);
+    failures += check("a budget stops cores spinning on a lock", t >= 0 && t < 1);
+    failures += checkJitLoopBudget();
+    failures += checkGuardPages("a guard page stops a stack overflow", 1);
+    failures += checkGuardPages("a guard page stops a stack underflow", 0);
+    failures += checkRecordedGuard();
+    failures += checkReplayedLock();
+    failures += checkSnapshotOverOwnFile();
+    return failures;
+}
+
+int main(int argc, char *argv[])
+{
+    int processors = 1;
+    int failures = 0;
+    int programs = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-c") == 0)
+        {
+            failures += runChecks();
+            programs++;
+            continue;
+        }
+        if (argv[i][0] == '-' && argv[i][1] == 'p')
+        {
+            processors = atoi(&argv[i][2]);
+            if (processors <= 0 || processors > VMX20_MAX_PROCESSORS)
+            {
+                fprintf(stderr, "Invalid option %s\n", argv[i]);
+                exit(50);
+            }
+            continue;
+        }
+        result_t ref;
+        run(argv[i], engines[0].engine, 0, processors, &ref);
+        for (int e = 1; e < NUM_ENGINES; e++)
+        {
+            result_t res;
+            if (!run(argv[i], engines[e].engine, engines[e].host, processors, &res)) continue;
+            int f = compare(argv[i], engines[e].name, processors, &ref, &res);
+            printf("%-32s -p%-2d %-9s %s\n", argv[i], processors, engines[e].name, f ? "FAIL" : "ok");
+            failures += f;
+            free(res.memory);
+        }
+        free(ref.memory);
+        programs++;
+    }
+    if (programs == 0)
+    {
+        fprintf(stderr, "Usage: ./difftest [-pN] <executable> ... | -c\n");
+        exit(1);
+    }
+    return failures != 0;
+}
@@ -2,11 +2,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 void failAddr(char *arg) { printf("failed to retrieve address for %s\n", arg); }
 void failGet(int addr) { printf("failed to get word at addr %d\n", addr); }
 void failPut(int addr) { printf("failed to put word at addr %d\n", addr); }
 
+// print every access to a watched label (-W)
+int32_t printAccess(void *handle, uint32_t pid, uint32_t pc, uint32_t addr, int32_t access,
+        int32_t word, void *arg)
+{
+    char *kind = access == VMX20_WATCH_READ ? "read" : access == VMX20_WATCH_WRITE ? "write" : "cmpxchg";
+    printf("[%d] %.3d: %-7s %s (%d) = %d\n", pid, pc, kind, (char *)arg, addr, word);
+    return 1;
+}
+
 #define PRINT_RESULTS 0
 #define TEST_DISASSEMBLE 0
 
@@ -50,7 +60,7 @@ int main(int argc, char *argv[])
 {
     if (argc < 2)
     {
-        perror("Usage: ./testvm <executable> [var] ... [var=value] ...");
+        perror("Usage: ./testvm <executable> [-t] [-Tfile] [-s] [-P] [-Ffile] [-Rfile] [-rfile] [-dSEED] [-pN] [-SWORDS] [-G] [-Wlabel] [var] ... [var=value] ...");
         exit(1);
     }
 
@@ -70,8 +80,13 @@ int main(int argc, char *argv[])
     // determine whether each argument needs to be printed (1 == print later)
     char *printAddr = calloc(argc, 1);
     int processors = 1;
+    uint32_t stackSize = 0;
+    int guard = 0;
     int trace = 0;
     int printResults = 0;
+    int printStats = 0;
+    int profile = 0;
+    char *foldedFile = NULL;
     for (int i = 2; i < argc; i++)
     {
         if (argv[i][0] == '-')
@@ -81,6 +96,57 @@ int main(int argc, char *argv[])
                 trace = 1;
                 printf("Option trace (-t)\n");
             }
+            else if (argv[i][1] == 'T' && argv[i][2] != '\0')
+            {
+                trace = 1;
+                printf("Option binary trace: %s (-T)\n", &argv[i][2]);
+                if (!setTraceFile(handle, &argv[i][2]))
+                {
+                    fprintf(stderr, "Can not open %s\n", &argv[i][2]);
+                    exit(50);
+                }
+            }
+            else if (strcmp(argv[i], "-s") == 0)
+            {
+                printStats = 1;
+                printf("Option statistics (-s)\n");
+            }
+            else if (strcmp(argv[i], "-P") == 0)
+            {
+                profile = 1;
+                setProfiling(handle, 1);
+                printf("Option profile (-P)\n");
+            }
+            else if (argv[i][1] == 'R' && argv[i][2] != '\0')
+            {
+                printf("Option record: %s (-R)\n", &argv[i][2]);
+                if (!setRecordFile(handle, &argv[i][2]))
+                {
+                    fprintf(stderr, "Can not open %s\n", &argv[i][2]);
+                    exit(50);
+                }
+            }
+            else if (argv[i][1] == 'r' && argv[i][2] != '\0')
+            {
+                printf("Option replay: %s (-r)\n", &argv[i][2]);
+                if (!setReplayFile(handle, &argv[i][2]))
+                {
+                    fprintf(stderr, "Can not read %s\n", &argv[i][2]);
+                    exit(50);
+                }
+            }
+            else if (argv[i][1] == 'F' && argv[i][2] != '\0')
+            {
+                foldedFile = &argv[i][2];
+                setProfiling(handle, 1);
+                printf("Option folded stacks: %s (-F)\n", foldedFile);
+            }
+            else if (argv[i][1] == 'd' && argv[i][2] != '\0')
+            {
+                uint32_t seed = strtoul(&argv[i][2], NULL, 0);
+                setScheduler(handle, VMX20_SCHEDULE_DETERMINISTIC, 0, seed);
+                printf("Option deterministic schedule: seed %u (-d)\n", seed);
+            }
             else if (argv[i][1] == 'p' && argv[i][2] != '\0')
             {
                 sscanf(argv[i], "-p%d", &processors);
@@ -91,6 +157,28 @@ int main(int argc, char *argv[])
                     exit(50);
                 }
             }
+            else if (argv[i][1] == 'S' && argv[i][2] != '\0')
+            {
+                stackSize = strtoul(&argv[i][2], NULL, 0);
+                printf("Option stack size: %u words (-S)\n", stackSize);
+            }
+            else if (strcmp(argv[i], "-G") == 0)
+            {
+                guard = 1;
+                printf("Option guard pages (-G)\n");
+            }
+            else if (argv[i][1] == 'W' && argv[i][2] != '\0')
+            {
+                uint32_t addr, id;
+                if (!getAddress(handle, &argv[i][2], &addr)) {failAddr(&argv[i][2]); continue;}
+                int all = VMX20_WATCH_READ | VMX20_WATCH_WRITE | VMX20_WATCH_CMPXCHG;
+                if (!addWatch(handle, addr, 1, all, printAccess, &argv[i][2], &id))
+                {
+                    fprintf(stderr, "Can not watch %s\n", &argv[i][2]);
+                    exit(50);
+                }
+                printf("Option watch: %s (-W)\n", &argv[i][2]);
+            }
             else
             {
                 fprintf(stderr, "Invalid option %s\n", argv[i]);
@@ -110,7 +198,7 @@ int main(int argc, char *argv[])
         int32_t word;
         if (strstr(split, "f") || strstr(split, ".")) {
             float _f = atof(split);
-            word = *(int32_t*)&_f;
+            memcpy(&word, &_f, sizeof(word));
         } else {
             word = atoi(split);
         }
@@ -128,6 +216,19 @@ int main(int argc, char *argv[])
     {
         initialSP[i] = 0xfffff - (STACK_SIZE * i);
     }
+    if (stackSize)
+    {
+        // stacks from the top of memory down with a page between them, so
+        //   that each can have guard pages; guarded stacks are whole pages
+        uint32_t page = sysconf(_SC_PAGESIZE) / sizeof(int32_t);
+        if (guard) stackSize = (stackSize + page - 1) / page * page;
+        uint32_t top = (VMX20_DEFAULT_MEMORY - page) / page * page;
+        for (int i = 0; i < processors; i++)
+        {
+            initialSP[i] = top - i * (stackSize + page) - 1;
+        }
+        setStacks(handle, &stackSize, 1, guard);
+    }
     int terminationStatus[VMX20_MAX_PROCESSORS] = {0};
     if (!execute(handle, processors, initialSP, terminationStatus, trace))
     {
@@ -144,6 +245,8 @@ int main(int argc, char *argv[])
         #define VMX20_DIVIDE_BY_ZERO -5
         #define VMX20_ADDRESS_OUT_OF_RANGE -6
         #define VMX20_ILLEGAL_INSTRUCTION -7
+        #define VMX20_BUDGET_EXCEEDED -8
+        #define VMX20_REPLAY_DIVERGED -9
      */
     for (int i = 0; i < processors; i++)
     {
@@ -161,6 +264,12 @@ int main(int argc, char *argv[])
                 case VMX20_ILLEGAL_INSTRUCTION:
                     fprintf(stderr, "(illegal instruction)\n");
                     break;
+                case VMX20_BUDGET_EXCEEDED:
+                    fprintf(stderr, "(budget exceeded)\n");
+                    break;
+                case VMX20_REPLAY_DIVERGED:
+                    fprintf(stderr, "(replay diverged)\n");
+                    break;
                 default:
                     fprintf(stderr, "(unknown)\n");
             }
@@ -180,10 +289,33 @@ int main(int argc, char *argv[])
             if (result == 0) {failAddr(argv[i]); continue;}
             result = getWord(handle, addr, &wordx);
             if (result == 0) {failGet(addr); continue;}
-            printf("[%.3x] %16s: 0x%.8x %10d %8f\n", addr, argv[i], wordx, wordx, *(float*)&wordx);
+            float wordf;
+            memcpy(&wordf, &wordx, sizeof(wordf));
+            printf("[%.3x] %16s: 0x%.8x %10d %8f\n", addr, argv[i], wordx, wordx, wordf);
+        }
+    }
+
+    if (printStats) {
+        printf("================== SUPERINSTRUCTIONS =================\n");
+        char *name;
+        uint64_t hits;
+        for (uint32_t i = 0; getSuperinstructionStats(handle, i, &name, &hits); i++)
+        {
+            printf("%-24s %12llu\n", name, (unsigned long long)hits);
         }
     }
 
+    if (profile) {
+        printf("======================= PROFILE ======================\n");
+        printProfile(handle, stdout);
+    }
+
+    if (foldedFile) {
+        FILE *fp = fopen(foldedFile, "w");
+        if (!fp || !printFoldedStacks(handle, fp)) fprintf(stderr, "Can not write %s\n", foldedFile);
+        if (fp) fclose(fp);
+    }
+
     #if (TEST_DISASSEMBLE)
     int _r = testDisassemble(handle, argv[1]);
     if (_r)
@@ -0,0 +1,92 @@
+#include "vmx20.h"
+#include "vmx20_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// decoder for binary vmx20 traces
+//   usage: ./tracex20 <trace file> <executable>
+//   prints the trace in the format of a printed (-t) trace. the executable
+//   that was traced is needed to disassemble the instructions.
+
+#define PC 15
+
+static void failRead(char *filename)
+{
+    fprintf(stderr, "%s: truncated or not a vmx20 trace\n", filename);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: ./tracex20 <trace file> <executable>\n");
+        exit(1);
+    }
+
+    FILE *in = fopen(argv[1], "rb");
+    if (!in)
+    {
+        perror(argv[1]);
+        exit(1);
+    }
+    int32_t err = 0;
+    void *handle = initVm(&err);
+    if (err)
+    {
+        fprintf(stderr, "Failed to initialize vm.\n");
+        exit(err);
+    }
+    if (!loadExecutableFile(handle, argv[2], &err))
+    {
+        fprintf(stderr, "Fatal error: exiting with code %d\n", err);
+        exit(err);
+    }
+
+    trace_header_t header;
+    while (fread(&header, sizeof(header), 1, in) == 1)
+    {
+        if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+                || header.recordSize != sizeof(trace_record_t)
+                || header.numProcessors > VMX20_MAX_PROCESSORS)
+        {
+            failRead(argv[1]);
+        }
+        // registers of each core as of its last record
+        int32_t reg[VMX20_MAX_PROCESSORS][16];
+        memcpy(reg, header.reg, sizeof(reg));
+
+        trace_record_t rec;
+        while (1)
+        {
+            if (fread(&rec, sizeof(rec), 1, in) != 1) failRead(argv[1]);
+            if (rec.core == TRACE_END) break;
+            if (rec.core >= header.numProcessors) failRead(argv[1]);
+
+            int32_t *r = reg[rec.core];
+            r[PC] = rec.pc;
+            for (int i = 0; i < 2; i++)
+            {
+                if (rec.reg[i] != TRACE_NO_REG) r[rec.reg[i] & 15] = rec.value[i];
+            }
+
+            printf("Core %d\n", rec.core);
+            for (int i = 0; i < 16; i++)
+            {
+                printf("%.8x ", r[i]);
+                if (i == 7) printf("\n");
+            }
+            // disassemble the word as it was when it was executed
+            char buffer[100] = "";
+            putWord(handle, rec.pc, rec.word);
+            disassemble(handle, rec.pc, buffer, &err);
+            printf("\n%s\n\n", buffer);
+        }
+    }
+    if (!feof(in)) failRead(argv[1]);
+
+    fclose(in);
+    cleanup(handle);
+    return 0;
+}
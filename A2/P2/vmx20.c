@@ -1,129 +1,132 @@
+#define _GNU_SOURCE    // pthread_setaffinity_np
 #include "vmx20.h"
 #include "vmx20_macros.h"
+#include "vmx20_internal.h"
 
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#endif
 
 #define DEBUG 0
 
-#define FP 13
-#define SP 14
-#define PC 15
-#define MEM_SIZE 0xfffff / sizeof(int32_t)    // 1_048_575 bytes; 1MB
-#define HALT 0x1f
-
-typedef struct Symbol {
+static const struct {
     char *name;
-    void *next;
-    int32_t address;
-} sym_t;
-
-// VM shouldn't have registers at all; should all be in Core
-struct VM {
-    int32_t reg[16];    // registers
-    int32_t *memory;    // main memory
-                        // memory[0] is where program is loaded
-    uint32_t entryPoint;   // where execution should begin
-    uint32_t progEnd;      // end of program (memory[n] < prog_end is program)
-    int numProcessors;     // number of processors (set on execute())
-    int trace;             // whether to trace execution or not
-    
-    pthread_mutex_t *traceLock;
-    pthread_mutex_t *memLock;
+    int length;
+    uint8_t ops[3];
+} superinstructions[VMX20_NUM_SUPERINSTRUCTIONS] = {
+    {"ldimm+cmpxchg+beq", 3, {INS_LDIMM, INS_CMPXCHG, INS_BEQ}},
+    {"load+addi+store",   3, {INS_LOAD, INS_ADDI, INS_STORE}},
+    {"subi+bgt",          2, {INS_SUBI, INS_BGT}},
+    {"float loop",        0, {INS_BEQ}},    // any length, see vmx20_loops.c
+};
 
-    sym_t *symbols;     // linked list of the insymbols
+// name and operand format of every opcode; unnamed ones are invalid
+static const struct {
+    char *name;
+    char format;
+} opcodes[256] = {
+    [INS_HALT]      = {"halt",    F_OP},
+    [INS_LOAD]      = {"load",    F_REGADDR},
+    [INS_STORE]     = {"store",   F_REGADDR},
+    [INS_LDIMM]     = {"ldimm",   F_REGCONST},
+    [INS_LDADDR]    = {"ldaddr",  F_REGADDR},
+    [INS_LDIND]     = {"ldind",   F_REGOFF},
+    [INS_STIND]     = {"stind",   F_REGOFF},
+    [INS_ADDF]      = {"addf",    F_REGREG},
+    [INS_SUBF]      = {"subf",    F_REGREG},
+    [INS_DIVF]      = {"divf",    F_REGREG},
+    [INS_MULF]      = {"mulf",    F_REGREG},
+    [INS_ADDI]      = {"addi",    F_REGREG},
+    [INS_SUBI]      = {"subi",    F_REGREG},
+    [INS_DIVI]      = {"divi",    F_REGREG},
+    [INS_MULI]      = {"muli",    F_REGREG},
+    [INS_CALL]      = {"call",    F_ADDR},
+    [INS_RET]       = {"ret",     F_OP},
+    [INS_BLT]       = {"blt",     F_REGREGADDR},
+    [INS_BGT]       = {"bgt",     F_REGREGADDR},
+    [INS_BEQ]       = {"beq",     F_REGREGADDR},
+    [INS_JMP]       = {"jmp",     F_ADDR},
+    [INS_CMPXCHG]   = {"cmpxchg", F_REGREGADDR},
+    [INS_GETPID]    = {"getpid",  F_REG},
+    [INS_GETPN]     = {"getpn",   F_REG},
+    [INS_PUSH]      = {"push",    F_REG},
+    [INS_POP]       = {"pop",     F_REG},
+    [INS_NOP]       = {"NOP",     F_OP},
 };
 
-typedef struct Core {
-    int32_t reg[16];    // registers
-    uint32_t stack;     // memory addr of bottom of stack
-    //uint32_t stackSize;   // size of stack
-    struct VM *vm;      // vm handle
-    int status;         // terminationStatus
-    int pid;             // getpid instr return value
-} core_t;
+char* op_name(unsigned char op)
+{
+    return opcodes[op].name ? opcodes[op].name : "unknown";
+}
+
+static char op_format(unsigned char op)
+{
+    return opcodes[op].name ? opcodes[op].format : F_INVALID;
+}
 
-static char* op_name(unsigned char op)
+static void printTrace(void *core)
 {
-    switch(op)
+    core_t *cpu = core;
+    pthread_mutex_lock(cpu->vm->traceLock);
+    printf("Core %d\n", cpu->pid);
+    for (int i = 0; i < 16; i++)
     {
-        case INS_HALT:
-            return "halt";
+        printf("%.8x ", cpu->reg[i]);
+        if (i == 7) printf("\n");
+    }
+    //pthread_mutex_unlock(cpu->vm->traceLock);
+    char buffer[100];
+    int err = 0;
+    disassemble(cpu->vm, cpu->reg[PC], buffer, &err);
+    //pthread_mutex_lock(cpu->vm->traceLock);
+    printf("\n%s\n\n", buffer);
+    pthread_mutex_unlock(cpu->vm->traceLock);
+}
+
+// decode a single word located at the given address
+static void decodeWord(int32_t word, uint32_t address, dop_t *out)
+{
+    uint32_t next = address + 1;    // pc-relative operands are relative to this
+    out->op = word & 0xff;
+    out->base = out->op;
+    out->r1 = word >> 8 & 0xf;
+    out->r2 = word >> 12 & 0xf;
+    out->arg = 0;
+    switch (out->op)
+    {
+        case INS_LDIMM:
+            out->arg = EXTENDSIGN20(word >> 12);
+            break;
         case INS_LOAD:
-            return "load";
         case INS_STORE:
-            return "store";
-        case INS_LDIMM:
-            return "ldimm";
         case INS_LDADDR:
-            return "ldaddr";
+        case INS_CALL:
+        case INS_JMP:
+            out->arg = next + EXTENDSIGN20(word >> 12);
+            break;
         case INS_LDIND:
-            return "ldind";
         case INS_STIND:
-            return "stind";
-        case INS_ADDF:
-            return "addf";
-        case INS_SUBF:
-            return "subf";
-        case INS_DIVF:
-            return "divf";
-        case INS_MULF:
-            return "mulf";
-        case INS_ADDI:
-            return "addi";
-        case INS_SUBI:
-            return "subi";
-        case INS_DIVI:
-            return "divi";
-        case INS_MULI:
-            return "muli";
-        case INS_CALL:
-            return "call";
-        case INS_RET:
-            return "ret";
+            out->arg = EXTENDSIGN16(word >> 16);
+            break;
         case INS_BLT:
-            return "blt";
         case INS_BGT:
-            return "bgt";
         case INS_BEQ:
-            return "beq";
-        case INS_JMP:
-            return "jmp";
         case INS_CMPXCHG:
-            return "cmpxchg";
-        case INS_GETPID:
-            return "getpid";
-        case INS_GETPN:
-            return "getpn";
-        case INS_PUSH:
-            return "push";
-        case INS_POP:
-            return "pop";
-        case INS_NOP:
-            return "NOP";
-        case INS_INVALID:
-        default:
-            return "unknown";
-    }
-}
-static char op_format(unsigned char op)
-{
-    switch(op)
-    {
+            out->arg = next + EXTENDSIGN16(word >> 16);
+            break;
         case INS_HALT:
-            return F_OP;
-        case INS_LOAD:
-        case INS_STORE:
-            return F_REGADDR;
-        case INS_LDIMM:
-            return F_REGCONST;
-        case INS_LDADDR:
-            return F_REGADDR;
-        case INS_LDIND:
-        case INS_STIND:
-            return F_REGOFF;
         case INS_ADDF:
         case INS_SUBF:
         case INS_DIVF:
@@ -132,65 +135,396 @@ static char op_format(unsigned char op)
         case INS_SUBI:
         case INS_DIVI:
         case INS_MULI:
-            return F_REGREG;
-        case INS_CALL:
-            return F_ADDR;
         case INS_RET:
-            return F_OP;
-        case INS_BLT:
-        case INS_BGT:
-        case INS_BEQ:
-            return F_REGREGADDR;
-        case INS_JMP:
-            return F_ADDR;
-        case INS_CMPXCHG:
-            return F_REGREGADDR;
         case INS_GETPID:
         case INS_GETPN:
         case INS_PUSH:
         case INS_POP:
-            return F_REG;
-        case INS_NOP:
-            return F_OP;
-        case INS_INVALID:
+            break;
         default:
-            return F_INVALID;
+            // includes NOP, which the interpreter does not execute
+            out->op = INS_INVALID;
+            out->base = INS_INVALID;
+            break;
     }
 }
 
-static void printTrace(void *core)
+// whether a decoded instruction names the PC as an operand
+static int usesPc(const dop_t *ins)
 {
-    core_t *cpu = core;
-    pthread_mutex_lock(cpu->vm->traceLock);
-    printf("Core %d\n", cpu->pid);
-    for (int i = 0; i < 16; i++)
+    switch (op_format(ins->base))
     {
-        printf("%.8x ", cpu->reg[i]);
-        if (i == 7) printf("\n");
+        case F_REG:
+        case F_REGCONST:
+        case F_REGADDR:
+            return ins->r1 == PC;
+        case F_REGREG:
+        case F_REGOFF:
+        case F_REGREGADDR:
+            return ins->r1 == PC || ins->r2 == PC;
+        default:
+            return 0;
     }
-    //pthread_mutex_unlock(cpu->vm->traceLock);
-    char buffer[100];
-    int err = 0;
-    disassemble(cpu->vm, cpu->reg[PC], buffer, &err);
-    //pthread_mutex_lock(cpu->vm->traceLock);
-    printf("\n%s\n\n", buffer);
-    pthread_mutex_unlock(cpu->vm->traceLock);
+}
+
+// mark the heads of the enabled superinstruction sequences
+//   sequences that touch the PC register are left alone because the
+//   fused handlers do not update it between the instructions
+static void fuseCode(dop_t *code, uint32_t codeEnd, uint32_t siMask)
+{
+    for (uint32_t i = 0; i < codeEnd; i++)
+    {
+        if (IS_SUPER(code[i].op)) code[i].op = code[i].base;
+    }
+    for (uint32_t i = 0; i < codeEnd; i++)
+    {
+        for (int k = 0; k < VMX20_NUM_SUPERINSTRUCTIONS; k++)
+        {
+            int len = superinstructions[k].length;
+            if (!(siMask & (1u << k)) || i + len > codeEnd) continue;
+            if (len == 0)
+            {
+                if (code[i].op != INS_BEQ || !(len = floatLoopLength(code, i, codeEnd))) continue;
+                code[i].op = SI_FIRST + k;
+                i += len - 1;
+                break;
+            }
+            int j;
+            for (j = 0; j < len; j++)
+            {
+                dop_t *ins = &code[i + j];
+                if (ins->op != superinstructions[k].ops[j] || usesPc(ins)) break;
+            }
+            if (j < len) continue;
+            code[i].op = SI_FIRST + k;
+            i += len - 1;
+            break;
+        }
+    }
+}
+
+// mark the words that can be reached from entry by falling through,
+//   branching and calling. returns 0 if that does not tell code from data:
+//   a program that names the PC as an operand may jump anywhere
+static int markReachable(const dop_t *code, uint32_t numWords, uint32_t entry, uint8_t *reached)
+{
+    // every word is pending at most once
+    uint32_t *pending = malloc(sizeof(uint32_t) * (numWords ? numWords : 1));
+    if (!pending) return 0;
+    uint32_t n = 0;
+    if (entry < numWords)
+    {
+        reached[entry] = 1;
+        pending[n++] = entry;
+    }
+    int known = 1;
+    while (n && known)
+    {
+        const dop_t *ins = &code[pending[--n]];
+        uint32_t next[2] = {pending[n] + 1, (uint32_t)ins->arg};
+        int count = 1;
+        if (usesPc(ins)) known = 0;
+        switch (ins->op)
+        {
+            case INS_HALT:
+            case INS_RET:
+            case INS_POP:
+            case INS_INVALID:
+                count = 0;
+                break;
+            case INS_JMP:
+                next[0] = ins->arg;
+                break;
+            case INS_CALL:
+            case INS_BLT:
+            case INS_BGT:
+            case INS_BEQ:
+                count = 2;
+                break;
+        }
+        for (int k = 0; k < count; k++)
+        {
+            if (next[k] >= numWords || reached[next[k]]) continue;
+            reached[next[k]] = 1;
+            pending[n++] = next[k];
+        }
+    }
+    free(pending);
+    return known;
+}
+
+// decode a whole program
+//   words that can not be reached from entry are data and are left
+//   undecoded, so storing into them leaves the decoded program alone; if
+//   one is executed after all it is decoded from memory like an
+//   overwritten instruction. returns NULL if out of memory
+dop_t *decodeProgram(const int32_t *words, uint32_t numWords, uint32_t entry, uint32_t siMask)
+{
+    dop_t *code = malloc(sizeof(dop_t) * (numWords ? numWords : 1));
+    uint8_t *reached = calloc(numWords ? numWords : 1, sizeof(uint8_t));
+    if (!code || !reached)
+    {
+        free(code);
+        free(reached);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < numWords; i++)
+    {
+        decodeWord(words[i], i, &code[i]);
+    }
+    if (markReachable(code, numWords, entry, reached))
+    {
+        for (uint32_t i = 0; i < numWords; i++)
+        {
+            if (!reached[i]) code[i].op = OP_UNDECODED;
+        }
+    }
+    free(reached);
+    fuseCode(code, numWords, siMask);
+    return code;
+}
+
+// give the vm its own copy of the decoded program of its image
+//   called before the first write into the decoded program. if there is
+//   no memory for a copy the vm stops using the decoded program at all.
+void privatizeCode(struct VM *vm)
+{
+    pthread_mutex_lock(vm->codeLock);
+    if (vm->codeShared)
+    {
+        if (__atomic_load_n(&vm->image->refs, __ATOMIC_ACQUIRE) == 1)
+        {
+            // nobody else can attach to the image any more; take its copy
+            vm->image->code = NULL;
+        }
+        else
+        {
+            dop_t *copy = malloc(sizeof(dop_t) * (vm->codeEnd ? vm->codeEnd : 1));
+            if (copy)
+            {
+                memcpy(copy, vm->code, sizeof(dop_t) * vm->codeEnd);
+                __atomic_store_n(&vm->code, copy, __ATOMIC_RELEASE);
+            }
+            else
+            {
+                // stays shared, but no longer used
+                __atomic_store_n(&vm->codeEnd, 0, __ATOMIC_RELEASE);
+                pthread_mutex_unlock(vm->codeLock);
+                return;
+            }
+        }
+        __atomic_store_n(&vm->codeShared, 0, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(vm->codeLock);
+}
+
+// free the cores left over from a suspended execution
+static void dropSuspended(struct VM *vm)
+{
+    for (int i = 0; i < VMX20_MAX_PROCESSORS; i++)
+    {
+        if (!vm->cores[i]) continue;
+        profileDestroy(vm->cores[i]->profile);
+        free(vm->cores[i]);
+        vm->cores[i] = NULL;
+    }
+}
+
+// drop the decoded and compiled copies of the current program
+static void releaseCode(struct VM *vm)
+{
+    jitDestroy(vm);
+    if (!vm->codeShared) free(vm->code);
+    if (vm->image) cleanupImage(vm->image);
+    vm->image = NULL;
+    vm->codeShared = 0;
+    vm->code = NULL;
+    vm->codeEnd = 0;
+}
+
+// re-fuse the decoded program after siMask changed
+static void fuseProgram(struct VM *vm)
+{
+    if (vm->codeShared) privatizeCode(vm);
+    fuseCode(vm->code, vm->codeEnd, vm->siMask);
+}
+
+// decode the word at addr straight from memory into the scratch entry
+static const dop_t *decodeFromMemory(struct VM *vm, uint32_t addr, dop_t *scratch)
+{
+    if (addr >= vm->memSize)
+    {
+        scratch->op = OP_BADFETCH;
+        return scratch;
+    }
+    decodeWord(__atomic_load_n(&vm->memory[addr], __ATOMIC_RELAXED), addr, scratch);
+    return scratch;
+}
+
+// get the decoded instruction at addr
+//   past the end of the program the word is decoded from memory; an entry
+//   inside the program may come back as OP_UNDECODED, in which case the
+//   dispatcher falls back to decodeFromMemory
+static inline const dop_t *fetchDecoded(struct VM *vm, uint32_t addr, dop_t *scratch)
+{
+    // both may change under a running core when a shared program is copied
+    if (addr < __atomic_load_n(&vm->codeEnd, __ATOMIC_RELAXED))
+        return &__atomic_load_n(&vm->code, __ATOMIC_RELAXED)[addr];
+    return decodeFromMemory(vm, addr, scratch);
+}
+
+// memory access
+//   in the relaxed model ordinary words are accessed with single atomic
+//   loads and stores and cmpxchg is a hardware compare-and-swap, so cores
+//   never wait on each other. in the strict model every instruction that
+//   touches memory additionally holds memLock for its whole duration,
+//   which makes execution sequentially consistent (useful for debugging).
+static inline void memAcquire(core_t *cpu)
+{
+    if (cpu->vm->memoryModel != VMX20_MEMORY_STRICT) return;
+    if (cpu->profile)
+    {
+        if (pthread_mutex_trylock(cpu->vm->memLock) == 0) return;
+        cpu->profile->lockWaits++;
+    }
+    pthread_mutex_lock(cpu->vm->memLock);
+}
+
+static inline void memRelease(core_t *cpu)
+{
+    if (cpu->vm->memoryModel == VMX20_MEMORY_STRICT) pthread_mutex_unlock(cpu->vm->memLock);
+}
+
+// engine selected by the VMX20_ENGINE environment variable
+//   ("switch", "threaded" or "jit"), threaded where it is supported otherwise
+static int defaultEngine(void)
+{
+    char *env = getenv("VMX20_ENGINE");
+    if (env && strcmp(env, "switch") == 0) return VMX20_ENGINE_SWITCH;
+    if (env && strcmp(env, "threaded") == 0) return VMX20_ENGINE_THREADED;
+#if defined(__x86_64__)
+    if (env && strcmp(env, "jit") == 0) return VMX20_ENGINE_JIT;
+#endif
+#if defined(__GNUC__)
+    return VMX20_ENGINE_THREADED;
+#else
+    return VMX20_ENGINE_SWITCH;
+#endif
+}
+
+// block entries before a block is compiled, from VMX20_JIT_THRESHOLD
+static uint32_t defaultJitThreshold(void)
+{
+    char *env = getenv("VMX20_JIT_THRESHOLD");
+    if (env) return strtoul(env, NULL, 0);
+    return 16;
+}
+
+// memory model selected by the VMX20_MEMORY environment variable
+//   ("relaxed" or "strict"), relaxed by default
+static int defaultMemoryModel(void)
+{
+    char *env = getenv("VMX20_MEMORY");
+    if (env && strcmp(env, "strict") == 0) return VMX20_MEMORY_STRICT;
+    return VMX20_MEMORY_RELAXED;
+}
+
+// scheduler selected by the VMX20_SCHEDULE environment variable
+//   ("threads" or "deterministic"), threads by default
+static int defaultScheduler(void)
+{
+    char *env = getenv("VMX20_SCHEDULE");
+    if (env && strcmp(env, "deterministic") == 0) return VMX20_SCHEDULE_DETERMINISTIC;
+    return VMX20_SCHEDULE_THREADS;
+}
+
+// instructions per turn of the deterministic scheduler
+#define DEFAULT_QUANTUM 10000
+
+// seed of the deterministic scheduler, from VMX20_SEED
+static uint32_t defaultSeed(void)
+{
+    char *env = getenv("VMX20_SEED");
+    if (env) return strtoul(env, NULL, 0);
+    return 0;
+}
+
+// superinstructions enabled by the VMX20_SUPERINSTRUCTIONS environment
+//   variable (a bit mask, see setSuperinstructions), all by default
+static uint32_t defaultSuperinstructions(void)
+{
+    char *env = getenv("VMX20_SUPERINSTRUCTIONS");
+    if (env) return strtoul(env, NULL, 0);
+    return (1u << VMX20_NUM_SUPERINSTRUCTIONS) - 1;
 }
 
 void* initVm(int32_t *errorNumber)
+{
+    return initVmEx(VMX20_DEFAULT_MEMORY, errorNumber);
+}
+
+void* initVmEx(uint32_t memoryWords, int32_t *errorNumber)
 {   // allocate memory
+    if (memoryWords == 0 || memoryWords > VMX20_MAX_MEMORY)
+    {
+        *errorNumber = VMX20_INITIALIZE_FAILURE;
+        return NULL;
+    }
     struct VM *vm = malloc(sizeof(struct VM));
     if (!vm) {*errorNumber = VMX20_INITIALIZE_FAILURE; return NULL;}
-    vm->memory = malloc(sizeof(int32_t) * MEM_SIZE);
-    if (!vm->memory) {*errorNumber = VMX20_INITIALIZE_FAILURE; free(vm); return NULL;}
+    // pages are only backed once they are touched, and they come zeroed
+    vm->memSize = memoryWords;
+    vm->memory = mmap(NULL, sizeof(int32_t) * (size_t)memoryWords, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (vm->memory == MAP_FAILED) {*errorNumber = VMX20_INITIALIZE_FAILURE; free(vm); return NULL;}
     // initialize all registers to 0
     for (int i = 0; i < 16; i++)
     {
         vm->reg[i] = 0;
     }
+    vm->engine = defaultEngine();
+    vm->jit = NULL;
+    vm->jitThreshold = defaultJitThreshold();
+    vm->memoryModel = defaultMemoryModel();
+    vm->scheduler = defaultScheduler();
+    vm->quantum = DEFAULT_QUANTUM;
+    vm->seed = defaultSeed();
+    vm->budget = 0;
+    vm->timeLimit = 0;
+    vm->deadline = 0;
+    vm->executed = 0;
+    vm->numStackWords = 0;
+    vm->stackGuard = 0;
+    vm->numGuards = 0;
+    vm->numAffinity = 0;
+    vm->spinWaiters = 0;
+    memset(vm->spinWaiting, 0, sizeof(vm->spinWaiting));
+    vm->siMask = defaultSuperinstructions();
+    memset(vm->siHits, 0, sizeof(vm->siHits));
+    vm->traceFile = NULL;
+    vm->tracer = NULL;
+    vm->suspendRequested = 0;
+    memset(vm->cores, 0, sizeof(vm->cores));
+    memset(vm->status, 0, sizeof(vm->status));
+    vm->watches = NULL;
+    vm->numWatches = 0;
+    vm->nextWatch = 0;
+    vm->watchPages = NULL;
+    vm->watchHit = 0;
+    vm->replay = NULL;
+    vm->profiling = 0;
+    vm->profiledCores = 0;
+    vm->symbols = NULL;
+    vm->symbolIndex = NULL;
+    vm->code = NULL;
+    vm->codeEnd = 0;
+    vm->codeShared = 0;
+    vm->image = NULL;
+    vm->progEnd = 0;
     // init mutexes
     vm->traceLock = malloc(sizeof(pthread_mutex_t));
     vm->memLock = malloc(sizeof(pthread_mutex_t));
+    vm->codeLock = malloc(sizeof(pthread_mutex_t));
     if (pthread_mutex_init(vm->traceLock, NULL))
     {
         fprintf(stderr, "Failed to init mutex.\n");
@@ -201,424 +535,1193 @@ void* initVm(int32_t *errorNumber)
         fprintf(stderr, "Failed to init mutex.\n");
         exit(50);
     }
+    if (pthread_mutex_init(vm->codeLock, NULL))
+    {
+        fprintf(stderr, "Failed to init mutex.\n");
+        exit(50);
+    }
 
     *errorNumber = VMX20_NORMAL_TERMINATION;
     return vm;
 }
 
-int32_t loadExecutableFile(void *handle, char *filename, int32_t *errorNumber)
+void *loadImage(char *filename, int32_t *errorNumber)
 {   // verify .exe file
     /*char* filetype = strstr(filename, ".exe");
     if (!filetype || *(filetype + 4) != '\0') return (*errorNumber = VMX20_FILE_IS_NOT_VALID) & 0;*/
-    // open file
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) return (*errorNumber = VMX20_FILE_NOT_FOUND) & 0;
-    // convert handle
-    struct VM *vm = handle;
-    if (!handle) return (*errorNumber = -99) & fclose(fp) & 0;
+    // open and map the file; it is never copied as a whole
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {*errorNumber = VMX20_FILE_NOT_FOUND; return NULL;}
+    image_t *image = calloc(1, sizeof(image_t));
+    if (!image) {*errorNumber = VMX20_INITIALIZE_FAILURE; close(fd); return NULL;}
+    image->refs = 1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 12)
+    {
+        close(fd);
+        *errorNumber = VMX20_FILE_IS_NOT_VALID;
+        goto fail;
+    }
+    image->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping keeps the file
+    close(fd);
+    if (image->map == MAP_FAILED)
+    {
+        image->map = NULL;
+        *errorNumber = VMX20_INITIALIZE_FAILURE;
+        goto fail;
+    }
+    image->mapSize = st.st_size;
 
     // get section lengths
-    int32_t lengths[3] = {0, 0, 0};
-    fread(&lengths[0], sizeof(int32_t), 3, fp);
+    const int32_t *lengths = image->map;
     if (DEBUG) printf("lengths %d %d %d\n", lengths[0], lengths[1], lengths[2]);
     // if outsymbol section: fatal error
-    if (lengths[1] != 0) return (*errorNumber = VMX20_FILE_CONTAINS_OUTSYMBOLS) & fclose(fp) & 0;
-    // read insymbols into vm symbol table
-    int32_t *symbuffer = malloc(sizeof(int32_t) * lengths[0]);
-    fseek(fp, 12, SEEK_SET);
-    fread(symbuffer, sizeof(int32_t), lengths[0], fp);
-
-    // load program into memory (starts at 0)
-    fseek(fp, 12 + ((lengths[0] + lengths[1]) * sizeof(int32_t)), SEEK_SET);
-    size_t wordsRead = fread(vm->memory, sizeof(int32_t), lengths[2], fp);
-    // set prog_end to end of instructions
-    vm->progEnd = wordsRead;
-    // verify bytesRead == fileLength
-    if (wordsRead != lengths[2]) {free(symbuffer); return (*errorNumber = VMX20_FILE_IS_NOT_VALID) & fclose(fp) & 0;}
-    fclose(fp);
+    if (lengths[1] != 0) {*errorNumber = VMX20_FILE_CONTAINS_OUTSYMBOLS; goto fail;}
+    if (lengths[0] < 0 || lengths[0] % 5 != 0 || lengths[2] < 0 || lengths[2] > VMX20_MAX_MEMORY)
+    {
+        *errorNumber = VMX20_FILE_IS_NOT_VALID;
+        goto fail;
+    }
+    // the sections have to be in the file
+    uint64_t end = 12 + sizeof(int32_t) * ((uint64_t)lengths[0] + lengths[2]);
+    if (end > image->mapSize) {*errorNumber = VMX20_FILE_IS_NOT_VALID; goto fail;}
+    image->words = (int32_t *)((char *)image->map + 12 + sizeof(int32_t) * lengths[0]);
+    image->numWords = lengths[2];
 
-    // parse insymbols
-    int32_t *ptr = symbuffer;
+    // parse insymbols, keeping the order of the file
+    uint32_t numSymbols = lengths[0] / 5;
+    sym_t *symbols = calloc(numSymbols ? numSymbols : 1, sizeof(sym_t));
+    if (!symbols) {*errorNumber = VMX20_INITIALIZE_FAILURE; goto fail;}
+    image->symbols = numSymbols ? symbols : NULL;
+    if (!numSymbols) free(symbols);
+    const int32_t *ptr = lengths + 3;
     char mainFound = 0;
-    for (int t = 0; t < lengths[0]; t += 5)
+    for (uint32_t t = 0; t < numSymbols; t++)
     {
-        sym_t *symbol = malloc(sizeof(sym_t));
-        symbol->name = calloc(16, sizeof(char));
-        strcpy(symbol->name, (char*)ptr);
+        // names use up to 16 bytes and are not terminated if they use all
+        sym_t *symbol = &symbols[t];
+        symbol->name = (char *)ptr;
         symbol->address = *(ptr + 4);
-        symbol->next = vm->symbols;
-        vm->symbols = symbol;
+        symbol->next = t + 1 < numSymbols ? &symbols[t + 1] : NULL;
 
-        if (strcmp(symbol->name, "mainx20") == 0)
+        if (strncmp(symbol->name, "mainx20", 16) == 0)
         {
-            if (mainFound) {free(symbuffer); *errorNumber = VMX20_FILE_IS_NOT_VALID; return 0;}
-            // set pc to address
-            vm->entryPoint = symbol->address;
+            if (mainFound) {*errorNumber = VMX20_FILE_IS_NOT_VALID; goto fail;}
+            image->entryPoint = symbol->address;
             mainFound = 1;
         }
 
-        if (DEBUG) printf("Insymbol %s at %x\n", symbol->name, symbol->address);
+        if (DEBUG) printf("Insymbol %.16s at %x\n", symbol->name, symbol->address);
         ptr += 5;
     }
 
-    free(symbuffer);
+    if (!mainFound) {*errorNumber = VMX20_FILE_IS_NOT_VALID; goto fail;}
+
+    image->siMask = defaultSuperinstructions();
+    image->code = decodeProgram(image->words, image->numWords, image->entryPoint, image->siMask);
+    if (!image->code) {*errorNumber = VMX20_INITIALIZE_FAILURE; goto fail;}
+    *errorNumber = VMX20_NORMAL_TERMINATION;
+    return image;
+
+fail:
+    cleanupImage(image);
+    return NULL;
+}
+
+void cleanupImage(void *handle)
+{
+    image_t *image = handle;
+    if (!image || __atomic_sub_fetch(&image->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    free(image->symbols);   // one array
+    free(image->code);
+    if (image->map) munmap(image->map, image->mapSize);
+    free(image);
+}
 
-    if (!mainFound)
+static void freeSymbols(struct VM *vm)
+{
+    symbolsClear(vm);
+    while (vm->symbols)
     {
-        *errorNumber = VMX20_FILE_IS_NOT_VALID;
-        return 0;
+        sym_t *cur = vm->symbols;
+        vm->symbols = cur->next;
+        free(cur->name);
+        free(cur);
     }
-
-    return 1;
 }
-    
-int32_t getAddress(void *handle, char *label, uint32_t *outAddr)
+
+int32_t loadExecutableImage(void *handle, void *imageHandle, int32_t *errorNumber)
 {
     struct VM *vm = handle;
-    sym_t *cur = vm->symbols;
-    while (cur)
+    image_t *image = imageHandle;
+    if (!vm || !image) return (*errorNumber = -99) & 0;
+    // the program has to fit into memory
+    if (image->numWords > vm->memSize) return (*errorNumber = VMX20_FILE_IS_NOT_VALID) & 0;
+    // drop the decoded and compiled copies of any previous program
+    releaseCode(vm);
+
+    // load program into memory (starts at 0), straight from the mapped file
+    memcpy(vm->memory, image->words, sizeof(int32_t) * image->numWords);
+    // set prog_end to end of instructions
+    vm->progEnd = image->numWords;
+    vm->entryPoint = image->entryPoint;
+    // the symbols of a previous program go with it
+    freeSymbols(vm);
+    for (sym_t *cur = image->symbols; cur; cur = cur->next)
     {
-        if (strcmp(cur->name, label) == 0)
+        sym_t *symbol = malloc(sizeof(sym_t));
+        char *name = strndup(cur->name, 16);
+        if (!symbol || !name)
         {
-            // found!
-            *outAddr = cur->address;
-            return 1;
+            free(symbol);
+            free(name);
+            return (*errorNumber = VMX20_INITIALIZE_FAILURE) & 0;
         }
-        cur = cur->next;
+        symbol->name = name;
+        symbol->address = cur->address;
+        symbol->next = vm->symbols;
+        vm->symbols = symbol;
     }
-    // not found ):
-    return 0;
+
+    if (!symbolsBuild(vm)) return (*errorNumber = VMX20_INITIALIZE_FAILURE) & 0;
+
+    // run from the decoded program of the image until something writes to it
+    __atomic_add_fetch(&image->refs, 1, __ATOMIC_ACQ_REL);
+    vm->image = image;
+    vm->code = image->code;
+    vm->codeEnd = image->numWords;
+    vm->codeShared = 1;
+    if (vm->siMask != image->siMask) fuseProgram(vm);
+    *errorNumber = VMX20_NORMAL_TERMINATION;
+    return 1;
 }
 
-int32_t getWord(void *handle, uint32_t addr, int32_t *outWord)
+int32_t loadExecutableFile(void *handle, char *filename, int32_t *errorNumber)
 {
-    struct VM *vm = handle;
-    if (addr >= MEM_SIZE) return 0;
-    *outWord = vm->memory[addr];
-    return 1;
+    if (!handle) return (*errorNumber = -99) & 0;
+    void *image = loadImage(filename, errorNumber);
+    if (!image) return 0;
+    int32_t result = loadExecutableImage(handle, image, errorNumber);
+    cleanupImage(image);
+    return result;
 }
 
-int32_t putWord(void *handle, uint32_t addr, int32_t word)
+int32_t reloadExecutableImage(void *handle, void *imageHandle, int32_t *errorNumber)
 {
     struct VM *vm = handle;
-    if (addr >= MEM_SIZE) return 0;
-    vm->memory[addr] = word;
+    image_t *image = imageHandle;
+    if (!vm || !image) return (*errorNumber = -99) & 0;
+    if (image->numWords > vm->memSize) return (*errorNumber = VMX20_FILE_IS_NOT_VALID) & 0;
+    // nothing of the old program is left: its cores, code, counters and
+    //   watches, and what it wrote into memory
+    dropSuspended(vm);
+    unguardStacks(vm);
+    profileClear(vm);
+    watchClear(vm);
+    vm->watchHit = 0;
+    vm->executed = 0;
+    memset(vm->status, 0, sizeof(vm->status));
+    releaseCode(vm);
+    // fresh zero pages in the same place, backed again only once touched
+    if (mmap(vm->memory, sizeof(int32_t) * (size_t)vm->memSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+    {
+        return (*errorNumber = VMX20_INITIALIZE_FAILURE) & 0;
+    }
+    return loadExecutableImage(vm, image, errorNumber);
+}
+
+int32_t reloadExecutableFile(void *handle, char *filename, int32_t *errorNumber)
+{
+    if (!handle) return (*errorNumber = -99) & 0;
+    // the old program stays if the new one can not be read
+    void *image = loadImage(filename, errorNumber);
+    if (!image) return 0;
+    int32_t result = reloadExecutableImage(handle, image, errorNumber);
+    cleanupImage(image);
+    return result;
+}
+    
+int32_t getAddress(void *handle, char *label, uint32_t *outAddr)
+{
+    struct VM *vm = handle;
+    sym_t *cur = symbolsFind(vm, label);
+    if (!cur) return 0;
+    *outAddr = cur->address;
+    return 1;
+}
+
+int32_t getWord(void *handle, uint32_t addr, int32_t *outWord)
+{
+    if (inGuard(handle, addr, 1)) return 0;
+    return memLoad(handle, addr, outWord);
+}
+
+int32_t putWord(void *handle, uint32_t addr, int32_t word)
+{
+    if (inGuard(handle, addr, 1)) return 0;
+    return memStore(handle, addr, word);
+}
+
+// n words from addr are all in memory
+static int inMemory(struct VM *vm, uint32_t addr, uint32_t n)
+{
+    return vm && addr <= vm->memSize && n <= vm->memSize - addr && !inGuard(vm, addr, n);
+}
+
+int32_t getWords(void *handle, uint32_t addr, uint32_t n, int32_t *outWords)
+{
+    struct VM *vm = handle;
+    if (!inMemory(vm, addr, n)) return 0;
+    memcpy(outWords, &vm->memory[addr], sizeof(int32_t) * n);
+    return 1;
+}
+
+int32_t putWords(void *handle, uint32_t addr, uint32_t n, const int32_t *words)
+{
+    struct VM *vm = handle;
+    if (!inMemory(vm, addr, n)) return 0;
+    memcpy(&vm->memory[addr], words, sizeof(int32_t) * n);
+    // only words of the program can be decoded
+    uint32_t codeEnd = __atomic_load_n(&vm->codeEnd, __ATOMIC_RELAXED);
+    for (uint32_t i = addr; i < codeEnd && i - addr < n; i++) invalidateDecoded(vm, i);
+    return 1;
+}
+
+int32_t getMemoryView(void *handle, uint32_t addr, uint32_t n, int32_t **view)
+{
+    struct VM *vm = handle;
+    if (!inMemory(vm, addr, n)) return 0;
+    *view = &vm->memory[addr];
+    return 1;
+}
+
+// instruction handlers
+//   shared by the switch and the threaded engines so that both execute
+//   exactly the same semantics. handlers that may terminate the core return
+//   0 and set the termination code, the others cannot fail. tPC holds the
+//   address of the next instruction on entry.
+
+static inline int32_t opHalt(int32_t *termCode)
+{
+    *termCode = VMX20_NORMAL_TERMINATION;
+    return 0;
+}
+
+static inline void opLoad(core_t *cpu, const dop_t *ins)
+{
+    memAcquire(cpu);
+    memLoad(cpu->vm, ins->arg, &cpu->reg[ins->r1]);
+    memRelease(cpu);
+}
+
+static inline void opStore(core_t *cpu, const dop_t *ins)
+{
+    memAcquire(cpu);
+    memStore(cpu->vm, ins->arg, cpu->reg[ins->r1]);
+    memRelease(cpu);
+}
+
+static inline void opLdimm(core_t *cpu, const dop_t *ins)
+{   // ldimm and ldaddr; the address is resolved when decoding
+    cpu->reg[ins->r1] = ins->arg;
+}
+
+static inline int32_t opLdind(core_t *cpu, const dop_t *ins, int32_t *termCode)
+{
+    int32_t addr = ins->arg;
+    if ((uint64_t)cpu->reg[ins->r2] + addr >= cpu->vm->memSize) {
+        *termCode = VMX20_ADDRESS_OUT_OF_RANGE;
+        return 0;
+    }
+    memAcquire(cpu);
+    memLoad(cpu->vm, cpu->reg[ins->r2] + addr, &cpu->reg[ins->r1]);
+    memRelease(cpu);
+    return 1;
+}
+
+static inline int32_t opStind(core_t *cpu, const dop_t *ins, int32_t *termCode)
+{
+    int32_t addr = ins->arg;
+    if ((uint64_t)ins->r2 + addr >= cpu->vm->memSize) {
+        *termCode = VMX20_ADDRESS_OUT_OF_RANGE;
+        return 0;
+    }
+    memAcquire(cpu);
+    memStore(cpu->vm, cpu->reg[ins->r2] + addr, cpu->reg[ins->r1]);
+    memRelease(cpu);
+    return 1;
+}
+
+static inline void opAddf(core_t *cpu, const dop_t *ins)
+{
+    float r1f, r2f;
+    memcpy(&r1f, &cpu->reg[ins->r1], sizeof(int32_t));
+    memcpy(&r2f, &cpu->reg[ins->r2], sizeof(int32_t));
+    r1f = r1f + r2f;
+    memcpy(&cpu->reg[ins->r1], &r1f, sizeof(int32_t));
+}
+
+static inline void opSubf(core_t *cpu, const dop_t *ins)
+{
+    float r1f, r2f;
+    memcpy(&r1f, &cpu->reg[ins->r1], sizeof(int32_t));
+    memcpy(&r2f, &cpu->reg[ins->r2], sizeof(int32_t));
+    r1f = r1f - r2f;
+    memcpy(&cpu->reg[ins->r1], &r1f, sizeof(int32_t));
+}
+
+static inline int32_t opDivf(core_t *cpu, const dop_t *ins, int32_t *termCode)
+{
+    float r1f, r2f;
+    memcpy(&r1f, &cpu->reg[ins->r1], sizeof(int32_t));
+    memcpy(&r2f, &cpu->reg[ins->r2], sizeof(int32_t));
+    if (r2f == 0.0f) {
+        *termCode = VMX20_DIVIDE_BY_ZERO;
+        return 0;
+    }
+    r1f = r1f / r2f;
+    memcpy(&cpu->reg[ins->r1], &r1f, sizeof(int32_t));
+    return 1;
+}
+
+static inline void opMulf(core_t *cpu, const dop_t *ins)
+{
+    float r1f, r2f;
+    memcpy(&r1f, &cpu->reg[ins->r1], sizeof(int32_t));
+    memcpy(&r2f, &cpu->reg[ins->r2], sizeof(int32_t));
+    r1f = r1f * r2f;
+    memcpy(&cpu->reg[ins->r1], &r1f, sizeof(int32_t));
+}
+
+static inline void opAddi(core_t *cpu, const dop_t *ins)
+{
+    cpu->reg[ins->r1] = cpu->reg[ins->r1] + cpu->reg[ins->r2];
+}
+
+static inline void opSubi(core_t *cpu, const dop_t *ins)
+{
+    cpu->reg[ins->r1] = cpu->reg[ins->r1] - cpu->reg[ins->r2];
+}
+
+static inline int32_t opDivi(core_t *cpu, const dop_t *ins, int32_t *termCode)
+{
+    if (cpu->reg[ins->r2] == 0) {
+        *termCode = VMX20_DIVIDE_BY_ZERO;
+        return 0;
+    }
+    cpu->reg[ins->r1] = cpu->reg[ins->r1] / cpu->reg[ins->r2];
+    return 1;
+}
+
+static inline void opMuli(core_t *cpu, const dop_t *ins)
+{
+    cpu->reg[ins->r1] = cpu->reg[ins->r1] * cpu->reg[ins->r2];
+}
+
+// call, ret, push and pop check the stack pointer against the stack unless
+//   checked is 0 because guard pages around the stack catch it instead
+
+static inline int32_t opCall(core_t *cpu, const dop_t *ins, uint32_t *tPC, int32_t *termCode,
+        int checked)
+{
+    // check if sp is/will be be out of bounds
+    if (checked && (cpu->reg[SP] > cpu->stack || cpu->reg[SP] - 3 < cpu->stackLow))
+    {
+        // out of bounds
+        if (DEBUG) printf("<before> sp %d out of range\n", cpu->reg[SP]);
+        *termCode = VMX20_ADDRESS_OUT_OF_RANGE;
+        return 0;
+    }
+    // acquire memory lock first
+    memAcquire(cpu);
+    // push pc on the stack
+    cpu->reg[SP] -= 1;
+    memStore(cpu->vm, cpu->reg[SP], *tPC);
+    // push contents of fp register onto stack
+    *tPC = ins->arg;
+    cpu->reg[SP] -= 1;
+    memStore(cpu->vm, cpu->reg[SP], cpu->reg[FP]);
+    // assign contents of fp register to sp register
+    cpu->reg[FP] = cpu->reg[SP];
+    // push a zero on top of the stack
+    cpu->reg[SP] -= 1;
+    memStore(cpu->vm, cpu->reg[SP], 0);
+    // release memory lock
+    memRelease(cpu);
+    return 1;
+}
+
+static inline int32_t opRet(core_t *cpu, uint32_t *tPC, int32_t *termCode, int checked)
+{
+    int32_t word = INS_RET;     // what used to be left here if the read fails
+    // check if sp is/will be be out of bounds
+    if (checked && (cpu->reg[SP] + 3 > cpu->stack|| cpu->reg[SP] < cpu->stackLow))
+    {
+        // out of bounds
+        *termCode = VMX20_ADDRESS_OUT_OF_RANGE;
+        return 0;
+    }
+    // acquire memory lock
+    memAcquire(cpu);
+    // retrieve the return value
+    memLoad(cpu->vm, cpu->reg[SP], &word);              // returnValue
+    cpu->reg[SP] += 1;
+    // set FP
+    memLoad(cpu->vm, cpu->reg[SP], &cpu->reg[FP]);      // savedFP
+    cpu->reg[SP] += 1;
+    // set PC
+    memLoad(cpu->vm, cpu->reg[SP], (int32_t *)tPC);     // returnAddress
+    cpu->reg[SP] += 1;
+    // store return value
+    memStore(cpu->vm, cpu->reg[FP] - 1, word);
+    // release memory lock
+    memRelease(cpu);
+    return 1;
+}
+
+static inline void opBlt(core_t *cpu, const dop_t *ins, uint32_t *tPC)
+{
+    if (cpu->reg[ins->r1] < cpu->reg[ins->r2])
+    {
+        *tPC = ins->arg;
+    }
+}
+
+static inline void opBgt(core_t *cpu, const dop_t *ins, uint32_t *tPC)
+{
+    if (cpu->reg[ins->r1] > cpu->reg[ins->r2])
+    {
+        *tPC = ins->arg;
+    }
+}
+
+static inline void opBeq(core_t *cpu, const dop_t *ins, uint32_t *tPC)
+{
+    if (cpu->reg[ins->r1] == cpu->reg[ins->r2])
+    {
+        *tPC = ins->arg;
+    }
+}
+
+// spin-wait detection
+//   a core whose cmpxchg keeps failing on the same word with only a few
+//   instructions in between is spinning on a lock held by another core.
+//   after SPIN_THRESHOLD such failures it backs off so that the owner can
+//   run: cores without a thread of their own end their turn, the others
+//   yield the host cpu and then sleep on the word until it is stored to,
+//   for up to SPIN_MAX_NS. the stores of compiled code do not wake
+//   sleepers, so under the JIT engine cores only yield. so do cores with
+//   an instruction budget, which a sleeping core would hardly use up. a
+//   backoff also ends the slice, so that budget, deadline and suspendVm
+//   are checked after each one even if the lock is never released.
+#define SPIN_LOOP 16            // instructions between failures of a spin loop
+#define SPIN_THRESHOLD 4        // failures before backing off
+#define SPIN_YIELDS 4           // times to yield before sleeping
+#define SPIN_MIN_NS 10000       // first sleep, doubled every time
+#define SPIN_MAX_NS 1000000     // longest sleep; bounds a missed wake-up
+
+// sleep until the word at addr is stored to, if it still holds seen
+static void spinWait(struct VM *vm, uint32_t addr, int32_t seen, long ns)
+{
+#if defined(__linux__)
+    struct timespec timeout = {0, ns};
+    __atomic_add_fetch(&vm->spinWaiting[addr % SPIN_BUCKETS], 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&vm->spinWaiters, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &vm->memory[addr], FUTEX_WAIT_PRIVATE, seen, &timeout, NULL, 0);
+    __atomic_sub_fetch(&vm->spinWaiters, 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&vm->spinWaiting[addr % SPIN_BUCKETS], 1, __ATOMIC_SEQ_CST);
+#else
+    (void)vm; (void)addr; (void)seen; (void)ns;
+    sched_yield();
+#endif
+}
+
+// wake the cores sleeping on the word at addr after a store or exchange
+//   that changed it
+void spinWake(struct VM *vm, uint32_t addr)
+{
+#if defined(__linux__)
+    if (!__atomic_load_n(&vm->spinWaiting[addr % SPIN_BUCKETS], __ATOMIC_RELAXED)) return;
+    syscall(SYS_futex, &vm->memory[addr], FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+    (void)vm; (void)addr;
+#endif
+}
+
+// called after a failed cmpxchg on addr, which holds seen
+static void spinCheck(core_t *cpu, uint32_t addr, int32_t seen)
+{
+    if (addr != cpu->spinAddr || cpu->spinSlice - cpu->slice > SPIN_LOOP) cpu->spinCount = 0;
+    cpu->spinAddr = addr;
+    cpu->spinSlice = cpu->slice;
+    if (++cpu->spinCount < SPIN_THRESHOLD) return;
+
+    struct VM *vm = cpu->vm;
+    if (cpu->job || vm->scheduler == VMX20_SCHEDULE_DETERMINISTIC)
+    {
+        // end the turn at the next branch; the rest of it is not charged
+        cpu->forfeited += cpu->slice;
+        cpu->slice = 0;
+        return;
+    }
+    // a recorded or replayed core holds up the others while it executes
+    if (cpu->replay) return;
+    uint32_t backoff = cpu->spinCount - SPIN_THRESHOLD;
+    if (backoff < SPIN_YIELDS || vm->jit || vm->budget)
+    {
+        sched_yield();
+    }
+    else
+    {
+        backoff -= SPIN_YIELDS;
+        long ns = backoff < 7 ? SPIN_MIN_NS << backoff : SPIN_MAX_NS;
+        spinWait(vm, addr, seen, ns < SPIN_MAX_NS ? ns : SPIN_MAX_NS);
+    }
+    cpu->forfeited += cpu->slice;
+    cpu->slice = 0;
+}
+
+static inline void opCmpxchg(core_t *cpu, const dop_t *ins)
+{
+    uint32_t addr = ins->arg;
+    if (addr >= cpu->vm->memSize) return;   // nothing to compare with or exchange
+    memAcquire(cpu);
+    // on failure the current value of the word is written back into r1
+    if (__atomic_compare_exchange_n(&cpu->vm->memory[addr], &cpu->reg[ins->r1],
+            cpu->reg[ins->r2], 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    {
+        // like a store, an exchange may release cores waiting on the word
+        invalidateDecoded(cpu->vm, addr);
+        if (__atomic_load_n(&cpu->vm->spinWaiters, __ATOMIC_RELAXED)) spinWake(cpu->vm, addr);
+        memRelease(cpu);
+        return;
+    }
+    if (cpu->profile) cpu->profile->cmpxchgFailed++;
+    memRelease(cpu);
+    spinCheck(cpu, addr, cpu->reg[ins->r1]);
+}
+
+static inline int32_t opPush(core_t *cpu, const dop_t *ins, int32_t *termCode, int checked)
+{
+    // check if sp out of bounds
+    if (checked && (cpu->reg[SP] > cpu->stack || cpu->reg[SP] < cpu->stackLow))
+    {
+        // out of bounds
+        if (DEBUG) printf("<push> sp %d out of range\n", cpu->reg[SP]);
+        *termCode = VMX20_ADDRESS_OUT_OF_RANGE;
+        return 0;
+    }
+    cpu->reg[SP] -= 1;
+    memAcquire(cpu);
+    memStore(cpu->vm, cpu->reg[SP], cpu->reg[ins->r1]);
+    memRelease(cpu);
     return 1;
 }
 
+static inline int32_t opPop(core_t *cpu, const dop_t *ins, int32_t *termCode, int checked)
+{
+    // check if sp out of bounds
+    if (checked && (cpu->reg[SP] > cpu->stack || cpu->reg[SP] < cpu->stackLow))
+    {
+        // out of bounds
+        if (DEBUG) printf("<pop> sp %d out of range\n", cpu->reg[SP]);
+        *termCode = VMX20_ADDRESS_OUT_OF_RANGE;
+        return 0;
+    }
+    memAcquire(cpu);
+    memLoad(cpu->vm, cpu->reg[SP], &cpu->reg[ins->r1]);
+    memRelease(cpu);
+    cpu->reg[SP] += 1;
+    // pop has always fallen through into the illegal instruction trap
+    *termCode = VMX20_ILLEGAL_INSTRUCTION;
+    return 0;
+}
+
+// count an executed instruction in the core's profile
+static inline void profileStep(profile_t *profile, uint32_t pc, uint8_t op, uint32_t next)
+{
+    profile->retired++;
+    profile->ops[op]++;
+    profile->pcHits[pc < profile->pcCount ? pc : profile->pcCount]++;
+    profile->nodes[profile->current].self++;
+    if (op == INS_BLT || op == INS_BGT || op == INS_BEQ)
+    {
+        if (next != pc + 1) profile->taken++;
+        else profile->notTaken++;
+    }
+    else if (op == INS_CALL) profileCall(profile, next);
+    else if (op == INS_RET) profileReturn(profile);
+}
+
+// execute the instruction at instrAddr (switch engine)
+//   returns 1 to continue and 0 once the core has terminated
 static int32_t executeInstruction(void *core, uint32_t instrAddr, int32_t *termCode)
 {
     core_t *cpu = core;
     int32_t success = 1;
-    int32_t addr = 0;
-    
-    //pthread_mutex_lock(cpu->vm->memLock);
 
-    int32_t word = cpu->vm->memory[instrAddr];
-    int reg1 = word >> 8 & 0xf;
-    int reg2 = word >> 12 & 0xf;
-    float r1f, r2f;
-    //if (DEBUG) printf("%.8x\n", word);
+    dop_t scratch;
+    const dop_t *ins = fetchDecoded(cpu->vm, instrAddr, &scratch);
+    uint8_t op = opOf(ins);
+    if (op == OP_UNDECODED)
+    {
+        ins = decodeFromMemory(cpu->vm, instrAddr, &scratch);
+        op = ins->op;
+    }
+    if (IS_SUPER(op)) op = ins->base;   // one instruction at a time here
+    int32_t before[16];
+    if (cpu->ring) memcpy(before, cpu->reg, sizeof(before));
     uint32_t tPC = cpu->reg[PC] + 1;     // target PC; for use when executing operations
-    switch (word & 0xff)
+    switch (op)
     {
-        case INS_HALT:  // halt
-            *termCode = VMX20_NORMAL_TERMINATION;
-            //**termInfo = '\0';
+        case INS_HALT:      success = opHalt(termCode); break;
+        case INS_LOAD:      opLoad(cpu, ins); break;
+        case INS_STORE:     opStore(cpu, ins); break;
+        case INS_LDIMM:
+        case INS_LDADDR:    opLdimm(cpu, ins); break;
+        case INS_LDIND:     success = opLdind(cpu, ins, termCode); break;
+        case INS_STIND:     success = opStind(cpu, ins, termCode); break;
+        case INS_ADDF:      opAddf(cpu, ins); break;
+        case INS_SUBF:      opSubf(cpu, ins); break;
+        case INS_DIVF:      success = opDivf(cpu, ins, termCode); break;
+        case INS_MULF:      opMulf(cpu, ins); break;
+        case INS_ADDI:      opAddi(cpu, ins); break;
+        case INS_SUBI:      opSubi(cpu, ins); break;
+        case INS_DIVI:      success = opDivi(cpu, ins, termCode); break;
+        case INS_MULI:      opMuli(cpu, ins); break;
+        case INS_CALL:      success = opCall(cpu, ins, &tPC, termCode, 1); break;
+        case INS_RET:       success = opRet(cpu, &tPC, termCode, 1); break;
+        case INS_BLT:       opBlt(cpu, ins, &tPC); break;
+        case INS_BGT:       opBgt(cpu, ins, &tPC); break;
+        case INS_BEQ:       opBeq(cpu, ins, &tPC); break;
+        case INS_JMP:       tPC = ins->arg; break;
+        case INS_CMPXCHG:   opCmpxchg(cpu, ins); break;
+        case INS_GETPID:    cpu->reg[ins->r1] = cpu->pid; break;
+        case INS_GETPN:     cpu->reg[ins->r1] = cpu->vm->numProcessors; break;
+        case INS_PUSH:      success = opPush(cpu, ins, termCode, 1); break;
+        case INS_POP:       success = opPop(cpu, ins, termCode, 1); break;
+        case OP_BADFETCH:   // pc outside of memory
+            *termCode = VMX20_ADDRESS_OUT_OF_RANGE;
             success = 0;
             break;
-        case INS_LOAD:  // load
-            addr = EXTENDSIGN20(word >> 12);
-            pthread_mutex_lock(cpu->vm->memLock);
-            getWord(cpu->vm, tPC + addr, &cpu->reg[reg1]); 
-            pthread_mutex_unlock(cpu->vm->memLock);
-            break;
-        case INS_STORE:  // store
-            addr = EXTENDSIGN20(word >> 12);
-            pthread_mutex_lock(cpu->vm->memLock);
-            putWord(cpu->vm, tPC + addr, cpu->reg[reg1]);
-            pthread_mutex_unlock(cpu->vm->memLock);
-            break;
-        case INS_LDIMM:  // ldimm
-            addr = EXTENDSIGN20(word >> 12);
-            cpu->reg[reg1] = addr;
-            break;
-        case INS_LDADDR:  // ldaddr
-            addr = EXTENDSIGN20(word >> 12);
-            cpu->reg[reg1] = tPC + addr;
-            break;
-        case INS_LDIND:  // ldind
-            addr = EXTENDSIGN16(word >> 16);
-            if ((uint64_t)cpu->reg[reg2] + addr >= MEM_SIZE) {
-                *termCode = VMX20_ADDRESS_OUT_OF_RANGE;
-                //sprintf(*termInfo, "%8x (%8x + %8x)", cpu->reg[reg2] + addr, cpu->reg[reg2], addr);
-                success = 0;
-                break;
-            }
-            pthread_mutex_lock(cpu->vm->memLock);
-            getWord(cpu->vm, cpu->reg[reg2] + addr, &cpu->reg[reg1]);
-            pthread_mutex_unlock(cpu->vm->memLock);
-            break;
-        case INS_STIND:  // stind
-            addr = EXTENDSIGN16(word >> 16);
-            if ((uint64_t)reg2 + addr >= MEM_SIZE) {
-                *termCode = VMX20_ADDRESS_OUT_OF_RANGE;
-                //sprintf(*termInfo, "%8x (%8x + %8x)", cpu->reg[reg2] + addr, cpu->reg[reg2], addr);
-                success = 0;
-                break;
-            }
-            pthread_mutex_lock(cpu->vm->memLock);
-            putWord(cpu->vm, cpu->reg[reg2] + addr, cpu->reg[reg1]);
-            pthread_mutex_unlock(cpu->vm->memLock);
-            break;
-        case INS_ADDF:  // addf
-            memcpy(&r1f, &cpu->reg[reg1], sizeof(int32_t));
-            memcpy(&r2f, &cpu->reg[reg2], sizeof(int32_t));
-            r1f = r1f + r2f;
-            memcpy(&cpu->reg[reg1], &r1f, sizeof(int32_t));
-            break;
-        case INS_SUBF:  // subf
-            memcpy(&r1f, &cpu->reg[reg1], sizeof(int32_t));
-            memcpy(&r2f, &cpu->reg[reg2], sizeof(int32_t));
-            r1f = r1f - r2f;
-            memcpy(&cpu->reg[reg1], &r1f, sizeof(int32_t));
-            break;
-        case INS_DIVF:  // divf
-            memcpy(&r1f, &cpu->reg[reg1], sizeof(int32_t));
-            memcpy(&r2f, &cpu->reg[reg2], sizeof(int32_t));
-            if (r2f == 0.0f) {
-                *termCode = VMX20_DIVIDE_BY_ZERO;
-                //**termInfo = '\0';
-                success = 0;
-                break;
-            }
-            r1f = r1f / r2f;
-            memcpy(&cpu->reg[reg1], &r1f, sizeof(int32_t));
-            break;
-        case INS_MULF:  // mulf
-            memcpy(&r1f, &cpu->reg[reg1], sizeof(int32_t));
-            memcpy(&r2f, &cpu->reg[reg2], sizeof(int32_t));
-            r1f = r1f * r2f;
-            memcpy(&cpu->reg[reg1], &r1f, sizeof(int32_t));
-            break;
-        case INS_ADDI:  // addi
-            cpu->reg[reg1] = cpu->reg[reg1] + cpu->reg[reg2];
-            break;
-        case INS_SUBI:  // subi
-            cpu->reg[reg1] = cpu->reg[reg1] - cpu->reg[reg2];
-            break;
-        case INS_DIVI:  // divi
-            if (cpu->reg[reg2] == 0) {
-                *termCode = VMX20_DIVIDE_BY_ZERO;
-                //**termInfo = '\0';
-                success = 0;
-                break;
-            }
-            cpu->reg[reg1] = cpu->reg[reg1] / cpu->reg[reg2];
-            break;
-        case INS_MULI:  // muli
-            cpu->reg[reg1] = cpu->reg[reg1] * cpu->reg[reg2];
-            break;
-        case INS_CALL:  // call
-            // check if sp is/will be be out of bounds
-            if (cpu->reg[SP] > cpu->stack || cpu->reg[SP] - 3 < cpu->vm->progEnd)
-            {
-                // out of bounds
-                if (DEBUG) printf("<before> sp %d out of range\n", cpu->reg[SP]);
-                *termCode = VMX20_ADDRESS_OUT_OF_RANGE;
-                success = 0;
-                break;
-            }
-            addr = EXTENDSIGN20(word >> 12);
-            // acquire memory lock first
-            pthread_mutex_lock(cpu->vm->memLock);
-            // push pc on the stack
-            cpu->reg[SP] -= 1;
-            putWord(cpu->vm, cpu->reg[SP], tPC);
-            // push contents of fp register onto stack
-            tPC += addr;
-            cpu->reg[SP] -= 1;
-            putWord(cpu->vm, cpu->reg[SP], cpu->reg[FP]);
-            // assign contents of fp register to sp register
-            cpu->reg[FP] = cpu->reg[SP];
-            // push a zero on top of the stack
-            cpu->reg[SP] -= 1;
-            putWord(cpu->vm, cpu->reg[SP], 0);
-            // release memory lock
-            pthread_mutex_unlock(cpu->vm->memLock);
-            break;
-        case INS_RET:  // ret
-            // check if sp is/will be be out of bounds
-            if (cpu->reg[SP] + 3 > cpu->stack|| cpu->reg[SP] < cpu->vm->progEnd)
-            {
-                // out of bounds
-                *termCode = VMX20_ADDRESS_OUT_OF_RANGE;
-                success = 0;
-                break;
-            }
-            // acquire memory lock
-            pthread_mutex_lock(cpu->vm->memLock);
-            // retrieve the return value
-            getWord(cpu->vm, cpu->reg[SP], &word);              // returnValue
-            cpu->reg[SP] += 1;
-            // set FP
-            getWord(cpu->vm, cpu->reg[SP], &cpu->reg[FP]);      // savedFP
-            cpu->reg[SP] += 1;
-            // set PC
-            getWord(cpu->vm, cpu->reg[SP], (int32_t *)&tPC);    // returnAddress
-            cpu->reg[SP] += 1;
-            // store return value
-            putWord(cpu->vm, cpu->reg[FP] - 1, word);
-            // release memory lock
-            pthread_mutex_unlock(cpu->vm->memLock);
-            break;
-        case INS_BLT:  // blt
-            addr = EXTENDSIGN16(word >> 16);
-            if (cpu->reg[reg1] < cpu->reg[reg2])
-            {
-                tPC += addr;
-            }
-            break;
-        case INS_BGT:  // bgt
-            addr = EXTENDSIGN16(word >> 16);
-            if (cpu->reg[reg1] > cpu->reg[reg2])
-            {
-                tPC += addr;
-            }
-            break;
-        case INS_BEQ:  // beq
-            addr = EXTENDSIGN16(word >> 16);
-            if (cpu->reg[reg1] == cpu->reg[reg2])
-            {
-                tPC += addr;
-            }
-            break;
-        case INS_JMP:  // jmp
-            addr = EXTENDSIGN20(word >> 12);
-            tPC += addr;
-            break;
-        case INS_CMPXCHG:  // cmpxchg
-            addr = EXTENDSIGN16(word >> 16);
-            // lock memory
-            pthread_mutex_lock(cpu->vm->memLock);
-            int32_t _w = 0;
-            getWord(cpu->vm, tPC + addr, &_w);
-            if (cpu->reg[reg1] == _w)
-            {
-                putWord(cpu->vm, tPC + addr, cpu->reg[reg2]);
-            }
-            else
-            {
-                getWord(cpu->vm, tPC + addr, &cpu->reg[reg1]);
-            }
-            // unlock memory
-            pthread_mutex_unlock(cpu->vm->memLock);
-            break;
-        case INS_GETPID:  // getpid
-            cpu->reg[reg1] = cpu->pid;
-            break;
-        case INS_GETPN:  // getpn
-            cpu->reg[reg1] = cpu->vm->numProcessors;
+        default:
+            *termCode = VMX20_ILLEGAL_INSTRUCTION;
+            success = 0;
             break;
-        case INS_PUSH:  // push
-            // check if sp out of bounds
-            if (cpu->reg[SP] > cpu->stack || cpu->reg[SP] < cpu->vm->progEnd)
+    }
+
+    if (cpu->profile) profileStep(cpu->profile, instrAddr, op, tPC);
+    if (cpu->ring) traceStep(cpu, instrAddr, ins, op, before);
+    else if (cpu->vm->trace) printTrace(cpu);
+    cpu->reg[PC] = tPC;
+    return success;
+
+}
+
+#if defined(__GNUC__)
+// direct-threaded engine
+//   same semantics as executeInstruction but every handler jumps straight
+//   to the handler of the next instruction through a label table instead
+//   of returning to a loop and going through the switch. never traces.
+//   the slice is only charged at taken branches, with the length of the
+//   straight-line run that ended there.
+static int runThreaded(core_t *cpu)
+{
+    // cores with guard pages around their stack skip the stack checks
+#define LABELS(call, ret, push, pop) {                      \
+        [0 ... 255]     = &&l_invalid,                      \
+        [INS_HALT]      = &&l_halt,                         \
+        [INS_LOAD]      = &&l_load,                         \
+        [INS_STORE]     = &&l_store,                        \
+        [INS_LDIMM]     = &&l_ldimm,                        \
+        [INS_LDADDR]    = &&l_ldimm,                        \
+        [INS_LDIND]     = &&l_ldind,                        \
+        [INS_STIND]     = &&l_stind,                        \
+        [INS_ADDF]      = &&l_addf,                         \
+        [INS_SUBF]      = &&l_subf,                         \
+        [INS_DIVF]      = &&l_divf,                         \
+        [INS_MULF]      = &&l_mulf,                         \
+        [INS_ADDI]      = &&l_addi,                         \
+        [INS_SUBI]      = &&l_subi,                         \
+        [INS_DIVI]      = &&l_divi,                         \
+        [INS_MULI]      = &&l_muli,                         \
+        [INS_CALL]      = call,                             \
+        [INS_RET]       = ret,                              \
+        [INS_BLT]       = &&l_blt,                          \
+        [INS_BGT]       = &&l_bgt,                          \
+        [INS_BEQ]       = &&l_beq,                          \
+        [INS_JMP]       = &&l_jmp,                          \
+        [INS_CMPXCHG]   = &&l_cmpxchg,                      \
+        [INS_GETPID]    = &&l_getpid,                       \
+        [INS_GETPN]     = &&l_getpn,                        \
+        [INS_PUSH]      = push,                             \
+        [INS_POP]       = pop,                              \
+        [OP_BADFETCH]   = &&l_badfetch,                     \
+        [OP_UNDECODED]  = &&l_undecoded,                    \
+        [SI_CAS_BEQ]            = &&l_cas_beq,              \
+        [SI_LOAD_ADDI_STORE]    = &&l_load_addi_store,      \
+        [SI_SUBI_BGT]           = &&l_subi_bgt,             \
+        [SI_FLOAT_LOOP]         = &&l_float_loop,           \
+    }
+    static void *labels[256] = LABELS(&&l_call, &&l_ret, &&l_push, &&l_pop);
+    static void *guardedLabels[256] =
+        LABELS(&&l_call_guarded, &&l_ret_guarded, &&l_push_guarded, &&l_pop_guarded);
+#undef LABELS
+    void *const *table = cpu->guarded ? guardedLabels : labels;
+    struct VM *vm = cpu->vm;
+    int32_t *termCode = &cpu->status;
+    uint32_t tPC = cpu->reg[PC];
+    uint32_t blockStart = tPC;
+    const dop_t *ins;
+    dop_t scratch;
+
+    // registers may name the PC, so keep it current for every instruction
+#define DISPATCH()                                  \
+    do {                                            \
+        cpu->reg[PC] = tPC;                         \
+        ins = fetchDecoded(vm, tPC, &scratch);      \
+        tPC = tPC + 1;                              \
+        goto *table[opOf(ins)];                     \
+    } while (0)
+#define CHECK(x) do { if (!(x)) goto done; } while (0)
+    // account for the run that ends with the branch at pc; yield if used up
+#define BRANCH(pc)                                          \
+    do {                                                    \
+        if (tPC != (pc) + 1)                                \
+        {                                                   \
+            cpu->slice -= (pc) + 1 - blockStart;            \
+            blockStart = tPC;                               \
+            if (cpu->slice <= 0) goto yield;                \
+        }                                                   \
+    } while (0)
+    // run only the head if a later word of the sequence was overwritten
+#define SUPER(si, n)                                        \
+    do {                                                    \
+        for (int _j = 1; _j <= (n); _j++)                   \
+            if (opOf(ins + _j) == OP_UNDECODED)             \
+                goto *table[ins->base];                     \
+        cpu->siHits[(si) - SI_FIRST]++;                     \
+    } while (0)
+
+    DISPATCH();
+
+l_halt:     opHalt(termCode); goto done;
+l_load:     opLoad(cpu, ins); DISPATCH();
+l_store:    opStore(cpu, ins); DISPATCH();
+l_ldimm:    opLdimm(cpu, ins); DISPATCH();
+l_ldind:    CHECK(opLdind(cpu, ins, termCode)); DISPATCH();
+l_stind:    CHECK(opStind(cpu, ins, termCode)); DISPATCH();
+l_addf:     opAddf(cpu, ins); DISPATCH();
+l_subf:     opSubf(cpu, ins); DISPATCH();
+l_divf:     CHECK(opDivf(cpu, ins, termCode)); DISPATCH();
+l_mulf:     opMulf(cpu, ins); DISPATCH();
+l_addi:     opAddi(cpu, ins); DISPATCH();
+l_subi:     opSubi(cpu, ins); DISPATCH();
+l_divi:     CHECK(opDivi(cpu, ins, termCode)); DISPATCH();
+l_muli:     opMuli(cpu, ins); DISPATCH();
+l_call:     CHECK(opCall(cpu, ins, &tPC, termCode, 1)); BRANCH(cpu->reg[PC]); DISPATCH();
+l_ret:      CHECK(opRet(cpu, &tPC, termCode, 1)); BRANCH(cpu->reg[PC]); DISPATCH();
+l_blt:      opBlt(cpu, ins, &tPC); BRANCH(cpu->reg[PC]); DISPATCH();
+l_bgt:      opBgt(cpu, ins, &tPC); BRANCH(cpu->reg[PC]); DISPATCH();
+l_beq:      opBeq(cpu, ins, &tPC); BRANCH(cpu->reg[PC]); DISPATCH();
+l_jmp:      tPC = ins->arg; BRANCH(cpu->reg[PC]); DISPATCH();
+l_cmpxchg:  opCmpxchg(cpu, ins); DISPATCH();
+l_getpid:   cpu->reg[ins->r1] = cpu->pid; DISPATCH();
+l_getpn:    cpu->reg[ins->r1] = vm->numProcessors; DISPATCH();
+l_push:     CHECK(opPush(cpu, ins, termCode, 1)); DISPATCH();
+l_pop:      opPop(cpu, ins, termCode, 1); goto done;
+l_call_guarded: opCall(cpu, ins, &tPC, termCode, 0); BRANCH(cpu->reg[PC]); DISPATCH();
+l_ret_guarded:  opRet(cpu, &tPC, termCode, 0); BRANCH(cpu->reg[PC]); DISPATCH();
+l_push_guarded: opPush(cpu, ins, termCode, 0); DISPATCH();
+l_pop_guarded:  opPop(cpu, ins, termCode, 0); goto done;
+l_badfetch: *termCode = VMX20_ADDRESS_OUT_OF_RANGE; goto done;
+l_invalid:  *termCode = VMX20_ILLEGAL_INSTRUCTION; goto done;
+l_undecoded:
+    ins = decodeFromMemory(vm, tPC - 1, &scratch);
+    goto *table[ins->op];
+
+l_cas_beq:
+    SUPER(SI_CAS_BEQ, 2);
+    opLdimm(cpu, ins);
+    opCmpxchg(cpu, ins + 1);
+    tPC += 2;
+    opBeq(cpu, ins + 2, &tPC);
+    BRANCH(cpu->reg[PC] + 2);
+    DISPATCH();
+l_load_addi_store:
+    SUPER(SI_LOAD_ADDI_STORE, 2);
+    opLoad(cpu, ins);
+    opAddi(cpu, ins + 1);
+    opStore(cpu, ins + 2);
+    tPC += 2;
+    DISPATCH();
+l_subi_bgt:
+    SUPER(SI_SUBI_BGT, 1);
+    opSubi(cpu, ins);
+    tPC += 1;
+    opBgt(cpu, ins + 1, &tPC);
+    BRANCH(cpu->reg[PC] + 1);
+    DISPATCH();
+
+l_float_loop:
+    // whole iterations, charged as if interpreted; then the beq itself
+    if (runFloatLoop(cpu, ins, tPC - 1, cpu->slice))
+    {
+        cpu->siHits[SI_FLOAT_LOOP - SI_FIRST]++;
+    }
+    goto *table[ins->base];
+
+done:
+    // the run up to the instruction that ended the core
+    cpu->slice -= tPC - 1 - blockStart;
+    cpu->reg[PC] = tPC;
+    return 0;
+yield:
+    cpu->reg[PC] = tPC;
+    return 1;
+#undef SUPER
+#undef BRANCH
+#undef CHECK
+#undef DISPATCH
+}
+#endif
+
+// whether the instruction at pc ends a basic block
+static int endsBlock(struct VM *vm, uint32_t pc)
+{
+    if (pc >= vm->codeEnd) return 1;
+    switch (vm->code[pc].base)
+    {
+        case INS_BLT:
+        case INS_BGT:
+        case INS_BEQ:
+        case INS_JMP:
+        case INS_CALL:
+        case INS_RET:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// template JIT engine
+//   interprets one instruction at a time and counts how often each basic
+//   block is entered; once a block is hot, vmx20_jit.c compiles it to
+//   native code which is run from then on. compiled code hands control
+//   back for everything it does not do itself.
+static int runJit(core_t *cpu)
+{
+    struct VM *vm = cpu->vm;
+    int blockEntry = 1;
+    while (1)
+    {
+        uint32_t pc = cpu->reg[PC];
+        if (blockEntry)
+        {
+            // only yield where a block starts, so that resuming is exact
+            if (cpu->slice <= 0) return 1;
+            jit_block_t block = jitEnter(vm, pc);
+            if (block)
             {
-                // out of bounds
-                if (DEBUG) printf("<push> sp %d out of range\n", cpu->reg[SP]);
-                *termCode = VMX20_ADDRESS_OUT_OF_RANGE;
-                success = 0;
-                break;
+                cpu->loopLimit = cpu->slice < JIT_MAX_LOOP ? cpu->slice : JIT_MAX_LOOP;
+                uint32_t ran = block(cpu, vm->memory);
+                cpu->slice -= ran & ~JIT_BAILED;
+                blockEntry = !(ran & JIT_BAILED);
+                continue;
             }
-            cpu->reg[SP] -= 1;
-            pthread_mutex_lock(cpu->vm->memLock);
-            putWord(cpu->vm, cpu->reg[SP], cpu->reg[reg1]);
-            pthread_mutex_unlock(cpu->vm->memLock);
-            break;
-        case INS_POP:  // pop
-            // check if sp out of bounds
-            if (cpu->reg[SP] > cpu->stack || cpu->reg[SP] < cpu->vm->progEnd)
+        }
+        if (!executeInstruction(cpu, pc, &cpu->status)) return 0;
+        cpu->slice--;
+        blockEntry = cpu->reg[PC] != pc + 1 || endsBlock(vm, pc);
+    }
+}
+
+// switch engine; the only one that traces
+static int runSwitch(core_t *cpu)
+{
+    while (executeInstruction(cpu, cpu->reg[PC], &cpu->status) == 1)
+    {
+        if (--cpu->slice <= 0) return 1;
+    }
+    return 0;
+}
+
+// whether an instruction reads or writes memory
+static int accessesMemory(uint8_t op)
+{
+    switch (op)
+    {
+        case INS_LOAD: case INS_STORE: case INS_LDIND: case INS_STIND: case INS_CMPXCHG:
+        case INS_CALL: case INS_RET: case INS_PUSH: case INS_POP:
+            return 1;
+    }
+    return 0;
+}
+
+// switch engine for runs with watches and recorded and replayed runs
+//   the accesses of an instruction are worked out from its decoding and
+//   the registers it started with, so executeInstruction does not have to
+//   look for watches. an instruction that accesses memory in a recorded
+//   or replayed run executes in its turn of the sequence (vmx20_replay.c)
+static int runChecked(core_t *cpu)
+{
+    struct VM *vm = cpu->vm;
+    while (1)
+    {
+        uint32_t pc = cpu->reg[PC];
+        dop_t scratch;
+        const dop_t *ins = fetchDecoded(vm, pc, &scratch);
+        uint8_t op = opOf(ins);
+        if (op == OP_UNDECODED)
+        {
+            ins = decodeFromMemory(vm, pc, &scratch);
+            op = ins->op;
+        }
+        if (IS_SUPER(op)) op = ins->base;
+        // only the opcode of an entry ever changes, and op is a copy of it
+        int32_t before[16];
+        memcpy(before, cpu->reg, sizeof(before));
+        int sequenced = cpu->replay && accessesMemory(op);
+        if (sequenced)
+        {
+            int turn = replayEnter(cpu);
+            if (turn < 0) return 0;
+            if (turn == 0)
             {
-                // out of bounds
-                if (DEBUG) printf("<pop> sp %d out of range\n", cpu->reg[SP]);
-                *termCode = VMX20_ADDRESS_OUT_OF_RANGE;
-                success = 0;
-                break;
+                // let the core whose turn it is run; the rest of the slice
+                //   is not charged
+                cpu->forfeited += cpu->slice;
+                cpu->slice = 0;
+                sched_yield();
+                return 1;
             }
-            pthread_mutex_lock(cpu->vm->memLock);
-            getWord(cpu->vm, cpu->reg[SP], &cpu->reg[reg1]);
-            pthread_mutex_unlock(cpu->vm->memLock);
-            cpu->reg[SP] += 1;
-        default:
-            *termCode = VMX20_ILLEGAL_INSTRUCTION;
-            //sprintf(*termInfo, "%.2x", word & 0xff);
-            success = 0;
-            break;
+        }
+        int32_t success = executeInstruction(cpu, pc, &cpu->status);
+        if (sequenced && !replayLeave(cpu, op, ins, before)) return 0;
+        if (vm->watchPages) watchStep(cpu, pc, op, ins, before, success);
+        if (!success) return 0;
+        if (--cpu->slice <= 0) return 1;
     }
+}
 
-    //pthread_mutex_unlock(cpu->vm->memLock);
+// run a core until it terminates or has used up its slice
+//   returns 1 if the core can be resumed and 0 once it has terminated
+static int runEngine(core_t *cpu)
+{
+    struct VM *vm = cpu->vm;
+    // profiled runs count every instruction, so they go through the switch
+    if (cpu->profile)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int running = vm->watchPages || cpu->replay ? runChecked(cpu) : runSwitch(cpu);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        cpu->profile->nanoseconds += (end.tv_sec - start.tv_sec) * 1000000000ull
+            + end.tv_nsec - start.tv_nsec;
+        return running;
+    }
+    // so do runs with watches, which look at every access, and recorded
+    //   and replayed runs, which order them
+    if (vm->watchPages || cpu->replay)
+    {
+        return runChecked(cpu);
+    }
+    // the deterministic scheduler may end a turn after any instruction,
+    //   which only the switch engine can; the others stop at branches
+    if (vm->scheduler == VMX20_SCHEDULE_DETERMINISTIC && !cpu->job)
+    {
+        return runSwitch(cpu);
+    }
+    if (vm->jit && !vm->trace)
+    {
+        return runJit(cpu);
+    }
+#if defined(__GNUC__)
+    if (vm->engine != VMX20_ENGINE_SWITCH && !vm->trace)
+    {
+        return runThreaded(cpu);
+    }
+#endif
+    return runSwitch(cpu);
+}
 
-    if (cpu->vm->trace) printTrace(cpu);
-    cpu->reg[PC] = tPC;
-    return success;
+int runCore(core_t *cpu)
+{
+    // with guard pages in place any core may fault on one
+    if (cpu->vm->numGuards) return runGuarded(cpu, runEngine);
+    return runEngine(cpu);
+}
 
+static uint64_t monotonicNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
 }
 
-static void *fetchDecodeExecute(void *core) {
-    // init cycle
-    core_t *cpu = core;
-    struct VM *vm = cpu->vm;
-    cpu->status = 1;
-    char *termInfo = malloc(256);
-    // set pc to entry_point
-    cpu->reg[PC] = vm->entryPoint;
-    if (DEBUG) printf("entry: %d\n", vm->entryPoint);
+// start the time limit of a call to execute or resumeVm
+static void startDeadline(struct VM *vm)
+{
+    vm->deadline = vm->timeLimit ? monotonicNs() + vm->timeLimit * 1000000ull : 0;
+}
 
-    while (executeInstruction(cpu, cpu->reg[PC], &cpu->status) == 1)
+// run a core for a slice of at most slice instructions of its budget
+//   returns 1 if the core can be resumed and 0 once it has terminated,
+//   which includes running out of its budget or past the deadline
+int runSlice(core_t *cpu, int64_t slice)
+{
+    if (slice > cpu->budget) slice = cpu->budget;
+    cpu->slice = slice;
+    int running = runCore(cpu);
+    int64_t used = slice - cpu->slice - cpu->forfeited;
+    cpu->forfeited = 0;
+    __atomic_fetch_add(&cpu->vm->executed, used, __ATOMIC_RELAXED);
+    cpu->budget -= used;
+    if (running && (cpu->budget <= 0
+            || (cpu->vm->deadline && monotonicNs() >= cpu->vm->deadline)))
     {
-        ;
+        cpu->status = VMX20_BUDGET_EXCEEDED;
+        running = 0;
     }
-
-    free(termInfo);
-    return NULL;
+    if (!running && cpu->replay) replayCoreStopped(cpu);
+    return running;
 }
 
+// instructions between checks for suspendVm
+#define EXECUTE_SLICE (1 << 20)
 
-int32_t execute(void *handle, uint32_t numProcessors, uint32_t initialSP[],
-      int terminationStatus[], int32_t trace)
+// pin a thread to a host cpu, or let it run on any if cpu is negative
+//   returns 1 if successful and 0 otherwise
+int pinThread(pthread_t thread, int32_t cpu)
 {
-    // init VM
-    struct VM *vm = handle;
-    if (numProcessors > VMX20_MAX_PROCESSORS)
+#if defined(__linux__)
+    cpu_set_t set;
+    if (cpu >= CPU_SETSIZE) return 0;
+    CPU_ZERO(&set);
+    if (cpu >= 0) CPU_SET(cpu, &set);
+    else for (int i = 0; i < CPU_SETSIZE; i++) CPU_SET(i, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+#else
+    (void)thread; (void)cpu;
+    return 0;
+#endif
+}
+
+static core_t *allocCore(void)
+{
+    void *core;
+    if (posix_memalign(&core, CACHE_LINE, sizeof(core_t))) return NULL;
+    return core;
+}
+
+// the thread of a core; slot points to the core, which the thread moves
+//   into memory it allocates itself, so the pages of the core are local to
+//   the host cpu it runs on
+static void *fetchDecodeExecute(void *slot) {
+    core_t *cpu = *(core_t **)slot;
+    struct VM *vm = cpu->vm;
+    if (vm->numAffinity) pinThread(pthread_self(), vm->affinity[cpu->pid % vm->numAffinity]);
+    core_t *local = allocCore();
+    if (local)
     {
-        return 0;
+        memcpy(local, cpu, sizeof(core_t));
+        free(cpu);
+        cpu = local;
+        *(core_t **)slot = cpu;
     }
+    if (DEBUG) printf("entry: %d\n", cpu->vm->entryPoint);
+    do
+    {
+        // the status stays VMX20_SUSPENDED
+        if (__atomic_load_n(&cpu->vm->suspendRequested, __ATOMIC_RELAXED)) break;
+    } while (runSlice(cpu, EXECUTE_SLICE));
+    return NULL;
+}
+
+// set the vm up for running numProcessors cores
+void beginExecution(struct VM *vm, uint32_t numProcessors, int32_t trace)
+{
+    dropSuspended(vm);
+    unguardStacks(vm);
+    vm->suspendRequested = 0;
+    vm->watchHit = 0;
+    startDeadline(vm);
+    vm->executed = 0;
     vm->numProcessors = numProcessors;
     vm->trace = trace;
+    // compiled code does not take memLock, so it only runs relaxed
+    if (vm->engine == VMX20_ENGINE_JIT && vm->memoryModel == VMX20_MEMORY_RELAXED)
+    {
+        if (!vm->jit && vm->codeEnd) jitCreate(vm);
+    }
+    else
+    {
+        jitDestroy(vm);
+    }
+    profileClear(vm);
+}
 
-    // init core(s)
-    core_t **cores = malloc(sizeof(core_t*) * numProcessors);
-    pthread_t *threads = malloc(sizeof(pthread_t) * numProcessors);
-    //uint32_t coreStackSize = 1000; // TODO: calculate
-    for (int i = 0; i < numProcessors; i++)
+// a core about to start at the entry point; NULL if out of memory
+core_t *createCore(struct VM *vm, int pid, uint32_t initialSP)
+{
+    core_t *core = allocCore();
+    if (!core) return NULL;
+    memcpy(core->reg, vm->reg, 16 * sizeof(int32_t));
+    core->stack = initialSP;
+    core->stackLow = stackLowest(vm, pid, initialSP);
+    core->guarded = 0;
+    core->reg[SP] = core->stack;
+    core->reg[PC] = vm->entryPoint;
+    core->vm = vm;
+    core->status = VMX20_SUSPENDED;    // until it terminates
+    core->pid = pid;
+    memset(core->siHits, 0, sizeof(core->siHits));
+    core->profile = vm->profiling ? profileCreate(vm->codeEnd, vm->entryPoint) : NULL;
+    core->ring = NULL;
+    core->replay = NULL;
+    core->slice = INT64_MAX;
+    core->budget = vm->budget ? (int64_t)vm->budget : INT64_MAX;
+    core->spinAddr = 0;
+    core->spinCount = 0;
+    core->spinSlice = 0;
+    core->forfeited = 0;
+    core->job = NULL;
+    core->next = NULL;
+    return core;
+}
+
+// collect the counters of a core that has stopped and free it
+//   returns its termination status
+int finishCore(core_t *core)
+{
+    struct VM *vm = core->vm;
+    int status = core->status;
+    for (int k = 0; k < VMX20_NUM_SUPERINSTRUCTIONS; k++)
     {
-        core_t *core = malloc(sizeof(core_t));
-        memcpy(core->reg, vm->reg, 16 * sizeof(int32_t));
-        //core->stackSize = coreStackSize;    
-        //core->stack = vm->progEnd + (core->stackSize * (i+1));  // TODO: initialSP??
-        core->stack = initialSP[i];
-        core->reg[SP] = core->stack;
-        core->vm = vm;
-        core->status = 1;
-        core->pid = i;
-        cores[i] = core;
+        vm->siHits[k] += core->siHits[k];
+    }
+    if (core->profile) vm->profiles[vm->profiledCores++] = core->profile;
+    free(core);
+    return status;
+}
 
+// run the cores with a thread each until they stop
+//   returns 0 if a thread could not be started; the cores that were
+//   started have stopped by then
+static int runThreads(struct VM *vm, core_t *cores[])
+{
+    int numProcessors = vm->numProcessors;
+    pthread_t threads[VMX20_MAX_PROCESSORS];
+    for (int i = 0; i < numProcessors; i++)
+    {
+        if (!cores[i]) continue;
         // create thread
-        if (pthread_create(&threads[i], NULL, &fetchDecodeExecute, core))
+        if (pthread_create(&threads[i], NULL, &fetchDecodeExecute, &cores[i]))
         {
-            // failure starting thread, fatal error
-            for (int j = 0; j < i; j++) if (cores[j]) free(cores[j]);
-            free(cores);
+            // failure starting thread, fatal error; let the others finish
+            for (int j = 0; j < i; j++) if (cores[j]) pthread_join(threads[j], NULL);
             return 0;
         }
     }
@@ -626,103 +1729,399 @@ int32_t execute(void *handle, uint32_t numProcessors, uint32_t initialSP[],
     // start thread work
     for (int i = 0; i < numProcessors; i++)
     {
-        pthread_join(threads[i], NULL);
+        if (cores[i]) pthread_join(threads[i], NULL);
+    }
+    return 1;
+}
+
+// next turn length of the deterministic scheduler
+//   the quantum itself without a seed, otherwise 1 to 2 * quantum
+static int64_t nextTurn(struct VM *vm, uint32_t *state)
+{
+    if (!*state) return vm->quantum;
+    // xorshift32
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return 1 + *state % (2 * (uint64_t)vm->quantum);
+}
+
+// run the cores on this thread in turns until they stop
+//   a core is running as long as its status is VMX20_SUSPENDED
+static void runInterleaved(struct VM *vm, core_t *cores[])
+{
+    int numProcessors = vm->numProcessors;
+    uint32_t state = vm->seed;
+    int running = 1;
+    while (running)
+    {
+        running = 0;
+        for (int i = 0; i < numProcessors; i++)
+        {
+            if (!cores[i] || cores[i]->status != VMX20_SUSPENDED) continue;
+            if (__atomic_load_n(&vm->suspendRequested, __ATOMIC_RELAXED)) return;
+            running |= runSlice(cores[i], nextTurn(vm, &state));
+        }
+    }
+}
+
+// run the cores of vm->numProcessors until they stop
+//   a NULL core has already terminated with the status in vm->status.
+//   cores that were suspended are kept in vm->cores for resumeVm
+static int32_t runCores(struct VM *vm, core_t *cores[], int terminationStatus[])
+{
+    int numProcessors = vm->numProcessors;
+    if (vm->scheduler == VMX20_SCHEDULE_DETERMINISTIC)
+    {
+        runInterleaved(vm, cores);
+    }
+    else if (!runThreads(vm, cores))
+    {
+        traceStop(vm);
+        for (int j = 0; j < numProcessors; j++) if (cores[j]) finishCore(cores[j]);
+        return 0;
     }
-    // all threads done
+    // all cores stopped
+    traceStop(vm);
 
     // cleanup cores
+    int suspended = 0;
     for (int i = 0; i < numProcessors; i++)
     {
-        if (cores[i] == NULL) continue;
-        terminationStatus[i] = cores[i]->status;
-        free(cores[i]);
+        if (cores[i] && cores[i]->status == VMX20_SUSPENDED)
+        {
+            vm->status[i] = VMX20_SUSPENDED;
+            vm->cores[i] = cores[i];
+            suspended = 1;
+        }
+        else if (cores[i])
+        {
+            vm->status[i] = finishCore(cores[i]);
+        }
+        terminationStatus[i] = vm->status[i];
+    }
+    // suspended cores keep their guard pages for resumeVm, and go on
+    //   with the same recording
+    if (!suspended)
+    {
+        unguardStacks(vm);
+        replayStop(vm);
     }
-    free(cores);
-    free(threads);
 
     return 1;
 }
 
-int disassemble(void *handle, uint32_t address, char *buffer, int32_t *errorNumber)
+int32_t execute(void *handle, uint32_t numProcessors, uint32_t initialSP[],
+      int terminationStatus[], int32_t trace)
 {
-    *errorNumber = 0;
+    // init VM
     struct VM *vm = handle;
-    if (address >= vm->progEnd)
+    if (numProcessors > VMX20_MAX_PROCESSORS)
     {
-        *errorNumber = VMX20_ADDRESS_OUT_OF_RANGE;
         return 0;
     }
-    int32_t word;
-    if (!getWord(vm, address, &word))
+    beginExecution(vm, numProcessors, trace);
+
+    // init core(s)
+    core_t *cores[VMX20_MAX_PROCESSORS];
+    for (int i = 0; i < numProcessors; i++)
     {
-        *errorNumber = VMX20_ADDRESS_OUT_OF_RANGE;
+        cores[i] = createCore(vm, i, initialSP[i]);
+        if (!cores[i])
+        {
+            for (int j = 0; j < i; j++) finishCore(cores[j]);
+            return 0;
+        }
+    }
+    // a binary trace replaces the printed one
+    if (trace && vm->traceFile && !traceStart(vm, cores, numProcessors))
+    {
+        for (int i = 0; i < numProcessors; i++) finishCore(cores[i]);
+        return 0;
+    }
+    if (!replayStart(vm, cores, numProcessors))
+    {
+        traceStop(vm);
+        for (int i = 0; i < numProcessors; i++) finishCore(cores[i]);
         return 0;
     }
+    guardStacks(vm, cores, numProcessors);
+
+    return runCores(vm, cores, terminationStatus);
+}
+
+int32_t suspendVm(void *handle)
+{
+    struct VM *vm = handle;
+    if (!vm) return 0;
+    __atomic_store_n(&vm->suspendRequested, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+int32_t resumeVm(void *handle, int terminationStatus[])
+{
+    struct VM *vm = handle;
+    if (!vm) return 0;
+    core_t *cores[VMX20_MAX_PROCESSORS];
+    int any = 0;
+    for (int i = 0; i < vm->numProcessors; i++)
+    {
+        cores[i] = vm->cores[i];
+        vm->cores[i] = NULL;
+        if (cores[i]) any = 1;
+    }
+    if (!any) return 0;
+    vm->suspendRequested = 0;
+    vm->watchHit = 0;
+    startDeadline(vm);
+    return runCores(vm, cores, terminationStatus);
+}
+
+int32_t setEngine(void *handle, int32_t engine)
+{
+    struct VM *vm = handle;
+    if (!vm) return 0;
+    switch (engine)
+    {
+        case VMX20_ENGINE_SWITCH:
+            break;
+        case VMX20_ENGINE_THREADED:
+#if defined(__GNUC__)
+            break;
+#else
+            return 0;
+#endif
+        case VMX20_ENGINE_JIT:
+#if defined(__x86_64__)
+            break;
+#else
+            return 0;
+#endif
+        default:
+            return 0;
+    }
+    vm->engine = engine;
+    return 1;
+}
+
+int32_t setJitThreshold(void *handle, uint32_t threshold)
+{
+    struct VM *vm = handle;
+    if (!vm) return 0;
+    vm->jitThreshold = threshold;
+    return 1;
+}
+
+int32_t setMemoryModel(void *handle, int32_t model)
+{
+    struct VM *vm = handle;
+    if (!vm) return 0;
+    if (model != VMX20_MEMORY_RELAXED && model != VMX20_MEMORY_STRICT) return 0;
+    vm->memoryModel = model;
+    return 1;
+}
+
+int32_t setBudget(void *handle, uint64_t instructions, uint32_t milliseconds)
+{
+    struct VM *vm = handle;
+    if (!vm) return 0;
+    vm->budget = instructions > INT64_MAX ? INT64_MAX : instructions;
+    vm->timeLimit = milliseconds;
+    return 1;
+}
+
+int32_t setAffinity(void *handle, const int32_t cpus[], uint32_t n)
+{
+    struct VM *vm = handle;
+    if (!vm || n > VMX20_MAX_PROCESSORS) return 0;
+    memcpy(vm->affinity, cpus, sizeof(int32_t) * n);
+    vm->numAffinity = n;
+    return 1;
+}
+
+int32_t setScheduler(void *handle, int32_t scheduler, uint32_t quantum, uint32_t seed)
+{
+    struct VM *vm = handle;
+    if (!vm) return 0;
+    if (scheduler != VMX20_SCHEDULE_THREADS && scheduler != VMX20_SCHEDULE_DETERMINISTIC) return 0;
+    vm->scheduler = scheduler;
+    vm->quantum = quantum ? quantum : DEFAULT_QUANTUM;
+    vm->seed = seed;
+    return 1;
+}
+
+int32_t setSuperinstructions(void *handle, uint32_t mask)
+{
+    struct VM *vm = handle;
+    if (!vm) return 0;
+    vm->siMask = mask;
+    fuseProgram(vm);
+    return 1;
+}
+
+int32_t getSuperinstructionStats(void *handle, uint32_t index, char **name, uint64_t *hits)
+{
+    struct VM *vm = handle;
+    if (!vm || index >= VMX20_NUM_SUPERINSTRUCTIONS) return 0;
+    *name = superinstructions[index].name;
+    *hits = vm->siHits[index];
+    return 1;
+}
+
+int32_t getInstructionCount(void *handle, uint64_t *count)
+{
+    struct VM *vm = handle;
+    if (!vm) return 0;
+    *count = __atomic_load_n(&vm->executed, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// writers for formatWord; each returns the end of what it wrote
+static char *putText(char *out, const char *text)
+{
+    while (*text) *out++ = *text++;
+    return out;
+}
+
+static char *putDecimal(char *out, int32_t value)
+{
+    char digits[10];
+    int n = 0;
+    uint32_t magnitude = value < 0 ? -(uint32_t)value : (uint32_t)value;
+    if (value < 0) *out++ = '-';
+    do
+    {
+        digits[n++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+    while (n) *out++ = digits[--n];
+    return out;
+}
+
+static char *putRegister(char *out, int reg)
+{
+    *out++ = 'r';
+    return putDecimal(out, reg);
+}
+
+// disassemble word as if it were at address into buffer, which always
+//   gets at most 40 characters; returns 0 if it is not an instruction
+static int formatWord(int32_t word, uint32_t address, char *buffer)
+{
     unsigned char op = word & 0xff;
+    int r1 = (word >> 8) & 0xf, r2 = (word >> 12) & 0xf;
     int32_t addr;
-    char format = op_format(op);
-    // print pc, word, instruction
-    sprintf(buffer, "%-8s ", op_name(op));
-    char *b = malloc(32);
-    switch (format) {
-        case F_OP:
-            break;
+    // the name padded to 8 columns, then a space
+    char *out = putText(buffer, op_name(op));
+    while (out < buffer + 9) *out++ = ' ';
+    switch (op_format(op))
+    {
         case F_INVALID:
-            *errorNumber = VMX20_ILLEGAL_INSTRUCTION;
-            break;
+            *out = '\0';
+            return 0;
         case F_ADDR:    // call, jmp
             addr = EXTENDSIGN20(word >> 12);
-            sprintf(b, "%d", addr + address + 1);
-            strcat(buffer, b);
+            out = putDecimal(out, addr + address + 1);
             break;
         case F_REG:
-            sprintf(b, "r%d", (word >> 8) & 0xf);
-            strcat(buffer, b);
+            out = putRegister(out, r1);
             break;
         case F_REGCONST:
-            sprintf(b, "r%d, %d", (word >> 8) & 0xf, (int32_t)EXTENDSIGN20((word >> 12) & 0xfffff));
-            strcat(buffer, b);
+            out = putRegister(out, r1);
+            out = putText(out, ", ");
+            out = putDecimal(out, (int32_t)EXTENDSIGN20((word >> 12) & 0xfffff));
             break;
         case F_REGADDR:
             addr = EXTENDSIGN20(word >> 12);
-            sprintf(b, "r%d, ", (word >> 8) & 0xf);
-            strcat(buffer, b);
-            sprintf(b, "%d", addr+address+1);
-            strcat(buffer, b);
+            out = putRegister(out, r1);
+            out = putText(out, ", ");
+            out = putDecimal(out, addr + address + 1);
             break;
         case F_REGREG:
-            sprintf(b, "r%d, r%d", (word >> 8) & 0xf, (word >> 12) & 0xf);
-            strcat(buffer, b);
+            out = putRegister(out, r1);
+            out = putText(out, ", ");
+            out = putRegister(out, r2);
             break;
         case F_REGOFF:
-            sprintf(b, "r%d, %d(r%d)", (word >> 8) & 0xf, (int16_t)(word >> 16), (word >> 12) & 0xf);
-            strcat(buffer, b);
+            out = putRegister(out, r1);
+            out = putText(out, ", ");
+            out = putDecimal(out, (int16_t)(word >> 16));
+            out = putText(out, "(");
+            out = putRegister(out, r2);
+            out = putText(out, ")");
             break;
         case F_REGREGADDR:
             addr = (int16_t)(word >> 16);
-            sprintf(b, "r%d, r%d, ", (word >> 8) & 0xf, (word >> 12) & 0xf);
-            strcat(buffer, b);
-            sprintf(b, "%d", addr+address+1);
-            strcat(buffer, b);
+            out = putRegister(out, r1);
+            out = putText(out, ", ");
+            out = putRegister(out, r2);
+            out = putText(out, ", ");
+            out = putDecimal(out, addr + address + 1);
             break;
     }
-    free(b);
+    *out = '\0';
+    return 1;
+}
+
+int disassemble(void *handle, uint32_t address, char *buffer, int32_t *errorNumber)
+{
+    struct VM *vm = handle;
+    int32_t word;
+    if (address >= vm->progEnd || !getWord(vm, address, &word))
+    {
+        *errorNumber = VMX20_ADDRESS_OUT_OF_RANGE;
+        return 0;
+    }
+    *errorNumber = formatWord(word, address, buffer) ? 0 : VMX20_ILLEGAL_INSTRUCTION;
     return *errorNumber == 0;
- 
 }
 
-void cleanup(void *handle)
+// longest line of a listing: an address, ": ", an instruction and "\n"
+#define LISTING_LINE (10 + 2 + 40 + 1)
+
+uint32_t disassembleRange(void *handle, uint32_t address, uint32_t count, char *buffer,
+        size_t size, int32_t *errorNumber)
 {
     struct VM *vm = handle;
-    if (!vm) return;
-    if (vm->memory) free(vm->memory);
-    while (vm->symbols)
+    *errorNumber = 0;
+    char *out = buffer, *end = buffer + size;
+    uint32_t listed = 0;
+    for (; listed < count; listed++)
     {
-        sym_t *cur = vm->symbols;
-        vm->symbols = cur->next;
-        free(cur->name);
-        free(cur);
+        uint32_t at = address + listed;
+        int32_t word;
+        if (at >= vm->progEnd || !getWord(vm, at, &word))
+        {
+            *errorNumber = VMX20_ADDRESS_OUT_OF_RANGE;
+            break;
+        }
+        if (end - out <= LISTING_LINE) break;
+        // at least three digits, as testvm has always listed them
+        if (at < 100) *out++ = '0';
+        if (at < 10) *out++ = '0';
+        out = putDecimal(out, at);
+        out = putText(out, ": ");
+        if (!formatWord(word, at, out)) *errorNumber = VMX20_ILLEGAL_INSTRUCTION;
+        out += strlen(out);
+        *out++ = '\n';
     }
+    if (size) *out = '\0';
+    return listed;
+}
+
+void cleanup(void *handle)
+{
+    struct VM *vm = handle;
+    if (!vm) return;
+    if (vm->memory) munmap(vm->memory, sizeof(int32_t) * (size_t)vm->memSize);
+    freeSymbols(vm);
+    releaseCode(vm);
+    dropSuspended(vm);
+    profileClear(vm);
+    watchClear(vm);
+    replayClear(vm);
+    if (vm->traceFile) fclose(vm->traceFile);
+    free(vm->codeLock);
     free(vm->memLock);
     free(vm->traceLock);
     free(vm);
@@ -5,11 +5,18 @@
 //
 
 #include <stdint.h>
+#include <stdio.h>
 
 // maximum number of processors
 #define VMX20_MAX_PROCESSORS 16
 
 
+// memory size in words
+//   the default of initVm is 1MB (0xfffff bytes); initVmEx accepts any
+//   size up to VMX20_MAX_MEMORY words (4GB)
+#define VMX20_DEFAULT_MEMORY (0xfffff / 4)
+#define VMX20_MAX_MEMORY (1u << 30)
+
 // error codes 
 #define VMX20_NORMAL_TERMINATION 0
 
@@ -22,6 +29,58 @@
 #define VMX20_DIVIDE_BY_ZERO -5
 #define VMX20_ADDRESS_OUT_OF_RANGE -6
 #define VMX20_ILLEGAL_INSTRUCTION -7
+#define VMX20_BUDGET_EXCEEDED -8
+#define VMX20_REPLAY_DIVERGED -9
+
+// termination status of a processor that was stopped by suspendVm
+#define VMX20_SUSPENDED 1
+
+// execution engines
+//   VMX20_ENGINE_SWITCH runs one instruction per call through a switch
+//   VMX20_ENGINE_THREADED jumps directly from handler to handler (GCC
+//     labels-as-values); it is the default when available
+//   VMX20_ENGINE_JIT interprets until a basic block has been entered often
+//     enough (see setJitThreshold) and then runs it as native x86-64 code;
+//     x86-64 hosts only. it falls back to VMX20_ENGINE_THREADED under the
+//     strict memory model
+//   the default can be overridden with the VMX20_ENGINE environment
+//   variable set to "switch", "threaded" or "jit"
+#define VMX20_ENGINE_SWITCH 0
+#define VMX20_ENGINE_THREADED 1
+#define VMX20_ENGINE_JIT 2
+
+// memory models
+//   VMX20_MEMORY_RELAXED lets the processors access memory concurrently;
+//     every word access is atomic and cmpxchg is a full barrier, but
+//     ordinary loads and stores of different processors are not ordered
+//     beyond acquire/release. this is the default
+//   VMX20_MEMORY_STRICT serializes every memory-accessing instruction on a
+//     single lock, giving sequentially consistent execution for debugging
+//   the default can be overridden with the VMX20_MEMORY environment
+//   variable set to "relaxed" or "strict"
+#define VMX20_MEMORY_RELAXED 0
+#define VMX20_MEMORY_STRICT 1
+
+// schedulers
+//   VMX20_SCHEDULE_THREADS runs each processor on a thread of its own. this
+//     is the default
+//   VMX20_SCHEDULE_DETERMINISTIC runs all processors on the calling thread,
+//     taking turns in order of their number for a quantum of instructions
+//     each, so that an execution can be reproduced exactly (see
+//     setScheduler)
+//   the default can be overridden with the VMX20_SCHEDULE environment
+//   variable set to "threads" or "deterministic"
+#define VMX20_SCHEDULE_THREADS 0
+#define VMX20_SCHEDULE_DETERMINISTIC 1
+
+// number of superinstruction patterns (see setSuperinstructions)
+#define VMX20_NUM_SUPERINSTRUCTIONS 4
+
+// accesses a watch can catch (see addWatch); they can be or-ed together
+//   call, ret, push and pop read and write the stack like load and store
+#define VMX20_WATCH_READ 1
+#define VMX20_WATCH_WRITE 2
+#define VMX20_WATCH_CMPXCHG 4
 
 // initialize the vm
 //   function returns a handle to the structure holding the vm
@@ -32,8 +91,19 @@
 //     VMX20_INITIALIZE_FAILURE
 void *initVm(int32_t *errorNumber);
 
+// initialize a vm with the given amount of memory
+//   same as initVm, but the memory holds memoryWords words instead of
+//     VMX20_DEFAULT_MEMORY; memory is reserved up front and only backed
+//     by the host as it is used, so a large memory costs little until the
+//     program touches it. all of memory starts out as zero
+//   VMX20_INITIALIZE_FAILURE is returned if memoryWords is 0 or larger
+//     than VMX20_MAX_MEMORY
+void *initVmEx(uint32_t memoryWords, int32_t *errorNumber);
+
 // load an executable file
-//   only one executable file may be loaded at a time
+//   only one executable file may be loaded at a time; the symbols of a
+//     file loaded before are dropped, but what it left in memory stays.
+//     use reloadExecutableFile to start over with another program
 //   the function returns 1 if successful and 0 otherwise
 //   if 0 is returned then an error number is returned through the third
 //     parameter
@@ -44,12 +114,59 @@ void *initVm(int32_t *errorNumber);
 
 int32_t loadExecutableFile(void *handle, char *filename, int32_t *errorNumber);
 
+// read and decode an executable file once so that many vms can load it
+//   the image keeps the program words and its decoded program in the
+//     process; nothing is mapped from the file, which may change afterwards
+//   function returns a handle to the image, or NULL with an error number
+//     returned through the second parameter
+//   the error numbers are those of loadExecutableFile, and
+//     VMX20_INITIALIZE_FAILURE if there is not enough memory
+void *loadImage(char *filename, int32_t *errorNumber);
+
+// load an executable file that was read with loadImage
+//   same as loadExecutableFile, except that the file is not read again:
+//     the program words are copied from the image into the memory of the
+//     vm, which is never shared. only the decoded program of the image is
+//     shared with the other vms loaded from it, until the vm writes into
+//     its program (when it gets a copy of its own)
+//   the image may be released with cleanupImage while vms still use it
+int32_t loadExecutableImage(void *handle, void *image, int32_t *errorNumber);
+
+// release an image; it is freed once no vm uses it any more
+void cleanupImage(void *image);
+
+// replace the program of a vm by another executable file
+//   the vm ends up as if it had just been initialized and the file loaded
+//     into it, without allocating it again: memory is cleared in place,
+//     and the symbols, decoded and compiled code, suspended processors,
+//     termination statuses, profile and watches of the old program are
+//     dropped. what was set for the vm (engine, memory model, scheduler,
+//     budget, stacks, affinity, superinstructions, trace, record and
+//     replay files) stays, and it can be submitted to the same host again
+//   the vm must not be executing, under execute or as a job of a host
+//   if the file can not be read the old program stays loaded
+//   the function returns 1 if successful and 0 otherwise, with the error
+//     numbers of loadExecutableFile, and VMX20_INITIALIZE_FAILURE if the
+//     memory can not be cleared
+int32_t reloadExecutableFile(void *handle, char *filename, int32_t *errorNumber);
+
+// replace the program of a vm by an image read with loadImage
+//   same as reloadExecutableFile; see loadExecutableImage
+int32_t reloadExecutableImage(void *handle, void *image, int32_t *errorNumber);
+
 // get the address of a symbol in the current executable file
 //   the label must be a symbol in the insymbol section of the executable file
 //   the address is returned through the third parameter
 //   the function returns 1 if successful and 0 otherwise
 int32_t getAddress(void *handle, char *label, uint32_t *outAddr);
 
+// get the symbol of an address in the current executable file
+//   the symbol is the insymbol with the highest address at or below addr;
+//     its name is returned through the third parameter and the distance of
+//     addr from it through the fourth
+//   the function returns 1 if successful and 0 if there is no such symbol
+int32_t getSymbol(void *handle, uint32_t addr, char **name, uint32_t *offset);
+
 // read a word from memory
 //   the word is returned through the third parameter
 //   the function returns 1 if successful and 0 otherwise
@@ -59,6 +176,24 @@ int32_t getWord(void *handle, uint32_t addr, int32_t *outWord);
 //   the function returns 1 if successful and 0 otherwise
 int32_t putWord(void *handle, uint32_t addr, int32_t word);
 
+// read n consecutive words from memory, starting at addr
+//   the words are returned through the fourth parameter
+//   the function returns 1 if successful and 0 if any of them is out of range
+int32_t getWords(void *handle, uint32_t addr, uint32_t n, int32_t *outWords);
+
+// write n consecutive words to memory, starting at addr
+//   the function returns 1 if successful and 0 if any of them is out of range,
+//     in which case nothing is written
+int32_t putWords(void *handle, uint32_t addr, uint32_t n, const int32_t *words);
+
+// get a pointer to n consecutive words of memory, starting at addr
+//   the pointer is returned through the fourth parameter and stays valid
+//     until the vm is cleaned up or loads another executable file
+//   words written through it are seen by the cores as data, but not as
+//     instructions; use putWords to write code
+//   the function returns 1 if successful and 0 if any of them is out of range
+int32_t getMemoryView(void *handle, uint32_t addr, uint32_t n, int32_t **view);
+
 // execute the current loaded executable file
 //   the function returns 1 if all processors are successfully started and
 //     0 otherwise
@@ -71,6 +206,10 @@ int32_t putWord(void *handle, uint32_t addr, int32_t word);
 //     VMX20_DIVIDE_BY_ZERO
 //     VMX20_ADDRESS_OUT_OF_RANGE
 //     VMX20_ILLEGAL_INSTRUCTION
+//     VMX20_BUDGET_EXCEEDED if the budget ran out (see setBudget)
+//     VMX20_SUSPENDED if suspendVm stopped the processor (see resumeVm)
+//     VMX20_REPLAY_DIVERGED if a replayed execution went differently
+//       from its recording (see setReplayFile)
 //   the fourth parameter is a Boolean indicating whether an instruction
 //     trace should be be printed to stderr
 //   Note: that all other registers will be initialized to 0, including
@@ -79,6 +218,282 @@ int32_t putWord(void *handle, uint32_t addr, int32_t word);
 int32_t execute(void *handle, uint32_t numProcessors, uint32_t initialSP[],
       int terminationStatus[], int32_t trace);
 
+// start a host that runs the processors of many vms on a pool of threads
+//   the first parameter is the number of worker threads; 0 uses one per
+//     online host cpu
+//   the second parameter is the number of instructions a processor runs
+//     before it has to let a waiting one have the worker; 0 uses 100000.
+//     the count is approximate: it is only checked at branches
+//   function returns a handle to the host, or NULL with
+//     VMX20_INITIALIZE_FAILURE returned through the third parameter
+void *initHost(uint32_t numWorkers, uint32_t quantum, int32_t *errorNumber);
+
+// run the loaded executable file of a vm on a host
+//   same as execute without a trace, but returns as soon as the processors
+//     are queued; the result is collected with waitJob or pollJob
+//   the vm must not be executed, submitted again or cleaned up until its
+//     job has been returned by waitJob or pollJob
+//   the function returns 1 if successful and 0 otherwise
+int32_t submitJob(void *host, void *handle, uint32_t numProcessors, uint32_t initialSP[]);
+
+// wait for a submitted job to complete
+//   jobs are returned in the order they complete; the vm handle of the job
+//     is returned through the second parameter and the termination status
+//     of each processor through the third, as by execute
+//   the function returns 1 if a job was returned and 0 if no job is left
+int32_t waitJob(void *host, void **handle, int terminationStatus[]);
+
+// same as waitJob, but returns 0 at once if no job has completed yet
+int32_t pollJob(void *host, void **handle, int terminationStatus[]);
+
+// pin the worker threads of a host to host cpus
+//   worker i runs on host cpu cpus[i % n]; n = 0 lets them run anywhere
+//   the function returns 1 if successful and 0 otherwise
+int32_t setHostAffinity(void *host, const int32_t cpus[], uint32_t n);
+
+// stop a host; jobs that were submitted are run to completion first
+void cleanupHost(void *host);
+
+// ask the processors of an executing vm to stop
+//   may be called from any thread while execute or resumeVm runs. every
+//     processor stops within about a million instructions, and execute
+//     returns VMX20_SUSPENDED for each one that has not terminated yet
+//   the function returns 1 if successful and 0 otherwise
+int32_t suspendVm(void *handle);
+
+// continue the suspended processors of a vm
+//   the second parameter is used to return the termination status of
+//     every processor of the execution, as by execute
+//   the function returns 1 if the processors were resumed and 0 if none
+//     is suspended
+int32_t resumeVm(void *handle, int terminationStatus[]);
+
+// write the state of a vm to a file
+//   the snapshot holds memory, the symbol table, the entry point and the
+//     end of the program, the registers and the rest of the budget of every
+//     suspended processor, and what setBudget and setStacks set; pages of
+//     memory that are all zero are left out
+//   a file that exists is replaced by a new one rather than overwritten,
+//     so vms restored from it are not affected
+//   the vm must not be executing
+//   the function returns 1 if successful and 0 otherwise, with the error
+//     number VMX20_FILE_NOT_FOUND if the file can not be written
+int32_t snapshotVm(void *handle, char *filename, int32_t *errorNumber);
+
+// create a vm from a snapshot
+//   the vm is in the state the snapshot was taken in; suspended processors
+//     continue with resumeVm, with their stacks checked rather than
+//     guarded. memory is mapped copy-on-write from the file, so any number
+//     of vms can be restored from one snapshot cheaply; the file must not
+//     be changed in place while they exist (snapshotVm replaces it)
+//   function returns a handle to the new vm, or NULL with an error number
+//     returned through the second parameter:
+//     VMX20_FILE_NOT_FOUND
+//     VMX20_FILE_IS_NOT_VALID
+//     VMX20_INITIALIZE_FAILURE
+void *restoreVm(char *filename, int32_t *errorNumber);
+
+// select the execution engine used by subsequent calls to execute
+//   the function returns 1 if successful and 0 if the engine is unknown or
+//     not supported by this build
+//   a traced execution always uses VMX20_ENGINE_SWITCH
+int32_t setEngine(void *handle, int32_t engine);
+
+// set how many times a basic block must be entered before the JIT engine
+//   compiles it; the default is 16 or the value of the VMX20_JIT_THRESHOLD
+//   environment variable
+//   the function returns 1 if successful and 0 otherwise
+int32_t setJitThreshold(void *handle, uint32_t threshold);
+
+// select the memory model used by subsequent calls to execute
+//   the function returns 1 if successful and 0 if the model is unknown
+int32_t setMemoryModel(void *handle, int32_t model);
+
+// limit subsequent calls to execute and resumeVm
+//   each processor may execute at most instructions instructions, counted
+//     over its whole run including resumes, and stops with the termination
+//     status VMX20_BUDGET_EXCEEDED once it has; 0 means no limit
+//   every processor still running milliseconds after the start of a call
+//     stops with the same status; 0 means no limit
+//   both are checked at taken branches, so a processor may overrun its
+//     budget by the length of a basic block and its deadline by a slice of
+//     about a million instructions. loops the JIT engine runs natively
+//     stop at the end of the slice as well
+//   the function returns 1 if successful and 0 otherwise
+int32_t setBudget(void *handle, uint64_t instructions, uint32_t milliseconds);
+
+// set the stacks of the processors of subsequent calls to execute and
+//   submitJob
+//   the stack of processor i is sizes[i % n] words ending at its initial
+//     SP, but never below the end of the program; call and push beyond it
+//     stop the processor with VMX20_ADDRESS_OUT_OF_RANGE. a size of 0, and
+//     n = 0, let the stack grow down to the end of the program, which is
+//     the default
+//   with guard set, execute makes the page below and the page above each
+//     stack inaccessible and the threaded engine drops its stack checks: a
+//     processor that touches a guard page stops with
+//     VMX20_ADDRESS_OUT_OF_RANGE when it does. only stacks that start and
+//     end on page boundaries with free pages around them are guarded, and
+//     only in the relaxed memory model and while no execution is recorded
+//     or replayed; the others keep their checks.
+//     getWord and the other accessors fail on guard pages while they exist
+//   the function returns 1 if successful and 0 if n is larger than
+//     VMX20_MAX_PROCESSORS
+int32_t setStacks(void *handle, const uint32_t sizes[], uint32_t n, int32_t guard);
+
+// pin the threads of subsequent calls to execute and resumeVm to host cpus
+//   processor i runs on host cpu cpus[i % n] and allocates its state there;
+//     n = 0 lets the threads run anywhere, which is the default
+//   the function returns 1 if successful and 0 if n is larger than
+//     VMX20_MAX_PROCESSORS
+int32_t setAffinity(void *handle, const int32_t cpus[], uint32_t n);
+
+// select the scheduler used by subsequent calls to execute and resumeVm
+//   quantum is the number of instructions a processor runs per turn under
+//     VMX20_SCHEDULE_DETERMINISTIC, 0 for the default of 10000. turns end
+//     after exactly that many instructions, so the processors run on the
+//     switch engine whatever engine is set
+//   with a seed other than 0 the length of each turn is drawn from 1 to
+//     2 * quantum instead, which gives a different interleaving for every
+//     seed; the same seed, engine and program always give the same one.
+//     the default seed is 0 or the value of the VMX20_SEED environment
+//     variable
+//   the function returns 1 if successful and 0 if the scheduler is unknown
+int32_t setScheduler(void *handle, int32_t scheduler, uint32_t quantum, uint32_t seed);
+
+// select which superinstructions the threaded engine may use
+//   a superinstruction executes a common sequence of instructions with a
+//   single dispatch; bit i of the mask enables pattern i:
+//     0 ldimm+cmpxchg+beq
+//     1 load+addi+store
+//     2 subi+bgt
+//     3 float loop: a counted loop of ldind, stind, addf, subf, mulf, divf
+//       and addi between a beq and a jmp back to it, run natively and, if
+//       its iterations are independent, several at a time with host
+//       vector instructions; results are bit-identical
+//   all patterns are enabled by default; the default can be overridden
+//   with the VMX20_SUPERINSTRUCTIONS environment variable
+//   the function returns 1 if successful and 0 otherwise
+int32_t setSuperinstructions(void *handle, uint32_t mask);
+
+// get the hit counter of a superinstruction
+//   the name of pattern index is returned through the third parameter and
+//     the number of times it was executed, summed over all calls to
+//     execute, through the fourth parameter
+//   the function returns 1 if successful and 0 if index is out of range
+int32_t getSuperinstructionStats(void *handle, uint32_t index, char **name, uint64_t *hits);
+
+// get the number of instructions executed by all cores since the last call
+//   to execute or submitJob, including those run by resumeVm
+//   the instruction that halted or trapped a core is not counted
+//   the function returns 1 if successful and 0 otherwise
+int32_t getInstructionCount(void *handle, uint64_t *count);
+
+// write the trace of subsequent traced executions to a file
+//   instead of being printed, each instruction of a traced execution is
+//     appended to the file as a fixed-size binary record, which tracex20
+//     turns back into the printed format; see vmx20_trace.h for the layout
+//   the file is created or truncated; NULL closes it and restores printing
+//   the function returns 1 if successful and 0 if the file can not be
+//     opened
+int32_t setTraceFile(void *handle, char *filename);
+
+// record subsequent calls to execute into a file
+//   a recorded execution logs the order in which the processors accessed
+//     memory and the outcome of every cmpxchg, which is all a replay needs
+//     to repeat it exactly. the processors run on VMX20_ENGINE_SWITCH and
+//     take turns at each instruction that accesses memory
+//   the file is created or truncated now and written when every processor
+//     of the execution has terminated, including after resumeVm; it holds
+//     the last recorded execution. it is not written if the log does not
+//     fit into memory
+//   NULL stops recording
+//   the function returns 1 if successful and 0 if the file can not be
+//     created or the vm has suspended processors
+int32_t setRecordFile(void *handle, char *filename);
+
+// replay the execution recorded in a file in subsequent calls to execute
+//   the processors access memory in the order they did when it was
+//     recorded, whatever the scheduler, so every run computes the same;
+//     the execution has to start from the same program, data and stack
+//     pointers. a processor that does anything else stops with
+//     VMX20_REPLAY_DIVERGED, as do the ones left waiting for it
+//   execute fails if the program or the number of processors is not the
+//     one recorded
+//   NULL stops replaying
+//   the function returns 1 if successful and 0 if the file can not be
+//     read or is not a recording, or the vm has suspended processors
+int32_t setReplayFile(void *handle, char *filename);
+
+// enable or disable profiling for subsequent calls to execute
+//   a profiled execution runs on VMX20_ENGINE_SWITCH and counts, for each
+//     processor, the instructions executed, the executions of each opcode
+//     and of each address, conditional branches taken and not taken,
+//     failed cmpxchg and waits for the memory lock (strict memory model)
+//   the function returns 1 if successful and 0 otherwise
+int32_t setProfiling(void *handle, int32_t enable);
+
+// print the profile of the last profiled execution
+//   the report lists the counters of each processor, the opcode mix, the
+//     most executed addresses with the nearest insymbol and their
+//     disassembly, and the functions that took the most instructions
+//   a function is the address of a call, or the entry point, named by its
+//     insymbol. it is credited with the instructions executed in it
+//     (exclusive) and those from its outermost call to the ret from it
+//     (inclusive), counted by following call and ret on a shadow stack of
+//     each processor
+//   the function returns 1 if successful and 0 if there is no profile
+int32_t printProfile(void *handle, FILE *out);
+
+// print the call stacks of the last profiled execution as folded stacks,
+//   the input of flame graph tools
+//   each line is a stack of functions (see printProfile) from the entry
+//     point in, separated by semicolons, a space and the number of
+//     instructions executed in the innermost one with the others below it;
+//     the processors are added together
+//   the function returns 1 if successful and 0 if there is no profile
+int32_t printFoldedStacks(void *handle, FILE *out);
+
+// called for every access a watch catches, on the thread of the processor
+//   that made it and after the instruction has executed
+//   the parameters are the vm, the number of the processor, the address of
+//     the instruction, the address of the word, the access (one of
+//     VMX20_WATCH_*), the word as the access left it and the argument the
+//     watch was added with
+//   the callback returns 1 to let the processor go on and 0 to suspend the
+//     vm, as suspendVm does
+typedef int32_t (*vmx20_watch_t)(void *handle, uint32_t pid, uint32_t pc, uint32_t addr,
+        int32_t access, int32_t word, void *arg);
+
+// watch n words from addr for subsequent calls to execute and resumeVm
+//   access is the set of accesses to catch, VMX20_WATCH_* or-ed together.
+//     a watch without a callback is a data breakpoint: the first access it
+//     catches suspends the vm, and getWatchHit tells which one it was
+//   while any watch is set the processors run on VMX20_ENGINE_SWITCH;
+//     without watches the engines do not look for them at all
+//   the vm must not be executing
+//   the number of the watch, for removeWatch, is returned through the last
+//     parameter
+//   the function returns 1 if successful and 0 if the range is outside of
+//     memory, access is empty or the watch can not be stored
+int32_t addWatch(void *handle, uint32_t addr, uint32_t n, int32_t access,
+        vmx20_watch_t callback, void *arg, uint32_t *id);
+
+// remove a watch added by addWatch
+//   the vm must not be executing
+//   the function returns 1 if successful and 0 if there is no such watch
+int32_t removeWatch(void *handle, uint32_t id);
+
+// get the access that suspended the vm in the last call to execute or
+//   resumeVm, through a watch without a callback or one whose callback
+//   returned 0
+//   the number of the watch, the number of the processor, the address of
+//     the instruction and the address of the word are returned through the
+//     other parameters
+//   the function returns 1 if successful and 0 if no watch suspended the vm
+int32_t getWatchHit(void *handle, uint32_t *id, uint32_t *pid, uint32_t *pc,
+        uint32_t *addr);
+
 // disassemble the word at the given address
 //   return 1 if successful and 0 otherwise
 //   the second parameter contains the address of the word to disassemble
@@ -98,5 +513,19 @@ int32_t execute(void *handle, uint32_t numProcessors, uint32_t initialSP[],
 //     VMX20_ILLEGAL_INSTRUCTION
 int disassemble(void *handle, uint32_t address, char *buffer, int32_t *errorNumber);
 
+// disassemble count words from the given address into a listing
+//   each line is the address in decimal, at least three digits wide, a
+//     colon, a space and the word as disassemble formats it, then a
+//     newline; words that are not instructions are listed as "unknown"
+//   at most size bytes, including the terminating zero, are written to
+//     buffer; the listing stops early at the first line that may not fit
+//     and at the end of the program
+//   the last parameter returns VMX20_ADDRESS_OUT_OF_RANGE if the listing
+//     reached the end of the program, VMX20_ILLEGAL_INSTRUCTION if a word
+//     is not an instruction and 0 otherwise
+//   the function returns the number of words listed
+uint32_t disassembleRange(void *handle, uint32_t address, uint32_t count, char *buffer,
+        size_t size, int32_t *errorNumber);
+
 // cleanup everything after simulation is done
 void cleanup(void *handle);
\ No newline at end of file
@@ -0,0 +1,229 @@
+//
+// vmx20_host.c
+//
+// host for running many vms at once
+//   a fixed pool of worker threads takes cores from a single run queue,
+//   runs each for a time slice with runCore and puts it back at the end of
+//   the queue if it has not terminated, so any number of cores of any
+//   number of vms share the workers. a job is done once all of its cores
+//   have terminated; done jobs wait in a completion queue for waitJob.
+//
+
+#define _GNU_SOURCE    // pthread_setaffinity_np
+#include "vmx20.h"
+#include "vmx20_internal.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEFAULT_QUANTUM 100000      // instructions per slice
+
+typedef struct Job {
+    struct VM *vm;
+    uint32_t numProcessors;
+    uint32_t running;           // cores that have not terminated yet
+    int status[VMX20_MAX_PROCESSORS];
+    struct Job *next;           // completion queue
+} job_t;
+
+struct Host {
+    pthread_mutex_t lock;       // protects everything below
+    pthread_cond_t work;        // run queue not empty, or stopping
+    pthread_cond_t finished;    // a job was completed
+    core_t *runHead;
+    core_t *runTail;
+    job_t *doneHead;
+    job_t *doneTail;
+    uint32_t outstanding;       // jobs submitted but not yet waited for
+    int stopping;
+    int64_t quantum;
+    uint32_t numWorkers;
+    pthread_t *workers;
+};
+
+// called with the lock held
+static void enqueueCore(struct Host *host, core_t *core)
+{
+    core->next = NULL;
+    if (host->runTail) host->runTail->next = core;
+    else host->runHead = core;
+    host->runTail = core;
+}
+
+static void *worker(void *arg)
+{
+    struct Host *host = arg;
+    pthread_mutex_lock(&host->lock);
+    while (1)
+    {
+        while (!host->runHead && !host->stopping)
+        {
+            pthread_cond_wait(&host->work, &host->lock);
+        }
+        core_t *core = host->runHead;
+        if (!core) break;   // stopping and nothing left to run
+        host->runHead = core->next;
+        if (!host->runHead) host->runTail = NULL;
+        pthread_mutex_unlock(&host->lock);
+
+        int running = runSlice(core, host->quantum);
+
+        pthread_mutex_lock(&host->lock);
+        if (running)
+        {
+            enqueueCore(host, core);
+            continue;
+        }
+        job_t *job = core->job;
+        int pid = core->pid;
+        job->status[pid] = finishCore(core);
+        if (--job->running == 0)
+        {
+            job->next = NULL;
+            if (host->doneTail) host->doneTail->next = job;
+            else host->doneHead = job;
+            host->doneTail = job;
+            pthread_cond_broadcast(&host->finished);
+        }
+    }
+    pthread_mutex_unlock(&host->lock);
+    return NULL;
+}
+
+void *initHost(uint32_t numWorkers, uint32_t quantum, int32_t *errorNumber)
+{
+    if (numWorkers == 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        numWorkers = online > 0 ? online : 1;
+    }
+    struct Host *host = calloc(1, sizeof(struct Host));
+    if (!host) {*errorNumber = VMX20_INITIALIZE_FAILURE; return NULL;}
+    host->workers = calloc(numWorkers, sizeof(pthread_t));
+    if (!host->workers) {*errorNumber = VMX20_INITIALIZE_FAILURE; free(host); return NULL;}
+    host->quantum = quantum ? quantum : DEFAULT_QUANTUM;
+    pthread_mutex_init(&host->lock, NULL);
+    pthread_cond_init(&host->work, NULL);
+    pthread_cond_init(&host->finished, NULL);
+    for (uint32_t i = 0; i < numWorkers; i++)
+    {
+        if (pthread_create(&host->workers[i], NULL, &worker, host))
+        {
+            host->numWorkers = i;
+            cleanupHost(host);
+            *errorNumber = VMX20_INITIALIZE_FAILURE;
+            return NULL;
+        }
+    }
+    host->numWorkers = numWorkers;
+    *errorNumber = VMX20_NORMAL_TERMINATION;
+    return host;
+}
+
+int32_t submitJob(void *hostHandle, void *handle, uint32_t numProcessors, uint32_t initialSP[])
+{
+    struct Host *host = hostHandle;
+    struct VM *vm = handle;
+    if (!host || !vm || numProcessors == 0 || numProcessors > VMX20_MAX_PROCESSORS) return 0;
+    job_t *job = calloc(1, sizeof(job_t));
+    if (!job) return 0;
+    job->vm = vm;
+    job->numProcessors = numProcessors;
+    job->running = numProcessors;
+
+    beginExecution(vm, numProcessors, 0);
+    core_t *cores[VMX20_MAX_PROCESSORS];
+    for (uint32_t i = 0; i < numProcessors; i++)
+    {
+        cores[i] = createCore(vm, i, initialSP[i]);
+        if (!cores[i])
+        {
+            for (uint32_t j = 0; j < i; j++) finishCore(cores[j]);
+            free(job);
+            return 0;
+        }
+        cores[i]->job = job;
+    }
+
+    pthread_mutex_lock(&host->lock);
+    host->outstanding++;
+    for (uint32_t i = 0; i < numProcessors; i++) enqueueCore(host, cores[i]);
+    pthread_cond_broadcast(&host->work);
+    pthread_mutex_unlock(&host->lock);
+    return 1;
+}
+
+// take a job off the completion queue, waiting for one if block is set
+static int32_t takeJob(struct Host *host, int block, void **handle, int terminationStatus[])
+{
+    pthread_mutex_lock(&host->lock);
+    while (block && !host->doneHead && host->outstanding > 0)
+    {
+        pthread_cond_wait(&host->finished, &host->lock);
+    }
+    job_t *job = host->doneHead;
+    if (job)
+    {
+        host->doneHead = job->next;
+        if (!host->doneHead) host->doneTail = NULL;
+        host->outstanding--;
+    }
+    pthread_mutex_unlock(&host->lock);
+    if (!job) return 0;
+
+    *handle = job->vm;
+    memcpy(terminationStatus, job->status, sizeof(int) * job->numProcessors);
+    free(job);
+    return 1;
+}
+
+int32_t waitJob(void *host, void **handle, int terminationStatus[])
+{
+    if (!host) return 0;
+    return takeJob(host, 1, handle, terminationStatus);
+}
+
+int32_t pollJob(void *host, void **handle, int terminationStatus[])
+{
+    if (!host) return 0;
+    return takeJob(host, 0, handle, terminationStatus);
+}
+
+int32_t setHostAffinity(void *hostHandle, const int32_t cpus[], uint32_t n)
+{
+    struct Host *host = hostHandle;
+    if (!host) return 0;
+    int32_t ok = 1;
+    for (uint32_t i = 0; i < host->numWorkers; i++)
+    {
+        ok &= pinThread(host->workers[i], n ? cpus[i % n] : -1);
+    }
+    return ok;
+}
+
+void cleanupHost(void *hostHandle)
+{
+    struct Host *host = hostHandle;
+    if (!host) return;
+    pthread_mutex_lock(&host->lock);
+    host->stopping = 1;
+    pthread_cond_broadcast(&host->work);
+    pthread_mutex_unlock(&host->lock);
+    for (uint32_t i = 0; i < host->numWorkers; i++)
+    {
+        pthread_join(host->workers[i], NULL);
+    }
+    while (host->doneHead)
+    {
+        job_t *job = host->doneHead;
+        host->doneHead = job->next;
+        free(job);
+    }
+    pthread_cond_destroy(&host->finished);
+    pthread_cond_destroy(&host->work);
+    pthread_mutex_destroy(&host->lock);
+    free(host->workers);
+    free(host);
+}
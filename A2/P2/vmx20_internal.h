@@ -0,0 +1,341 @@
+//
+// vmx20_internal.h
+//
+// state shared between the modules of the vmx20 library; not part of the
+// public interface
+//
+
+#ifndef VMX20_INTERNAL_H
+#define VMX20_INTERNAL_H
+
+#include "vmx20.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define FP 13
+#define SP 14
+#define PC 15
+#define HALT 0x1f
+#define SPIN_BUCKETS 64     // words waited on are counted by address modulo this
+
+// cores are aligned to and padded to whole cache lines, so that the
+//   registers of cores running on different host cpus never share a line
+#define CACHE_LINE 64
+#if defined(__GNUC__)
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE)))
+#else
+#define CACHE_ALIGNED
+#endif
+
+typedef struct Symbol {
+    char *name;
+    void *next;
+    int32_t address;
+} sym_t;
+
+// VM shouldn't have registers at all; should all be in Core
+struct VM {
+    int32_t reg[16];    // registers
+    int32_t *memory;    // main memory
+                        // memory[0] is where program is loaded
+    uint32_t memSize;   // words of memory
+    uint32_t entryPoint;   // where execution should begin
+    uint32_t progEnd;      // end of program (memory[n] < prog_end is program)
+    int numProcessors;     // number of processors (set on execute())
+    int trace;             // whether to trace execution or not
+    int engine;            // VMX20_ENGINE_* used by execute()
+    int memoryModel;       // VMX20_MEMORY_*
+    int scheduler;         // VMX20_SCHEDULE_*
+    uint32_t quantum;      // instructions per turn (VMX20_SCHEDULE_DETERMINISTIC)
+    uint32_t seed;         // varies the turns if not 0
+    uint64_t budget;       // instructions per core (setBudget), 0 if unlimited
+    uint32_t timeLimit;    // milliseconds per call, 0 if unlimited
+    uint64_t deadline;     // CLOCK_MONOTONIC ns of the running call, 0 if none
+    uint64_t executed;     // instructions since execute (getInstructionCount)
+    
+    pthread_mutex_t *traceLock;
+    pthread_mutex_t *memLock;
+
+    sym_t *symbols;     // linked list of the insymbols
+    struct SymbolIndex *symbolIndex;   // lookup by name and by address
+
+    struct DecodedOp *code;    // pre-decoded copy of memory[0..codeEnd)
+    uint32_t codeEnd;          // number of decoded words (0 if none)
+    struct Image *image;       // image the program was loaded from, or NULL
+    int codeShared;            // code belongs to image; copy before writing
+    pthread_mutex_t *codeLock; // taken to make that copy
+
+    uint32_t siMask;           // superinstructions that may be fused
+    uint64_t siHits[VMX20_NUM_SUPERINSTRUCTIONS];   // totals over all executions
+
+    struct Jit *jit;           // compiled blocks (VMX20_ENGINE_JIT), or NULL
+    uint32_t jitThreshold;     // block entries before a block is compiled
+
+    FILE *traceFile;           // binary trace output (setTraceFile), or NULL
+    struct Tracer *tracer;     // writer of the running traced execution
+
+    int spinWaiters;           // cores sleeping in spinWait
+    int spinWaiting[SPIN_BUCKETS];  // of them, by the address of their word
+
+    uint32_t stackWords[VMX20_MAX_PROCESSORS]; // stack size of each core (setStacks)
+    uint32_t numStackWords;    // entries in stackWords; 0 if stacks are unbounded
+    int stackGuard;            // whether execute puts guard pages around stacks
+    uint32_t guards[2 * VMX20_MAX_PROCESSORS];  // first word of each guard page
+    uint32_t numGuards;        // guard pages in place
+
+    int32_t affinity[VMX20_MAX_PROCESSORS];    // host cpu of each core (setAffinity)
+    uint32_t numAffinity;      // entries in affinity; 0 if cores are not pinned
+
+    int suspendRequested;      // set by suspendVm; cores stop at their next slice
+    struct Core *cores[VMX20_MAX_PROCESSORS];  // suspended cores, for resumeVm
+    int status[VMX20_MAX_PROCESSORS];          // status of each core as of now
+
+    struct Watch *watches;     // set by addWatch, in the order they were added
+    uint32_t numWatches;
+    uint32_t nextWatch;        // number of the next watch
+    uint64_t *watchPages;      // a bit per page holding a watched word; NULL if none
+    int watchHit;              // whether a watch suspended the vm (getWatchHit)
+    uint32_t hitWatch, hitPid, hitPc, hitAddr;   // and where
+
+    struct Replay *replay;     // log being recorded or replayed, or NULL
+
+    int profiling;             // whether execute() collects a profile
+    int profiledCores;         // number of entries in profiles
+    struct Profile *profiles[VMX20_MAX_PROCESSORS];   // of the last execute()
+};
+
+// pre-decoded instruction
+//   built once per word of the program by decodeProgram so that the
+//   interpreter does not have to re-shift and re-sign-extend every step.
+//   PC-relative operands are resolved to absolute addresses.
+#define OP_UNDECODED 0xff   // data, or invalidated by a store; refetch
+#define OP_BADFETCH  0xfe   // pc is outside of memory
+
+typedef struct DecodedOp {
+    uint8_t op;         // opcode (INS_INVALID if not executable)
+    uint8_t r1;         // first register operand
+    uint8_t r2;         // second register operand
+    uint8_t base;       // opcode of the word itself, even when op is fused
+    int32_t arg;        // constant, offset or absolute target address
+} dop_t;
+
+// superinstructions
+//   short idioms that the threaded engine executes with a single dispatch.
+//   only the head of a sequence gets the SI_* opcode; the words after it
+//   keep their own decoding, so branching into the middle of a sequence
+//   still works and a store into any of them simply stops the fusion.
+#define SI_CAS_BEQ          0x40    // ldimm; cmpxchg; beq (lock acquire)
+#define SI_LOAD_ADDI_STORE  0x41    // load; addi; store (memory increment)
+#define SI_SUBI_BGT         0x42    // subi; bgt (counted loop)
+#define SI_FLOAT_LOOP       0x43    // beq ... jmp over floats in memory (vmx20_loops.c)
+#define SI_FIRST            SI_CAS_BEQ
+#define IS_SUPER(op)        ((op) >= SI_FIRST && (op) < SI_FIRST + VMX20_NUM_SUPERINSTRUCTIONS)
+
+// call graph of a profiled core
+//   a node per calling context: the same callee reached through different
+//   callers gets a node under each. node 0 is the entry point and never
+//   anyone's child. the shadow stack has a frame per call not yet
+//   returned from, with the node to go back to below it
+typedef struct CallNode {
+    uint32_t callee;        // address called
+    uint32_t parent;        // node of the caller
+    uint32_t child;         // first node called from here, 0 if none
+    uint32_t sibling;       // next node called from the parent, 0 if none
+    uint32_t function;      // index into functions
+    uint64_t self;          // instructions executed here, not in callees
+} call_node_t;
+
+typedef struct CallFunction {
+    uint32_t address;
+    uint32_t active;        // frames of it on the shadow stack
+    uint64_t calls;
+    uint64_t inclusive;     // instructions from the outermost call to its return
+} call_function_t;
+
+typedef struct CallFrame {
+    uint32_t node;
+    uint32_t function;
+    uint64_t start;         // retired when it was called
+} call_frame_t;
+
+// per-core profile counters
+//   owned by a single core while it runs, so they are plain increments.
+//   pcHits has one slot per decoded word plus one for everything else.
+typedef struct Profile {
+    uint64_t retired;           // instructions executed
+    uint64_t ops[256];          // by opcode (of the word, never fused)
+    uint64_t taken;             // conditional branches taken
+    uint64_t notTaken;          // conditional branches not taken
+    uint64_t cmpxchgFailed;     // cmpxchg that found another value
+    uint64_t lockWaits;         // memLock acquisitions that had to wait
+    uint64_t nanoseconds;       // time the core spent running
+    uint32_t pcCount;           // words covered by pcHits
+    uint64_t *pcHits;           // pcHits[pc], pcHits[pcCount] if pc >= pcCount
+    call_node_t *nodes;         // call graph; see CallNode
+    uint32_t numNodes, maxNodes;
+    call_function_t *functions; // everything called, and the entry point
+    uint32_t numFunctions, maxFunctions;
+    call_frame_t *frames;       // shadow stack; frames[0] is the entry point
+    uint32_t depth, maxDepth;
+    uint32_t current;           // node of the innermost frame
+    int callsLost;              // the call graph ran out of memory and stopped
+} profile_t;
+
+// executable file read and decoded once (loadImage); any number of vms
+//   can load from it and run on its decoded program until they write to it
+typedef struct Image {
+    int32_t *words;     // the program, in the mapped file
+    uint32_t numWords;
+    uint32_t entryPoint;
+    sym_t *symbols;     // insymbols in file order; names are in the mapped file
+    void *map;          // the whole file, mapped read-only
+    size_t mapSize;
+    dop_t *code;        // decoded program, read-only while shared
+    uint32_t siMask;    // superinstructions fused into code
+    int refs;           // owners: the loader and every vm using it
+} image_t;
+
+typedef struct Core {
+    int32_t reg[16];    // registers
+    uint32_t stack;     // memory addr of bottom of stack
+    uint32_t stackLow;  // lowest word the stack may grow down to
+    int guarded;        // stack has guard pages; call, ret, push, pop skip checks
+    //uint32_t stackSize;   // size of stack
+    struct VM *vm;      // vm handle
+    int status;         // terminationStatus
+    int pid;             // getpid instr return value
+    uint64_t siHits[VMX20_NUM_SUPERINSTRUCTIONS];   // superinstructions executed
+    profile_t *profile;     // counters, or NULL when not profiling
+    struct TraceRing *ring; // binary trace records, or NULL when not traced
+    struct ReplayCore *replay;  // log of the core when recording or replaying
+    int64_t slice;          // instructions left before yielding (runCore)
+    int64_t budget;         // instructions left in the budget (runSlice)
+    uint32_t loopLimit;     // instructions a compiled loop may run (runJit)
+    uint32_t spinAddr;      // word of the last failed cmpxchg
+    uint32_t spinCount;     // failed cmpxchg on it in a tight loop
+    int64_t spinSlice;      // slice left at the last one
+    int64_t forfeited;      // slice given up by spinCheck, not charged
+    struct Job *job;        // job of a host, or NULL under execute
+    struct Core *next;      // run queue of a host
+} CACHE_ALIGNED core_t;
+
+// vmx20.c
+char *op_name(unsigned char op);
+dop_t *decodeProgram(const int32_t *words, uint32_t numWords, uint32_t entry, uint32_t siMask);
+void privatizeCode(struct VM *vm);
+void beginExecution(struct VM *vm, uint32_t numProcessors, int32_t trace);
+core_t *createCore(struct VM *vm, int pid, uint32_t initialSP);
+int runCore(core_t *cpu);
+int runSlice(core_t *cpu, int64_t slice);
+int finishCore(core_t *core);
+void spinWake(struct VM *vm, uint32_t addr);
+int pinThread(pthread_t thread, int32_t cpu);
+
+// vmx20_profile.c
+profile_t *profileCreate(uint32_t pcCount, uint32_t entry);
+void profileCall(profile_t *profile, uint32_t callee);
+void profileReturn(profile_t *profile);
+void profileDestroy(profile_t *profile);
+void profileClear(struct VM *vm);
+
+// vmx20_loops.c
+uint32_t floatLoopLength(const dop_t *code, uint32_t head, uint32_t codeEnd);
+int64_t runFloatLoop(core_t *cpu, const dop_t *ins, uint32_t head, int64_t slice);
+
+// vmx20_stacks.c
+uint32_t stackLowest(struct VM *vm, int pid, uint32_t initialSP);
+void guardStacks(struct VM *vm, core_t *cores[], int numCores);
+void unguardStacks(struct VM *vm);
+void liftGuards(struct VM *vm, int lift);
+int inGuard(struct VM *vm, uint32_t addr, uint32_t n);
+int runGuarded(core_t *cpu, int (*run)(core_t *cpu));
+
+// vmx20_watch.c
+void watchStep(core_t *cpu, uint32_t pc, uint8_t op, const dop_t *ins, const int32_t before[16],
+        int32_t success);
+void watchClear(struct VM *vm);
+
+// vmx20_replay.c
+int replayStart(struct VM *vm, core_t *cores[], int numCores);
+void replayStop(struct VM *vm);
+void replayClear(struct VM *vm);
+void replayCoreStopped(core_t *cpu);
+int replayEnter(core_t *cpu);
+int replayLeave(core_t *cpu, uint8_t op, const dop_t *ins, const int32_t before[16]);
+
+// vmx20_symbols.c
+int symbolsBuild(struct VM *vm);
+void symbolsClear(struct VM *vm);
+sym_t *symbolsFind(struct VM *vm, const char *label);
+sym_t *symbolsAt(struct VM *vm, uint32_t addr);
+
+// vmx20_trace.c
+int traceStart(struct VM *vm, core_t **cores, int numCores);
+void traceStop(struct VM *vm);
+void traceStep(core_t *cpu, uint32_t pc, const dop_t *ins, uint8_t op, const int32_t before[16]);
+
+// vmx20_jit.c
+//   a compiled block runs natively until it reaches a branch, which ends
+//   the block, or something it leaves to the interpreter. it stores the
+//   next PC in the core and returns the number of instructions it executed,
+//   with JIT_BAILED set if the instruction at the new PC must be
+//   interpreted before another block is entered. a block that branches
+//   back to its own start loops natively for at most cpu->loopLimit
+//   instructions, which runJit keeps within the slice and JIT_MAX_LOOP.
+#define JIT_BAILED 0x80000000u
+#define JIT_MAX_LOOP (1 << 16)      // instructions before a looping block returns
+
+typedef uint32_t (*jit_block_t)(core_t *cpu, int32_t *memory);
+
+int jitCreate(struct VM *vm);
+void jitDestroy(struct VM *vm);
+jit_block_t jitEnter(struct VM *vm, uint32_t pc);
+void jitInvalidate(struct VM *vm, uint32_t addr);
+
+// opcode of a decoded entry; read exactly once per dispatch
+static inline uint8_t opOf(const dop_t *ins)
+{
+    return __atomic_load_n(&ins->op, __ATOMIC_RELAXED);
+}
+
+// forget the decoded form of a word that has just been written
+//   other cores may be reading the entry at the same time, so only the
+//   opcode byte is touched. compiled code covering the word is dropped too.
+//   a decoded program shared with other vms is copied first. data words
+//   were never decoded, nor compiled, so stores into them change nothing
+static inline void invalidateDecoded(struct VM *vm, uint32_t addr)
+{
+    if (addr < __atomic_load_n(&vm->codeEnd, __ATOMIC_RELAXED)
+            && opOf(&__atomic_load_n(&vm->code, __ATOMIC_RELAXED)[addr]) != OP_UNDECODED)
+    {
+        if (__atomic_load_n(&vm->codeShared, __ATOMIC_ACQUIRE)) privatizeCode(vm);
+        if (!__atomic_load_n(&vm->codeShared, __ATOMIC_ACQUIRE))
+        {
+            __atomic_store_n(&vm->code[addr].op, OP_UNDECODED, __ATOMIC_RELAXED);
+        }
+        if (vm->jit) jitInvalidate(vm, addr);
+    }
+}
+
+// loads acquire and stores release: the same plain moves as relaxed
+//   accesses on x86-64, but a store that releases an x20 lock can not be
+//   moved ahead of the stores made inside the critical section
+static inline int32_t memLoad(struct VM *vm, uint32_t addr, int32_t *outWord)
+{
+    if (addr >= vm->memSize) return 0;
+    *outWord = __atomic_load_n(&vm->memory[addr], __ATOMIC_ACQUIRE);
+    return 1;
+}
+
+static inline int32_t memStore(struct VM *vm, uint32_t addr, int32_t word)
+{
+    if (addr >= vm->memSize) return 0;
+    __atomic_store_n(&vm->memory[addr], word, __ATOMIC_RELEASE);
+    invalidateDecoded(vm, addr);
+    if (__atomic_load_n(&vm->spinWaiters, __ATOMIC_RELAXED)) spinWake(vm, addr);
+    return 1;
+}
+
+#endif
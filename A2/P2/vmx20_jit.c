@@ -0,0 +1,534 @@
+//
+// vmx20_jit.c
+//
+// template JIT for hot basic blocks (VMX20_ENGINE_JIT)
+//
+// every instruction of a block is translated with a fixed x86-64 stencil
+// that works directly on the register file in the core_t (rbx) and on VM
+// memory (r12); nothing is kept in host registers across instructions.
+// a block ends at the first branch. anything the stencils do not handle
+// (call, ret, cmpxchg, push, pop, halt, traps, stores into the program)
+// makes the block return to the interpreter, which keeps both engines
+// bit-identical.
+//
+
+#include "vmx20_internal.h"
+#include "vmx20_macros.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+
+#define JIT_BUFFER_SIZE (8 << 20)   // bytes of executable memory per VM
+#define JIT_MAX_BLOCK 64            // instructions per block
+#define JIT_NEVER UINT32_MAX        // hits value of a block that can't compile
+
+struct Jit {
+    pthread_mutex_t lock;   // held while compiling or dropping blocks
+    uint8_t *buffer;        // mmap'd executable memory
+    uint32_t used;          // bytes of buffer handed out
+    jit_block_t *blocks;    // compiled block starting at each address
+    uint32_t *blockEnd;     // first address after each compiled block
+    uint32_t *hits;         // entries of each (not yet compiled) block
+    uint8_t *covered;       // number of compiled blocks containing each word
+};
+
+// emitter
+typedef struct Emitter {
+    uint8_t *p;
+    uint8_t *end;
+    int overflow;
+} emit_t;
+
+static void emit8(emit_t *e, uint8_t b)
+{
+    if (e->p >= e->end) { e->overflow = 1; return; }
+    *e->p++ = b;
+}
+
+static void emitBytes(emit_t *e, int n, ...)
+{
+    va_list ap;
+    va_start(ap, n);
+    for (int i = 0; i < n; i++) emit8(e, va_arg(ap, int));
+    va_end(ap);
+}
+
+static void emit32(emit_t *e, uint32_t v)
+{
+    for (int i = 0; i < 4; i++) emit8(e, v >> (8 * i));
+}
+
+static void emit64(emit_t *e, uint64_t v)
+{
+    for (int i = 0; i < 8; i++) emit8(e, v >> (8 * i));
+}
+
+// displacement of a VM register in the core_t
+static uint32_t R(int reg)
+{
+    return offsetof(core_t, reg) + reg * sizeof(int32_t);
+}
+
+// <op> <reg>, [rbx + disp32]; modrm reg field selects eax/ecx/edx
+#define EAX 0
+#define ECX 1
+#define EDX 2
+static void emitRbx(emit_t *e, int opcodeLen, const uint8_t *opcode, int reg, uint32_t disp)
+{
+    for (int i = 0; i < opcodeLen; i++) emit8(e, opcode[i]);
+    emit8(e, 0x80 | reg << 3 | 3);
+    emit32(e, disp);
+}
+
+static void movLoad(emit_t *e, int reg, uint32_t disp)     // mov r32, [rbx+disp]
+{
+    emitRbx(e, 1, (uint8_t[]){0x8b}, reg, disp);
+}
+
+static void movStore(emit_t *e, int reg, uint32_t disp)    // mov [rbx+disp], r32
+{
+    emitRbx(e, 1, (uint8_t[]){0x89}, reg, disp);
+}
+
+static void movImm(emit_t *e, uint32_t disp, uint32_t imm) // mov dword [rbx+disp], imm32
+{
+    emitRbx(e, 1, (uint8_t[]){0xc7}, 0, disp);
+    emit32(e, imm);
+}
+
+// leave the block: store the next PC and return the instruction count
+//   (count of this pass plus r13d, the instructions of earlier passes
+//   around a loop). always exactly EXIT_SIZE bytes so that it can be
+//   jumped over with a short branch
+#define EXIT_SIZE 23
+static void emitExit(emit_t *e, uint8_t *epilogue, uint32_t nextPc, uint32_t count)
+{
+    movImm(e, R(PC), nextPc);
+    emit8(e, 0xb8);                     // mov eax, imm32
+    emit32(e, count);
+    emitBytes(e, 3, 0x44, 0x01, 0xe8);  // add eax, r13d
+    emit8(e, 0xe9);                     // jmp epilogue
+    emit32(e, (uint32_t)(epilogue - (e->p + 4)));
+}
+
+// jcc rel32 with the displacement patched later by patchHere
+static uint8_t *jccForward(emit_t *e, uint8_t cc)
+{
+    emitBytes(e, 2, 0x0f, 0x80 | cc);
+    uint8_t *at = e->p;
+    emit32(e, 0);
+    return at;
+}
+
+static uint8_t *jmpForward(emit_t *e)
+{
+    emit8(e, 0xe9);
+    uint8_t *at = e->p;
+    emit32(e, 0);
+    return at;
+}
+
+static void patchHere(emit_t *e, uint8_t *at)
+{
+    if (e->overflow) return;
+    uint32_t rel = (uint32_t)(e->p - (at + 4));
+    memcpy(at, &rel, 4);
+}
+
+// condition codes
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A  0x7
+#define CC_P  0xa
+#define CC_L  0xc
+#define CC_GE 0xd
+#define CC_LE 0xe
+#define CC_G  0xf
+
+// short jump over the exit that follows it
+static void jccOverExit(emit_t *e, uint8_t cc)
+{
+    emitBytes(e, 2, 0x70 | cc, EXIT_SIZE);
+}
+
+// store into the program while running compiled code
+//   does the store the way the interpreter would (invalidating decoded
+//   entries and compiled blocks) and tells the block whether it just
+//   overwrote compiled code, in which case it must not keep running
+static uint32_t jitStoreProgram(core_t *cpu, uint32_t addr, int32_t word)
+{
+    struct Jit *jit = cpu->vm->jit;
+    uint32_t hit = __atomic_load_n(&jit->covered[addr], __ATOMIC_RELAXED);
+    memStore(cpu->vm, addr, word);
+    return hit;
+}
+
+// call jitStoreProgram(cpu, eax, ecx) and leave the block if it says so
+static void emitStoreProgram(emit_t *e, uint8_t *epilogue, uint32_t nextPc, uint32_t count)
+{
+    emitBytes(e, 2, 0x89, 0xc6);        // mov esi, eax
+    emitBytes(e, 2, 0x89, 0xca);        // mov edx, ecx
+    emitBytes(e, 3, 0x48, 0x89, 0xdf);  // mov rdi, rbx
+    emitBytes(e, 2, 0x48, 0xb8);        // mov rax, imm64
+    emit64(e, (uint64_t)(uintptr_t)&jitStoreProgram);
+    emitBytes(e, 2, 0xff, 0xd0);        // call rax
+    emitBytes(e, 2, 0x85, 0xc0);        // test eax, eax
+    jccOverExit(e, CC_E);
+    emitExit(e, epilogue, nextPc, count | JIT_BAILED);
+}
+
+// eax = word at the static address in memory; mov [r12 + disp32], eax
+static void memStatic(emit_t *e, uint8_t opcode, uint32_t addr)
+{
+    emitBytes(e, 4, 0x41, opcode, 0x84, 0x24);
+    emit32(e, addr * sizeof(int32_t));
+}
+
+// movd xmm<n>, [rbx+disp] / movd [rbx+disp], xmm0
+static void movdLoad(emit_t *e, int xmm, uint32_t disp)
+{
+    emitRbx(e, 3, (uint8_t[]){0x66, 0x0f, 0x6e}, xmm, disp);
+}
+
+static void movdStore(emit_t *e, uint32_t disp)
+{
+    emitRbx(e, 3, (uint8_t[]){0x66, 0x0f, 0x7e}, 0, disp);
+}
+
+// block being compiled
+typedef struct Block {
+    struct VM *vm;
+    uint32_t start;         // address of the first instruction
+    uint8_t *epilogue;      // shared exit path
+    uint8_t *body;          // code of the first instruction
+} block_t;
+
+// taken branch to target after count instructions of this pass
+//   a branch back to the start of the block loops inside the compiled code
+//   and only returns once it has run cpu->loopLimit instructions
+static void emitBranch(block_t *b, emit_t *e, uint32_t target, uint32_t count)
+{
+    if (target == b->start)
+    {
+        emitBytes(e, 3, 0x41, 0x81, 0xc5);  // add r13d, imm32
+        emit32(e, count);
+        emitRbx(e, 2, (uint8_t[]){0x44, 0x3b}, 5,   // cmp r13d, [rbx+loopLimit]
+                offsetof(core_t, loopLimit));
+        emitBytes(e, 2, 0x0f, 0x82);        // jb body
+        emit32(e, (uint32_t)(b->body - (e->p + 4)));
+        count = 0;
+    }
+    emitExit(e, b->epilogue, target, count);
+}
+
+// translate the instruction at pc, the count-th one of the block
+//   returns 1 if the block continues after it and 0 if the block ended;
+//   *compiled tells whether anything was emitted for it
+static int compileInstruction(block_t *b, emit_t *e, uint32_t pc, uint32_t count, int *compiled)
+{
+    struct VM *vm = b->vm;
+    uint8_t *epilogue = b->epilogue;
+    const dop_t *ins = &vm->code[pc];
+    uint8_t op = opOf(ins);
+    int32_t arg = ins->arg;
+    uint32_t r1 = R(ins->r1), r2 = R(ins->r2);
+    *compiled = 1;
+    if (op == OP_UNDECODED) { *compiled = 0; return 0; }
+    op = ins->base;
+
+    // instructions that read r15 see their own address
+    switch (op)
+    {
+        case INS_LOAD: case INS_STORE: case INS_LDIND: case INS_STIND:
+        case INS_ADDF: case INS_SUBF: case INS_DIVF: case INS_MULF:
+        case INS_ADDI: case INS_SUBI: case INS_DIVI: case INS_MULI:
+        case INS_BLT: case INS_BGT: case INS_BEQ:
+            if (ins->r1 == PC || ins->r2 == PC) movImm(e, R(PC), pc);
+            break;
+    }
+
+    switch (op)
+    {
+        case INS_LDIMM:
+        case INS_LDADDR:
+            movImm(e, r1, arg);
+            return 1;
+        case INS_LOAD:
+            if ((uint32_t)arg >= vm->memSize) return 1;    // reads nothing
+            memStatic(e, 0x8b, arg);
+            movStore(e, EAX, r1);
+            return 1;
+        case INS_STORE:
+            if ((uint32_t)arg >= vm->memSize) return 1;    // writes nothing
+            movLoad(e, EAX, r1);
+            if ((uint32_t)arg < vm->codeEnd)
+            {
+                emitBytes(e, 2, 0x89, 0xc1);            // mov ecx, eax
+                emit8(e, 0xb8);                         // mov eax, arg
+                emit32(e, arg);
+                emitStoreProgram(e, epilogue, pc + 1, count + 1);
+                return 1;
+            }
+            memStatic(e, 0x89, arg);
+            return 1;
+        case INS_LDIND:
+            emitRbx(e, 2, (uint8_t[]){0x48, 0x63}, EAX, r2);    // movsxd rax, [r2]
+            emitBytes(e, 2, 0x48, 0x05);                        // add rax, imm32
+            emit32(e, arg);
+            emitBytes(e, 2, 0x48, 0x3d);                        // cmp rax, memSize
+            emit32(e, vm->memSize);
+            jccOverExit(e, CC_B);
+            emitExit(e, epilogue, pc, count | JIT_BAILED);      // out of range
+            emitBytes(e, 4, 0x41, 0x8b, 0x04, 0x84);            // mov eax, [r12+rax*4]
+            movStore(e, EAX, r1);
+            return 1;
+        case INS_STIND:
+        {
+            if ((uint64_t)ins->r2 + arg >= vm->memSize) { *compiled = 0; return 0; }
+            movLoad(e, EAX, r2);
+            emit8(e, 0x05);                                     // add eax, imm32
+            emit32(e, arg);
+            emit8(e, 0x3d);                                     // cmp eax, memSize
+            emit32(e, vm->memSize);
+            uint8_t *outside = jccForward(e, CC_AE);            // writes nothing
+            movLoad(e, ECX, r1);
+            emit8(e, 0x3d);                                     // cmp eax, codeEnd
+            emit32(e, vm->codeEnd);
+            uint8_t *program = jccForward(e, CC_B);
+            emitBytes(e, 4, 0x41, 0x89, 0x0c, 0x84);            // mov [r12+rax*4], ecx
+            uint8_t *done = jmpForward(e);
+            patchHere(e, program);
+            emitStoreProgram(e, epilogue, pc + 1, count + 1);
+            patchHere(e, done);
+            patchHere(e, outside);
+            return 1;
+        }
+        case INS_ADDF:
+        case INS_SUBF:
+        case INS_MULF:
+            movdLoad(e, 0, r1);
+            movdLoad(e, 1, r2);
+            emitBytes(e, 4, 0xf3, 0x0f, op == INS_ADDF ? 0x58 : op == INS_SUBF ? 0x5c : 0x59, 0xc1);
+            movdStore(e, r1);
+            return 1;
+        case INS_DIVF:
+        {
+            movdLoad(e, 1, r2);
+            emitBytes(e, 3, 0x0f, 0x57, 0xd2);                  // xorps xmm2, xmm2
+            emitBytes(e, 3, 0x0f, 0x2e, 0xca);                  // ucomiss xmm1, xmm2
+            uint8_t *nan = jccForward(e, CC_P);
+            jccOverExit(e, CC_NE);
+            emitExit(e, epilogue, pc, count | JIT_BAILED);      // divide by zero
+            patchHere(e, nan);
+            movdLoad(e, 0, r1);
+            emitBytes(e, 4, 0xf3, 0x0f, 0x5e, 0xc1);            // divss xmm0, xmm1
+            movdStore(e, r1);
+            return 1;
+        }
+        case INS_ADDI:
+        case INS_SUBI:
+        case INS_MULI:
+            movLoad(e, EAX, r1);
+            if (op == INS_ADDI) emitRbx(e, 1, (uint8_t[]){0x03}, EAX, r2);
+            else if (op == INS_SUBI) emitRbx(e, 1, (uint8_t[]){0x2b}, EAX, r2);
+            else emitRbx(e, 2, (uint8_t[]){0x0f, 0xaf}, EAX, r2);
+            movStore(e, EAX, r1);
+            return 1;
+        case INS_DIVI:
+            movLoad(e, ECX, r2);
+            emitBytes(e, 3, 0x8d, 0x41, 0x01);                  // lea eax, [rcx+1]
+            emitBytes(e, 3, 0x83, 0xf8, 0x01);                  // cmp eax, 1
+            jccOverExit(e, CC_A);
+            emitExit(e, epilogue, pc, count | JIT_BAILED);      // 0 or -1
+            movLoad(e, EAX, r1);
+            emitBytes(e, 1, 0x99);                              // cdq
+            emitBytes(e, 2, 0xf7, 0xf9);                        // idiv ecx
+            movStore(e, EAX, r1);
+            return 1;
+        case INS_GETPID:
+            movLoad(e, EAX, offsetof(core_t, pid));
+            movStore(e, EAX, r1);
+            return 1;
+        case INS_GETPN:
+            emitRbx(e, 2, (uint8_t[]){0x48, 0x8b}, EAX, offsetof(core_t, vm));
+            emitBytes(e, 2, 0x8b, 0x80);                        // mov eax, [rax+disp32]
+            emit32(e, offsetof(struct VM, numProcessors));
+            movStore(e, EAX, r1);
+            return 1;
+        case INS_BLT:
+        case INS_BGT:
+        case INS_BEQ:
+        {
+            movLoad(e, EAX, r1);
+            emitRbx(e, 1, (uint8_t[]){0x3b}, EAX, r2);          // cmp eax, [r2]
+            uint8_t *notTaken = jccForward(e, op == INS_BLT ? CC_GE : op == INS_BGT ? CC_LE : CC_NE);
+            emitBranch(b, e, arg, count + 1);
+            patchHere(e, notTaken);
+            emitExit(e, epilogue, pc + 1, count + 1);
+            return 0;
+        }
+        case INS_JMP:
+            emitBranch(b, e, arg, count + 1);
+            return 0;
+        default:
+            // call, ret, cmpxchg, push, pop, halt and invalid instructions
+            *compiled = 0;
+            return 0;
+    }
+}
+
+// compile the block starting at pc; the caller holds jit->lock
+static jit_block_t compileBlock(struct VM *vm, uint32_t pc)
+{
+    struct Jit *jit = vm->jit;
+    emit_t e = {jit->buffer + jit->used, jit->buffer + JIT_BUFFER_SIZE, 0};
+
+    // the shared exit path comes first so that exits can jump back to it
+    uint8_t *epilogue = e.p;
+    emitBytes(&e, 2, 0x41, 0x5d);       // pop r13
+    emitBytes(&e, 2, 0x41, 0x5c);       // pop r12
+    emitBytes(&e, 1, 0x5b);             // pop rbx
+    emitBytes(&e, 1, 0xc3);             // ret
+    uint8_t *entry = e.p;
+    emitBytes(&e, 1, 0x53);             // push rbx
+    emitBytes(&e, 2, 0x41, 0x54);       // push r12
+    emitBytes(&e, 2, 0x41, 0x55);       // push r13 (also keeps rsp aligned for calls)
+    emitBytes(&e, 3, 0x48, 0x89, 0xfb); // mov rbx, rdi
+    emitBytes(&e, 3, 0x49, 0x89, 0xf4); // mov r12, rsi
+    emitBytes(&e, 3, 0x45, 0x31, 0xed); // xor r13d, r13d
+    block_t b = {vm, pc, epilogue, e.p};
+
+    uint32_t count = 0;
+    uint32_t addr = pc;
+    int more = 1;
+    int compiled = 1;
+    while (more && addr < vm->codeEnd && count < JIT_MAX_BLOCK)
+    {
+        more = compileInstruction(&b, &e, addr, count, &compiled);
+        if (!compiled) break;
+        count++;
+        addr++;
+    }
+    if (count == 0) return NULL;
+    // unless the block ended on a branch, the interpreter takes over at addr
+    if (more || !compiled) emitExit(&e, epilogue, addr, count | JIT_BAILED);
+    if (e.overflow) return NULL;
+
+    jit->used = e.p - jit->buffer;
+    jit->blockEnd[pc] = addr;
+    for (uint32_t a = pc; a < addr; a++) jit->covered[a]++;
+    return (jit_block_t)(void *)entry;
+}
+
+int jitCreate(struct VM *vm)
+{
+    struct Jit *jit = calloc(1, sizeof(struct Jit));
+    if (!jit) return 0;
+    uint32_t n = vm->codeEnd ? vm->codeEnd : 1;
+    jit->blocks = calloc(n, sizeof(jit_block_t));
+    jit->blockEnd = calloc(n, sizeof(uint32_t));
+    jit->hits = calloc(n, sizeof(uint32_t));
+    jit->covered = calloc(n, sizeof(uint8_t));
+    jit->buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->buffer == MAP_FAILED) jit->buffer = NULL;
+    if (!jit->blocks || !jit->blockEnd || !jit->hits || !jit->covered || !jit->buffer)
+    {
+        vm->jit = jit;
+        jitDestroy(vm);
+        return 0;
+    }
+    pthread_mutex_init(&jit->lock, NULL);
+    vm->jit = jit;
+    return 1;
+}
+
+void jitDestroy(struct VM *vm)
+{
+    struct Jit *jit = vm->jit;
+    if (!jit) return;
+    vm->jit = NULL;
+    if (jit->buffer)
+    {
+        munmap(jit->buffer, JIT_BUFFER_SIZE);
+        pthread_mutex_destroy(&jit->lock);
+    }
+    free(jit->blocks);
+    free(jit->blockEnd);
+    free(jit->hits);
+    free(jit->covered);
+    free(jit);
+}
+
+jit_block_t jitEnter(struct VM *vm, uint32_t pc)
+{
+    struct Jit *jit = vm->jit;
+    if (pc >= vm->codeEnd) return NULL;
+    jit_block_t block = __atomic_load_n(&jit->blocks[pc], __ATOMIC_ACQUIRE);
+    if (block) return block;
+    uint32_t hits = __atomic_load_n(&jit->hits[pc], __ATOMIC_RELAXED);
+    if (hits == JIT_NEVER) return NULL;
+    if (__atomic_add_fetch(&jit->hits[pc], 1, __ATOMIC_RELAXED) < vm->jitThreshold) return NULL;
+
+    pthread_mutex_lock(&jit->lock);
+    block = jit->blocks[pc];
+    if (!block && jit->hits[pc] != JIT_NEVER)
+    {
+        block = compileBlock(vm, pc);
+        if (block) __atomic_store_n(&jit->blocks[pc], block, __ATOMIC_RELEASE);
+        else jit->hits[pc] = JIT_NEVER;
+    }
+    pthread_mutex_unlock(&jit->lock);
+    return block;
+}
+
+void jitInvalidate(struct VM *vm, uint32_t addr)
+{
+    struct Jit *jit = vm->jit;
+    if (!__atomic_load_n(&jit->covered[addr], __ATOMIC_RELAXED)) return;
+    pthread_mutex_lock(&jit->lock);
+    uint32_t first = addr >= JIT_MAX_BLOCK ? addr - JIT_MAX_BLOCK + 1 : 0;
+    for (uint32_t s = first; s <= addr; s++)
+    {
+        if (!jit->blocks[s] || jit->blockEnd[s] <= addr) continue;
+        // the code stays in the buffer in case a core is still running it
+        __atomic_store_n(&jit->blocks[s], NULL, __ATOMIC_RELEASE);
+        for (uint32_t a = s; a < jit->blockEnd[s]; a++) jit->covered[a]--;
+        jit->hits[s] = 0;
+    }
+    pthread_mutex_unlock(&jit->lock);
+}
+
+#else
+
+// no code generator for this host: the JIT engine is never selected
+
+int jitCreate(struct VM *vm)
+{
+    return 0;
+}
+
+void jitDestroy(struct VM *vm)
+{
+}
+
+jit_block_t jitEnter(struct VM *vm, uint32_t pc)
+{
+    return NULL;
+}
+
+void jitInvalidate(struct VM *vm, uint32_t addr)
+{
+}
+
+#endif
@@ -0,0 +1,362 @@
+//
+// vmx20_loops.c
+//
+// float loop kernels for the threaded engine
+//
+// a counted loop of the form
+//     head:  beq   ri, rn, exit
+//            ldind / stind / addf / subf / mulf / divf / addi ...
+//            jmp   head
+//     exit:
+// whose index and pointers only advance by addi of loop-invariant steps is
+// fused into SI_FLOAT_LOOP at its head. the kernel runs whole iterations
+// of it natively: when the iterations do not depend on each other through
+// registers or memory LOOP_LANES of them at a time with host vector
+// arithmetic, otherwise one at a time. each lane does exactly the single
+// precision operations of the interpreter, so results are bit-identical.
+// every address is checked once for the whole run, stores are held back
+// until their iterations have completed and anything unusual (a zero
+// divisor, a trap, the strict memory model, a store into the loop) leaves
+// the rest of the loop to the interpreter.
+//
+
+#include "vmx20_internal.h"
+#include "vmx20_macros.h"
+
+#include <string.h>
+
+#define LOOP_MAX_LENGTH 32      // words from the beq to the jmp
+#define LOOP_LANES 8            // iterations run together
+#define LOOP_MIN_ITERATIONS 4   // below this the interpreter is as fast
+
+typedef struct LoopPlan {
+    uint32_t length;            // words from the beq to the jmp
+    int index;                  // counts towards bound
+    int bound;
+    uint16_t linear;            // registers only advanced by addi of a step
+    uint16_t data;              // registers loaded or computed
+    uint16_t carried;           // data read before it is written
+    uint8_t step[16];           // step register of each linear register
+} loop_plan_t;
+
+// check the shape of the loop starting with the beq at ins[0], at address
+//   head; at most room words can be read. returns the length or 0
+static uint32_t analyseLoop(const dop_t *ins, uint32_t head, uint32_t room, loop_plan_t *plan)
+{
+    if (ins[0].base != INS_BEQ || ins[0].r1 == PC || ins[0].r2 == PC) return 0;
+    uint32_t length = 0;
+    int loads = 0, floats = 0;
+    for (uint32_t j = 1; j < LOOP_MAX_LENGTH && j < room; j++)
+    {
+        const dop_t *b = &ins[j];
+        uint8_t op = opOf(b);
+        if (op != b->base) return 0;    // fused or overwritten
+        if (op == INS_JMP)
+        {
+            if ((uint32_t)b->arg != head) return 0;
+            length = j + 1;
+            break;
+        }
+        switch (op)
+        {
+            case INS_LDIND:
+                loads++;
+                break;
+            case INS_ADDF:
+            case INS_SUBF:
+            case INS_MULF:
+            case INS_DIVF:
+                floats++;
+                break;
+            case INS_STIND:
+            case INS_ADDI:
+                break;
+            default:
+                return 0;
+        }
+        if (b->r1 == PC || b->r2 == PC) return 0;
+    }
+    if (!length || (uint32_t)ins[0].arg != head + length || !loads || !floats) return 0;
+
+    // registers advanced by addi, and everything else that is written
+    int increments[16] = {0};
+    uint16_t other = 0;
+    memset(plan, 0, sizeof(*plan));
+    for (uint32_t j = 1; j < length - 1; j++)
+    {
+        const dop_t *b = &ins[j];
+        if (b->base == INS_ADDI)
+        {
+            increments[b->r1]++;
+            plan->step[b->r1] = b->r2;
+        }
+        else if (b->base != INS_STIND)
+        {
+            other |= 1u << b->r1;
+        }
+    }
+    uint16_t written = other;
+    for (int r = 0; r < 16; r++) if (increments[r]) written |= 1u << r;
+    for (int r = 0; r < 16; r++)
+    {
+        if (!increments[r]) continue;
+        if (increments[r] > 1 || (other & (1u << r)) || (written & (1u << plan->step[r]))) return 0;
+        plan->linear |= 1u << r;
+    }
+    plan->data = other;
+
+    // the index is the linear one of the two compared, the bound is fixed
+    int r1 = ins[0].r1, r2 = ins[0].r2;
+    if ((plan->linear & (1u << r1)) && !(written & (1u << r2))) plan->index = r1, plan->bound = r2;
+    else if ((plan->linear & (1u << r2)) && !(written & (1u << r1))) plan->index = r2, plan->bound = r1;
+    else return 0;
+
+    // addresses come from linear registers before they advance, values
+    //   from the others
+    uint16_t defined = 0, advanced = 0;
+    for (uint32_t j = 1; j < length - 1; j++)
+    {
+        const dop_t *b = &ins[j];
+        uint16_t m1 = 1u << b->r1, m2 = 1u << b->r2;
+        switch (b->base)
+        {
+            case INS_LDIND:
+                if (!(plan->linear & m2) || (advanced & m2)) return 0;
+                defined |= m1;
+                break;
+            case INS_STIND:
+                if (!(plan->linear & m2) || (advanced & m2) || (plan->linear & m1)) return 0;
+                if ((plan->data & m1) && !(defined & m1)) plan->carried |= m1;
+                break;
+            case INS_ADDI:
+                advanced |= m1;
+                break;
+            default:    // float operations
+                if ((plan->linear & m1) || (plan->linear & m2)) return 0;
+                if (!(defined & m1)) plan->carried |= m1;
+                if ((plan->data & m2) && !(defined & m2)) plan->carried |= m2;
+                defined |= m1;
+                break;
+        }
+    }
+    plan->length = length;
+    return length;
+}
+
+uint32_t floatLoopLength(const dop_t *code, uint32_t head, uint32_t codeEnd)
+{
+    loop_plan_t plan;
+    return analyseLoop(&code[head], head, codeEnd - head, &plan);
+}
+
+#if defined(__GNUC__)
+
+typedef float vfloat_t __attribute__((vector_size(LOOP_LANES * sizeof(float))));
+
+// addresses accessed by a memory instruction of the body
+typedef struct Stream {
+    int64_t first;          // in the first iteration
+    int64_t stride;
+    int64_t low, high;      // over all iterations
+    uint32_t at;            // position in the body
+    int store;
+    int contiguous;         // stride 1, accessed LOOP_LANES at a time
+    int code;               // a store that may hit the decoded program
+} stream_t;
+
+// whether two streams can touch the same word in different iterations
+static int streamsConflict(const stream_t *a, const stream_t *b)
+{
+    if (a->high < b->low || b->high < a->low) return 0;
+    // the same words in the same order are only shared within an iteration
+    return a->first != b->first || a->stride != b->stride || a->stride == 0;
+}
+
+// run iterations of the loop headed by ins at head, as many as fit into
+//   slice instructions but at least one; returns how many ran, 0 if the
+//   interpreter has to run it
+int64_t runFloatLoop(core_t *cpu, const dop_t *ins, uint32_t head, int64_t slice)
+{
+    struct VM *vm = cpu->vm;
+    uint32_t codeEnd = __atomic_load_n(&vm->codeEnd, __ATOMIC_RELAXED);
+    if (vm->memoryModel != VMX20_MEMORY_RELAXED || head >= codeEnd) return 0;
+    if (__atomic_load_n(&vm->spinWaiters, __ATOMIC_RELAXED)) return 0;
+    loop_plan_t plan;
+    uint32_t length = analyseLoop(ins, head, codeEnd - head, &plan);
+    if (!length) return 0;
+
+    // iterations until the index reaches the bound
+    int32_t *reg = cpu->reg;
+    uint32_t distance = (uint32_t)reg[plan.bound] - (uint32_t)reg[plan.index];
+    int32_t step = reg[plan.step[plan.index]];
+    int64_t n;
+    if (step == 1) n = distance;
+    else if (step == -1) n = (uint32_t)-distance;
+    else return 0;
+    if (n > slice / length + 1) n = slice / length + 1;
+    if (n < LOOP_MIN_ITERATIONS) return 0;
+
+    // every address of every iteration must be valid
+    stream_t streams[LOOP_MAX_LENGTH];
+    uint32_t numStreams = 0;
+    for (uint32_t j = 1; j < length - 1; j++)
+    {
+        const dop_t *b = &ins[j];
+        if (b->base != INS_LDIND && b->base != INS_STIND) continue;
+        stream_t *s = &streams[numStreams++];
+        s->first = (int64_t)reg[b->r2] + b->arg;
+        s->stride = reg[plan.step[b->r2]];
+        int64_t last = s->first + (n - 1) * s->stride;
+        s->low = s->first < last ? s->first : last;
+        s->high = s->first < last ? last : s->first;
+        s->at = j;
+        s->store = b->base == INS_STIND;
+        if (s->low < 0 || s->high >= vm->memSize) return 0;
+        if (s->store)
+        {
+            // the interpreter checks stind against the register number
+            if ((uint64_t)b->r2 + b->arg >= vm->memSize) return 0;
+            // a store into the loop itself changes what it does
+            if (s->low < head + length && s->high >= head) return 0;
+        }
+    }
+
+    // iterations are independent unless a register carries a value from
+    //   one to the next or a store reaches a word used in another one
+    int lanes = plan.carried ? 1 : LOOP_LANES;
+    for (uint32_t a = 0; a < numStreams && lanes > 1; a++)
+    {
+        if (!streams[a].store) continue;
+        for (uint32_t b = 0; b < numStreams; b++)
+        {
+            if (a == b) continue;
+            if (streamsConflict(&streams[a], &streams[b])) {lanes = 1; break;}
+            // a load of the word stored earlier in the same iteration
+            if (!streams[b].store && streams[b].at > streams[a].at
+                    && streams[b].first == streams[a].first
+                    && streams[b].high >= streams[a].low && streams[a].high >= streams[b].low)
+            {
+                lanes = 1;
+                break;
+            }
+        }
+    }
+
+    // words next to each other are copied as a block
+    int8_t streamOf[LOOP_MAX_LENGTH];
+    uint16_t used = 0;
+    for (uint32_t j = 1, k = 0; j < length - 1; j++)
+    {
+        const dop_t *b = &ins[j];
+        used |= (1u << b->r1) | (1u << b->r2);
+        streamOf[j] = -1;
+        if (b->base != INS_LDIND && b->base != INS_STIND) continue;
+        streamOf[j] = k;
+        streams[k].contiguous = lanes > 1 && streams[k].stride == 1;
+        streams[k].code = streams[k].store && streams[k].low < codeEnd;
+        k++;
+    }
+    int32_t spread[16][LOOP_LANES];
+    for (int r = 0; r < 16; r++)
+    {
+        int32_t stride = (plan.linear & (1u << r)) ? reg[plan.step[r]] : 0;
+        for (int l = 0; l < LOOP_LANES; l++) spread[r][l] = (uint32_t)stride * l;
+    }
+
+    int32_t lane[16][LOOP_LANES] __attribute__((aligned(32)));
+    struct {
+        const stream_t *stream;
+        uint32_t addr[LOOP_LANES];
+        int32_t value[LOOP_LANES];
+    } held[LOOP_MAX_LENGTH];
+    int64_t done = 0;
+    while (done < n)
+    {
+        int g = n - done < lanes ? n - done : lanes;
+        for (int r = 0; r < 16; r++)
+        {
+            if (!(used & (1u << r))) continue;
+            for (int l = 0; l < LOOP_LANES; l++) lane[r][l] = (uint32_t)reg[r] + spread[r][l];
+        }
+        uint32_t numHeld = 0;
+        for (uint32_t j = 1; j < length - 1; j++)
+        {
+            const dop_t *b = &ins[j];
+            const stream_t *st = &streams[streamOf[j] < 0 ? 0 : streamOf[j]];
+            int32_t *d = lane[b->r1], *s = lane[b->r2];
+            vfloat_t x, y;
+            switch (b->base)
+            {
+                case INS_LDIND:
+                    if (st->contiguous)
+                    {
+                        memcpy(d, &vm->memory[(uint32_t)(s[0] + b->arg)], sizeof(int32_t) * g);
+                        break;
+                    }
+                    for (int l = 0; l < g; l++)
+                    {
+                        uint32_t addr = s[l] + b->arg;
+                        d[l] = __atomic_load_n(&vm->memory[addr], __ATOMIC_RELAXED);
+                        // one at a time, a store of this iteration may hold the word
+                        for (uint32_t k = numHeld; lanes == 1 && k-- > 0; )
+                        {
+                            if (held[k].addr[0] == addr) {d[0] = held[k].value[0]; break;}
+                        }
+                    }
+                    break;
+                case INS_STIND:
+                    held[numHeld].stream = st;
+                    for (int l = 0; l < g; l++) held[numHeld].addr[l] = s[l] + b->arg;
+                    memcpy(held[numHeld].value, d, sizeof(int32_t) * g);
+                    numHeld++;
+                    break;
+                case INS_ADDI:
+                    for (int l = 0; l < LOOP_LANES; l++) d[l] = (uint32_t)d[l] + (uint32_t)s[l];
+                    break;
+                default:
+                    memcpy(&x, d, sizeof(x));
+                    memcpy(&y, s, sizeof(y));
+                    switch (b->base)
+                    {
+                        case INS_ADDF: x = x + y; break;
+                        case INS_SUBF: x = x - y; break;
+                        case INS_MULF: x = x * y; break;
+                        case INS_DIVF:
+                            // the interpreter traps here; let it
+                            for (int l = 0; l < g; l++) if (y[l] == 0.0f) goto stop;
+                            x = x / y;
+                            break;
+                    }
+                    memcpy(d, &x, sizeof(x));
+                    break;
+            }
+        }
+
+        // the iterations are complete; commit them
+        for (uint32_t k = 0; k < numHeld; k++)
+        {
+            if (held[k].stream->contiguous)
+            {
+                memcpy(&vm->memory[held[k].addr[0]], held[k].value, sizeof(int32_t) * g);
+            }
+            else
+            {
+                for (int l = 0; l < g; l++)
+                {
+                    __atomic_store_n(&vm->memory[held[k].addr[l]], held[k].value[l], __ATOMIC_RELEASE);
+                }
+            }
+            for (int l = 0; held[k].stream->code && l < g; l++) invalidateDecoded(vm, held[k].addr[l]);
+        }
+        for (int r = 0; r < 16; r++)
+        {
+            if ((plan.linear | plan.data) & (1u << r)) reg[r] = lane[r][g - 1];
+        }
+        done += g;
+    }
+stop:
+    cpu->slice -= done * length;
+    return done;
+}
+
+#endif
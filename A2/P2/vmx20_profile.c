@@ -0,0 +1,438 @@
+//
+// vmx20_profile.c
+//
+// profiling counters collected by the switch engine and the report that
+//   is printed from them
+//   the call graph follows call and ret on a shadow stack: every
+//   instruction is charged to the calling context it ran in, and every
+//   function gets the instructions from its outermost call to the return
+//   from it, so recursion is not counted twice
+//
+
+#include "vmx20.h"
+#include "vmx20_macros.h"
+#include "vmx20_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HOT_PCS 20  // entries in the hot pc table
+#define HOT_FUNCTIONS 20    // entries in the function table
+#define MAX_CALL_NODES (1u << 16)   // contexts per core; calls beyond are charged to the caller
+
+typedef struct PcHits {
+    uint32_t pc;
+    uint64_t hits;
+} pc_hits_t;
+
+// a function over all cores
+typedef struct FunctionTotals {
+    uint32_t address;
+    uint64_t calls;
+    uint64_t inclusive;
+    uint64_t exclusive;
+} function_totals_t;
+
+// a line of the folded stacks
+typedef struct Folded {
+    char *stack;
+    uint64_t count;
+} folded_t;
+
+// make room for need entries of size bytes in an array of max entries
+static int grow(void **array, uint32_t *max, uint32_t need, size_t size)
+{
+    if (need <= *max) return 1;
+    uint32_t n = *max ? *max : 16;
+    while (n < need) n *= 2;
+    void *grown = realloc(*array, size * n);
+    if (!grown) return 0;
+    *array = grown;
+    *max = n;
+    return 1;
+}
+
+// index of the function at address, added if new; -1 if out of memory
+static int64_t findFunction(profile_t *profile, uint32_t address)
+{
+    for (uint32_t i = 0; i < profile->numFunctions; i++)
+    {
+        if (profile->functions[i].address == address) return i;
+    }
+    if (!grow((void **)&profile->functions, &profile->maxFunctions, profile->numFunctions + 1,
+            sizeof(call_function_t)))
+    {
+        return -1;
+    }
+    profile->functions[profile->numFunctions] = (call_function_t){address, 0, 0, 0};
+    return profile->numFunctions++;
+}
+
+profile_t *profileCreate(uint32_t pcCount, uint32_t entry)
+{
+    profile_t *profile = calloc(1, sizeof(profile_t));
+    if (!profile) return NULL;
+    profile->pcCount = pcCount;
+    profile->pcHits = calloc(pcCount + 1, sizeof(uint64_t));
+    // the entry point is the root of the call graph and the outermost frame
+    if (!profile->pcHits
+            || !grow((void **)&profile->nodes, &profile->maxNodes, 1, sizeof(call_node_t))
+            || !grow((void **)&profile->frames, &profile->maxDepth, 1, sizeof(call_frame_t))
+            || findFunction(profile, entry) < 0)
+    {
+        profileDestroy(profile);
+        return NULL;
+    }
+    profile->nodes[0] = (call_node_t){entry, 0, 0, 0, 0, 0};
+    profile->numNodes = 1;
+    profile->functions[0].active = 1;
+    profile->functions[0].calls = 1;
+    profile->frames[0] = (call_frame_t){0, 0, 0};
+    profile->depth = 1;
+    return profile;
+}
+
+void profileDestroy(profile_t *profile)
+{
+    if (!profile) return;
+    free(profile->pcHits);
+    free(profile->nodes);
+    free(profile->functions);
+    free(profile->frames);
+    free(profile);
+}
+
+// enter callee from the current context; the call is already counted
+void profileCall(profile_t *profile, uint32_t callee)
+{
+    if (profile->callsLost) return;
+    uint32_t parent = profile->current;
+    uint32_t node = profile->nodes[parent].child;
+    while (node && profile->nodes[node].callee != callee) node = profile->nodes[node].sibling;
+    int64_t function;
+    if (node)
+    {
+        function = profile->nodes[node].function;
+    }
+    else
+    {
+        function = findFunction(profile, callee);
+        if (function < 0) {profile->callsLost = 1; return;}
+        if (profile->numNodes < MAX_CALL_NODES
+                && grow((void **)&profile->nodes, &profile->maxNodes, profile->numNodes + 1,
+                        sizeof(call_node_t)))
+        {
+            node = profile->numNodes++;
+            profile->nodes[node] = (call_node_t){callee, parent, 0,
+                    profile->nodes[parent].child, function, 0};
+            profile->nodes[parent].child = node;
+        }
+        else
+        {
+            node = parent;
+        }
+    }
+    if (!grow((void **)&profile->frames, &profile->maxDepth, profile->depth + 1,
+            sizeof(call_frame_t)))
+    {
+        profile->callsLost = 1;
+        return;
+    }
+    call_function_t *f = &profile->functions[function];
+    f->calls++;
+    f->active++;
+    profile->frames[profile->depth++] = (call_frame_t){node, function, profile->retired};
+    profile->current = node;
+}
+
+// go back to the caller; the ret is already counted in the callee
+void profileReturn(profile_t *profile)
+{
+    // a ret without a call stays in the entry point
+    if (profile->callsLost || profile->depth <= 1) return;
+    call_frame_t *frame = &profile->frames[--profile->depth];
+    call_function_t *f = &profile->functions[frame->function];
+    if (--f->active == 0) f->inclusive += profile->retired - frame->start;
+    profile->current = profile->frames[profile->depth - 1].node;
+}
+
+// drop the profile of the previous execution
+void profileClear(struct VM *vm)
+{
+    for (int i = 0; i < vm->profiledCores; i++)
+    {
+        profileDestroy(vm->profiles[i]);
+    }
+    vm->profiledCores = 0;
+}
+
+int32_t setProfiling(void *handle, int32_t enable)
+{
+    struct VM *vm = handle;
+    if (!vm) return 0;
+    vm->profiling = enable != 0;
+    return 1;
+}
+
+static int byHits(const void *a, const void *b)
+{
+    const pc_hits_t *x = a, *y = b;
+    if (x->hits != y->hits) return x->hits < y->hits ? 1 : -1;
+    return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+static double percent(uint64_t part, uint64_t whole)
+{
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+// name of the code at address: its insymbol, with an offset if it is not
+//   right at it, or else the address
+static void functionName(struct VM *vm, uint32_t address, char *name, size_t size)
+{
+    sym_t *sym = symbolsAt(vm, address);
+    if (!sym) snprintf(name, size, "%u", address);
+    else if ((uint32_t)sym->address == address) snprintf(name, size, "%.16s", sym->name);
+    else snprintf(name, size, "%.16s+%u", sym->name, address - (uint32_t)sym->address);
+}
+
+static int byFunctionAddress(const void *a, const void *b)
+{
+    const function_totals_t *x = a, *y = b;
+    return x->address < y->address ? -1 : x->address > y->address;
+}
+
+static int byInclusive(const void *a, const void *b)
+{
+    const function_totals_t *x = a, *y = b;
+    if (x->inclusive != y->inclusive) return x->inclusive < y->inclusive ? 1 : -1;
+    return byFunctionAddress(a, b);
+}
+
+static int byStack(const void *a, const void *b)
+{
+    return strcmp(((const folded_t *)a)->stack, ((const folded_t *)b)->stack);
+}
+
+// the functions of all profiled cores merged by address, most inclusive
+//   instructions first; NULL if out of memory
+static function_totals_t *functionTotals(struct VM *vm, uint32_t *count)
+{
+    uint32_t n = 0;
+    for (int i = 0; i < vm->profiledCores; i++) n += vm->profiles[i]->numFunctions;
+    function_totals_t *totals = calloc(n ? n : 1, sizeof(function_totals_t));
+    if (!totals) return NULL;
+    uint32_t k = 0;
+    for (int i = 0; i < vm->profiledCores; i++)
+    {
+        profile_t *p = vm->profiles[i];
+        function_totals_t *own = &totals[k];
+        for (uint32_t f = 0; f < p->numFunctions; f++)
+        {
+            call_function_t *function = &p->functions[f];
+            own[f] = (function_totals_t){function->address, function->calls, function->inclusive, 0};
+        }
+        for (uint32_t node = 0; node < p->numNodes; node++)
+        {
+            own[p->nodes[node].function].exclusive += p->nodes[node].self;
+        }
+        // functions not returned from ran until the core stopped; the
+        //   frame of the outermost call is the lowest on the stack
+        uint8_t *seen = calloc(p->numFunctions, 1);
+        if (!seen) {free(totals); return NULL;}
+        for (uint32_t d = 0; d < p->depth; d++)
+        {
+            call_frame_t *frame = &p->frames[d];
+            if (seen[frame->function]) continue;
+            seen[frame->function] = 1;
+            own[frame->function].inclusive += p->retired - frame->start;
+        }
+        free(seen);
+        k += p->numFunctions;
+    }
+    qsort(totals, n, sizeof(function_totals_t), byFunctionAddress);
+    uint32_t merged = 0;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        if (merged && totals[merged - 1].address == totals[i].address)
+        {
+            totals[merged - 1].calls += totals[i].calls;
+            totals[merged - 1].inclusive += totals[i].inclusive;
+            totals[merged - 1].exclusive += totals[i].exclusive;
+        }
+        else
+        {
+            totals[merged++] = totals[i];
+        }
+    }
+    qsort(totals, merged, sizeof(function_totals_t), byInclusive);
+    *count = merged;
+    return totals;
+}
+
+int32_t printProfile(void *handle, FILE *out)
+{
+    struct VM *vm = handle;
+    if (!vm || vm->profiledCores == 0) return 0;
+
+    // per core
+    profile_t total;
+    memset(&total, 0, sizeof(total));
+    fprintf(out, "core   retired        ms   Minstr/s      taken  not taken   cas fail lock waits\n");
+    for (int i = 0; i < vm->profiledCores; i++)
+    {
+        profile_t *p = vm->profiles[i];
+        double ms = p->nanoseconds / 1e6;
+        fprintf(out, "%4d %9llu %9.2f %10.1f %10llu %10llu %10llu %10llu\n", i,
+                (unsigned long long)p->retired, ms, ms > 0 ? p->retired / ms / 1e3 : 0.0,
+                (unsigned long long)p->taken, (unsigned long long)p->notTaken,
+                (unsigned long long)p->cmpxchgFailed, (unsigned long long)p->lockWaits);
+        total.retired += p->retired;
+        total.taken += p->taken;
+        total.notTaken += p->notTaken;
+        total.cmpxchgFailed += p->cmpxchgFailed;
+        total.lockWaits += p->lockWaits;
+        for (int op = 0; op < 256; op++) total.ops[op] += p->ops[op];
+    }
+    if (vm->profiledCores > 1)
+    {
+        fprintf(out, " all %9llu %9s %10s %10llu %10llu %10llu %10llu\n",
+                (unsigned long long)total.retired, "", "",
+                (unsigned long long)total.taken, (unsigned long long)total.notTaken,
+                (unsigned long long)total.cmpxchgFailed, (unsigned long long)total.lockWaits);
+    }
+
+    // per opcode
+    fprintf(out, "\nopcode       count      %%\n");
+    for (int op = 0; op < 256; op++)
+    {
+        if (!total.ops[op]) continue;
+        char *name = op < OP_BADFETCH ? op_name(op) : "(bad pc)";
+        fprintf(out, "%-8s %9llu %6.2f\n", name, (unsigned long long)total.ops[op],
+                percent(total.ops[op], total.retired));
+    }
+
+    // hottest pcs, all cores together
+    uint32_t pcCount = vm->profiles[0]->pcCount;
+    pc_hits_t *hot = malloc(sizeof(pc_hits_t) * (pcCount + 1));
+    if (!hot) return 0;
+    uint32_t n = 0;
+    for (uint32_t pc = 0; pc <= pcCount; pc++)
+    {
+        uint64_t hits = 0;
+        for (int i = 0; i < vm->profiledCores; i++) hits += vm->profiles[i]->pcHits[pc];
+        if (hits) hot[n++] = (pc_hits_t){pc, hits};
+    }
+    qsort(hot, n, sizeof(pc_hits_t), byHits);
+    fprintf(out, "\n    pc      hits      %%  location             instruction\n");
+    for (uint32_t i = 0; i < n && i < HOT_PCS; i++)
+    {
+        char location[32] = "";
+        char buffer[100] = "";
+        int32_t err;
+        if (hot[i].pc == pcCount)
+        {
+            fprintf(out, "%6s %9llu %6.2f  (outside of program)\n", "",
+                    (unsigned long long)hot[i].hits, percent(hot[i].hits, total.retired));
+            continue;
+        }
+        sym_t *sym = symbolsAt(vm, hot[i].pc);
+        if (sym)
+        {
+            snprintf(location, sizeof(location), "%s+%u", sym->name,
+                    hot[i].pc - (uint32_t)sym->address);
+        }
+        disassemble(vm, hot[i].pc, buffer, &err);
+        fprintf(out, "%6u %9llu %6.2f  %-20s %s\n", hot[i].pc,
+                (unsigned long long)hot[i].hits, percent(hot[i].hits, total.retired),
+                location, buffer);
+    }
+    free(hot);
+
+    // functions, all cores together
+    uint32_t numFunctions;
+    function_totals_t *functions = functionTotals(vm, &numFunctions);
+    if (!functions) return 0;
+    fprintf(out, "\nfunction                 calls  inclusive      %%  exclusive      %%\n");
+    for (uint32_t i = 0; i < numFunctions && i < HOT_FUNCTIONS; i++)
+    {
+        char name[32];
+        functionName(vm, functions[i].address, name, sizeof(name));
+        fprintf(out, "%-20s %9llu %10llu %6.2f %10llu %6.2f\n", name,
+                (unsigned long long)functions[i].calls,
+                (unsigned long long)functions[i].inclusive,
+                percent(functions[i].inclusive, total.retired),
+                (unsigned long long)functions[i].exclusive,
+                percent(functions[i].exclusive, total.retired));
+    }
+    free(functions);
+    for (int i = 0; i < vm->profiledCores; i++)
+    {
+        if (!vm->profiles[i]->callsLost) continue;
+        fprintf(out, "(out of memory for the call graph; calls and returns were lost)\n");
+        break;
+    }
+    return 1;
+}
+
+int32_t printFoldedStacks(void *handle, FILE *out)
+{
+    struct VM *vm = handle;
+    if (!vm || vm->profiledCores == 0) return 0;
+    uint32_t n = 0, maxNodes = 1;
+    for (int i = 0; i < vm->profiledCores; i++)
+    {
+        profile_t *p = vm->profiles[i];
+        for (uint32_t node = 0; node < p->numNodes; node++) if (p->nodes[node].self) n++;
+        if (p->numNodes > maxNodes) maxNodes = p->numNodes;
+    }
+    folded_t *lines = malloc(sizeof(folded_t) * (n ? n : 1));
+    uint32_t *path = malloc(sizeof(uint32_t) * maxNodes);
+    int ok = lines && path;
+    uint32_t k = 0;
+    for (int i = 0; i < vm->profiledCores && ok; i++)
+    {
+        profile_t *p = vm->profiles[i];
+        for (uint32_t node = 0; node < p->numNodes && ok; node++)
+        {
+            if (!p->nodes[node].self) continue;
+            uint32_t depth = 0;
+            for (uint32_t at = node; ; at = p->nodes[at].parent)
+            {
+                path[depth++] = at;
+                if (at == 0) break;
+            }
+            // the names from the entry point in, separated by semicolons
+            char *stack = NULL;
+            size_t size = 0;
+            FILE *text = open_memstream(&stack, &size);
+            if (!text) {ok = 0; break;}
+            for (uint32_t d = depth; d-- > 0; )
+            {
+                char name[32];
+                functionName(vm, p->nodes[path[d]].callee, name, sizeof(name));
+                fprintf(text, d + 1 < depth ? ";%s" : "%s", name);
+            }
+            if (fclose(text) != 0) {free(stack); ok = 0; break;}
+            lines[k++] = (folded_t){stack, p->nodes[node].self};
+        }
+    }
+    // the same stack on several cores is printed once
+    if (ok) qsort(lines, k, sizeof(folded_t), byStack);
+    for (uint32_t i = 0; i < k; i++)
+    {
+        if (ok && i + 1 < k && strcmp(lines[i].stack, lines[i + 1].stack) == 0)
+        {
+            lines[i + 1].count += lines[i].count;
+        }
+        else if (ok)
+        {
+            fprintf(out, "%s %llu\n", lines[i].stack, (unsigned long long)lines[i].count);
+        }
+        free(lines[i].stack);
+    }
+    free(lines);
+    free(path);
+    return ok;
+}
@@ -0,0 +1,403 @@
+//
+// vmx20_replay.c
+//
+// record and replay of executions
+//   every instruction that accesses memory takes the next number of a
+//   sequence shared by all cores. a recording takes the numbers under a
+//   lock, so their order is the order the accesses happened in, and logs
+//   them per core as runs of consecutive numbers: how many numbers other
+//   cores took since the last run of the core, and how many the core took
+//   in a row. the outcome of every cmpxchg is logged as a bit, to tell a
+//   replay that went wrong. a replay makes each instruction wait until the
+//   sequence reaches its number, so memory sees the same accesses in the
+//   same order and every core computes what it did when recorded.
+//
+//   a replay has gone wrong if a cmpxchg comes out differently, a core
+//   accesses memory more often than recorded or stops before it has used
+//   all of its numbers; that core stops with VMX20_REPLAY_DIVERGED, and so
+//   does every core left waiting for a number nobody will take.
+//
+
+#include "vmx20.h"
+#include "vmx20_macros.h"
+#include "vmx20_internal.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REPLAY_MAGIC "VMX20RP1"
+#define NO_TICKET UINT64_MAX    // a core that has used all of its numbers
+
+// file layout: the header, then for every core its runs and its cmpxchg
+//   outcomes, a bit each from the lowest bit of the first word
+typedef struct ReplayHeader {
+    char magic[8];              // REPLAY_MAGIC, not terminated
+    uint32_t numProcessors;
+    uint32_t progEnd;
+    uint64_t programHash;       // of the program when the recording started
+    uint32_t numRuns[VMX20_MAX_PROCESSORS];
+    uint64_t numCas[VMX20_MAX_PROCESSORS];
+} replay_header_t;
+
+typedef struct ReplayRun {
+    uint32_t skip;              // numbers taken by other cores before the run
+    uint32_t count;             // numbers taken by this core in a row
+} replay_run_t;
+
+struct ReplayCore {
+    replay_run_t *runs;
+    uint32_t numRuns, maxRuns;
+    uint64_t *cas;              // cmpxchg outcomes, 1 if it exchanged
+    uint64_t numCas, maxCas;    // bits
+    uint64_t ticket;            // number of the instruction in progress
+    uint64_t next;              // recording: after the last run; replay: next number
+    uint32_t run;               // replay: current run
+    uint32_t left;              // replay: numbers left in it
+    uint64_t casUsed;           // replay: outcomes compared
+    int done;                   // replay: the core has stopped
+};
+
+struct Replay {
+    int recording;              // 1 to record, 0 to replay
+    char *filename;             // where a recording goes
+    int failed;                 // a recording ran out of memory
+    pthread_mutex_t lock;       // held by a recording core while it accesses memory
+    uint64_t sequence;          // numbers taken
+    uint32_t numCores;
+    uint32_t progEnd;
+    uint64_t programHash;
+    struct ReplayCore cores[VMX20_MAX_PROCESSORS];
+};
+
+// FNV-1a over the program
+static uint64_t hashProgram(struct VM *vm)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (uint32_t i = 0; i < vm->progEnd && i < vm->memSize; i++)
+    {
+        h = (h ^ (uint32_t)vm->memory[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+static void freeReplay(struct Replay *replay)
+{
+    if (!replay) return;
+    for (int i = 0; i < VMX20_MAX_PROCESSORS; i++)
+    {
+        free(replay->cores[i].runs);
+        free(replay->cores[i].cas);
+    }
+    pthread_mutex_destroy(&replay->lock);
+    free(replay->filename);
+    free(replay);
+}
+
+static struct Replay *newReplay(int recording)
+{
+    struct Replay *replay = calloc(1, sizeof(struct Replay));
+    if (!replay) return NULL;
+    if (pthread_mutex_init(&replay->lock, NULL))
+    {
+        free(replay);
+        return NULL;
+    }
+    replay->recording = recording;
+    return replay;
+}
+
+void replayClear(struct VM *vm)
+{
+    freeReplay(vm->replay);
+    vm->replay = NULL;
+}
+
+// suspended cores still use the log they were started with
+static int hasSuspended(struct VM *vm)
+{
+    for (int i = 0; i < VMX20_MAX_PROCESSORS; i++) if (vm->cores[i]) return 1;
+    return 0;
+}
+
+int32_t setRecordFile(void *handle, char *filename)
+{
+    struct VM *vm = handle;
+    if (!vm || hasSuspended(vm)) return 0;
+    replayClear(vm);
+    if (!filename) return 1;
+    // the file is only written at the end, so make sure it can be
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) return 0;
+    fclose(fp);
+    struct Replay *replay = newReplay(1);
+    if (!replay) return 0;
+    replay->filename = strdup(filename);
+    if (!replay->filename) {freeReplay(replay); return 0;}
+    vm->replay = replay;
+    return 1;
+}
+
+int32_t setReplayFile(void *handle, char *filename)
+{
+    struct VM *vm = handle;
+    if (!vm || hasSuspended(vm)) return 0;
+    replayClear(vm);
+    if (!filename) return 1;
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return 0;
+    struct Replay *replay = newReplay(0);
+    replay_header_t header;
+    int ok = replay && fread(&header, sizeof(header), 1, fp) == 1
+        && memcmp(header.magic, REPLAY_MAGIC, sizeof(header.magic)) == 0
+        && header.numProcessors <= VMX20_MAX_PROCESSORS;
+    for (uint32_t i = 0; ok && i < header.numProcessors; i++)
+    {
+        struct ReplayCore *core = &replay->cores[i];
+        uint64_t words = (header.numCas[i] + 63) / 64;
+        core->runs = malloc(sizeof(replay_run_t) * (header.numRuns[i] ? header.numRuns[i] : 1));
+        core->cas = malloc(sizeof(uint64_t) * (words ? words : 1));
+        ok = core->runs && core->cas
+            && fread(core->runs, sizeof(replay_run_t), header.numRuns[i], fp) == header.numRuns[i]
+            && fread(core->cas, sizeof(uint64_t), words, fp) == words;
+        core->numRuns = header.numRuns[i];
+        core->numCas = header.numCas[i];
+    }
+    fclose(fp);
+    if (!ok) {freeReplay(replay); return 0;}
+    replay->numCores = header.numProcessors;
+    replay->progEnd = header.progEnd;
+    replay->programHash = header.programHash;
+    vm->replay = replay;
+    return 1;
+}
+
+// the next number of a replayed core after ticket, or NO_TICKET
+static uint64_t nextTicket(struct ReplayCore *core, uint64_t ticket)
+{
+    if (core->left > 1)
+    {
+        core->left--;
+        return ticket + 1;
+    }
+    ticket++;
+    while (++core->run < core->numRuns)
+    {
+        ticket += core->runs[core->run].skip;
+        if (core->runs[core->run].count)
+        {
+            core->left = core->runs[core->run].count;
+            return ticket;
+        }
+    }
+    core->left = 0;
+    return NO_TICKET;
+}
+
+// prepare a recording or a replay of the cores about to run
+//   returns 0 if the replay is of another program or number of cores
+int replayStart(struct VM *vm, core_t *cores[], int numCores)
+{
+    struct Replay *replay = vm->replay;
+    if (!replay) return 1;
+    if (!replay->recording
+            && (replay->numCores != numCores || replay->progEnd != vm->progEnd
+                || replay->programHash != hashProgram(vm)))
+    {
+        return 0;
+    }
+    replay->sequence = 0;
+    replay->failed = 0;
+    for (int i = 0; i < numCores; i++)
+    {
+        struct ReplayCore *core = &replay->cores[i];
+        if (replay->recording)
+        {
+            core->numRuns = 0;
+            core->numCas = 0;
+            core->next = 0;
+        }
+        else
+        {
+            // a run before the first, of no numbers at all
+            core->run = -1;
+            core->left = 0;
+            core->next = nextTicket(core, -1);
+            core->casUsed = 0;
+            core->done = 0;
+        }
+        cores[i]->replay = core;
+    }
+    replay->numCores = numCores;
+    replay->progEnd = vm->progEnd;
+    replay->programHash = hashProgram(vm);
+    return 1;
+}
+
+// write out a recording once its cores have all stopped
+void replayStop(struct VM *vm)
+{
+    struct Replay *replay = vm->replay;
+    if (!replay || !replay->recording || replay->failed) return;
+    FILE *fp = fopen(replay->filename, "wb");
+    if (!fp) return;
+    replay_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, REPLAY_MAGIC, sizeof(header.magic));
+    header.numProcessors = replay->numCores;
+    header.progEnd = replay->progEnd;
+    header.programHash = replay->programHash;
+    for (uint32_t i = 0; i < replay->numCores; i++)
+    {
+        header.numRuns[i] = replay->cores[i].numRuns;
+        header.numCas[i] = replay->cores[i].numCas;
+    }
+    fwrite(&header, sizeof(header), 1, fp);
+    for (uint32_t i = 0; i < replay->numCores; i++)
+    {
+        struct ReplayCore *core = &replay->cores[i];
+        fwrite(core->runs, sizeof(replay_run_t), core->numRuns, fp);
+        fwrite(core->cas, sizeof(uint64_t), (core->numCas + 63) / 64, fp);
+    }
+    fclose(fp);
+}
+
+// a core has stopped; if it was replayed its numbers should all be used
+void replayCoreStopped(core_t *cpu)
+{
+    struct ReplayCore *core = cpu->replay;
+    if (cpu->vm->replay->recording) return;
+    if (__atomic_load_n(&core->next, __ATOMIC_ACQUIRE) != NO_TICKET
+            && cpu->status == VMX20_NORMAL_TERMINATION)
+    {
+        cpu->status = VMX20_REPLAY_DIVERGED;
+    }
+    __atomic_store_n(&core->done, 1, __ATOMIC_RELEASE);
+}
+
+// whether a core that is still running will take number ticket
+//   a core whose next number is below it is in the middle of replayLeave,
+//   and may be about to take it
+static int ticketTaken(struct Replay *replay, uint64_t ticket)
+{
+    for (uint32_t i = 0; i < replay->numCores; i++)
+    {
+        struct ReplayCore *core = &replay->cores[i];
+        if (__atomic_load_n(&core->next, __ATOMIC_ACQUIRE) <= ticket
+                && !__atomic_load_n(&core->done, __ATOMIC_ACQUIRE))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// take the next number before an instruction that accesses memory
+//   returns 1 if the instruction can execute now, 0 if the core has to
+//   wait for its turn and -1 if the replay has gone wrong
+int replayEnter(core_t *cpu)
+{
+    struct Replay *replay = cpu->vm->replay;
+    struct ReplayCore *core = cpu->replay;
+    if (replay->recording)
+    {
+        pthread_mutex_lock(&replay->lock);
+        core->ticket = replay->sequence++;
+        return 1;
+    }
+    uint64_t sequence = __atomic_load_n(&replay->sequence, __ATOMIC_ACQUIRE);
+    if (core->next != NO_TICKET && sequence == core->next) return 1;
+    if (core->next != NO_TICKET && ticketTaken(replay, sequence)) return 0;
+    // the core that had the number may have moved past it during the look
+    //   at the others; only a sequence that stood still proves nobody has it
+    if (core->next != NO_TICKET
+            && __atomic_load_n(&replay->sequence, __ATOMIC_ACQUIRE) != sequence)
+    {
+        return 0;
+    }
+    cpu->status = VMX20_REPLAY_DIVERGED;
+    return -1;
+}
+
+static int appendRun(struct ReplayCore *core, uint32_t skip, uint32_t count)
+{
+    if (core->numRuns == core->maxRuns)
+    {
+        uint32_t max = core->maxRuns ? 2 * core->maxRuns : 256;
+        replay_run_t *runs = realloc(core->runs, sizeof(replay_run_t) * max);
+        if (!runs) return 0;
+        core->runs = runs;
+        core->maxRuns = max;
+    }
+    core->runs[core->numRuns++] = (replay_run_t){skip, count};
+    return 1;
+}
+
+static int appendCas(struct ReplayCore *core, int exchanged)
+{
+    if (core->numCas == 64 * core->maxCas)
+    {
+        uint64_t max = core->maxCas ? 2 * core->maxCas : 16;
+        uint64_t *cas = realloc(core->cas, sizeof(uint64_t) * max);
+        if (!cas) return 0;
+        core->cas = cas;
+        core->maxCas = max;
+    }
+    uint64_t bit = 1ull << (core->numCas % 64);
+    if (exchanged) core->cas[core->numCas / 64] |= bit;
+    else core->cas[core->numCas / 64] &= ~bit;
+    core->numCas++;
+    return 1;
+}
+
+// give the number back to the sequence after the instruction executed
+//   before holds the registers it started with
+//   returns 0 if the replay has gone wrong and 1 otherwise
+int replayLeave(core_t *cpu, uint8_t op, const dop_t *ins, const int32_t before[16])
+{
+    struct Replay *replay = cpu->vm->replay;
+    struct ReplayCore *core = cpu->replay;
+    // a cmpxchg that failed wrote the word it found into r1
+    int exchanged = op == INS_CMPXCHG && cpu->reg[ins->r1] == before[ins->r1];
+    if (replay->recording)
+    {
+        uint64_t ticket = core->ticket;
+        int ok = 1;
+        if (core->numRuns && ticket == core->next && core->runs[core->numRuns - 1].count < UINT32_MAX)
+        {
+            core->runs[core->numRuns - 1].count++;
+        }
+        else
+        {
+            for (; ok && ticket - core->next > UINT32_MAX; core->next += UINT32_MAX)
+            {
+                ok = appendRun(core, UINT32_MAX, 0);
+            }
+            ok = ok && appendRun(core, ticket - core->next, 1);
+        }
+        core->next = ticket + 1;
+        if (op == INS_CMPXCHG) ok = ok && appendCas(core, exchanged);
+        if (!ok) replay->failed = 1;
+        pthread_mutex_unlock(&replay->lock);
+        // the lock is not held while a core spins on a word
+        if (op == INS_CMPXCHG && !exchanged) sched_yield();
+        return 1;
+    }
+    int ok = 1;
+    if (op == INS_CMPXCHG)
+    {
+        uint64_t at = core->casUsed++;
+        ok = at < core->numCas && (int)(core->cas[at / 64] >> (at % 64) & 1) == exchanged;
+    }
+    // the sequence moves on before the next number of the core does, so
+    //   that a core looking for who has ticket + 1 in between finds this
+    //   one still below it (ticketTaken) instead of nobody
+    uint64_t ticket = core->next;
+    uint64_t next = nextTicket(core, ticket);
+    __atomic_store_n(&replay->sequence, ticket + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&core->next, next, __ATOMIC_RELEASE);
+    if (!ok) cpu->status = VMX20_REPLAY_DIVERGED;
+    return ok;
+}
@@ -0,0 +1,289 @@
+//
+// vmx20_snapshot.c
+//
+// snapshots of a vm in a file
+//   header, the registers of every core, the symbol table and an index of
+//   the pages that are stored, followed by the pages themselves at offsets
+//   that are multiples of the page size. pages that are all zero are left
+//   out. a restored vm maps the pages privately from the file, so they are
+//   shared with every other vm restored from it until one writes to them.
+//   a snapshot is therefore never rewritten in place: it is written to a
+//   new file that then replaces the old one, whose pages stay with the vms
+//   restored from it.
+//
+
+#include "vmx20.h"
+#include "vmx20_internal.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SNAPSHOT_MAGIC "VMX20SN2"
+#define PAGE_WORDS 1024                         // words per page
+#define PAGE_BYTES (PAGE_WORDS * sizeof(int32_t))
+
+typedef struct SnapshotHeader {
+    char magic[8];              // SNAPSHOT_MAGIC, not terminated
+    uint32_t memSize;           // words of memory
+    uint32_t progEnd;
+    uint32_t entryPoint;
+    uint32_t numProcessors;
+    uint32_t numSymbols;
+    uint32_t numPages;          // pages stored
+    int32_t engine;
+    int32_t memoryModel;
+    uint32_t siMask;
+    int32_t status[VMX20_MAX_PROCESSORS];
+    uint64_t budget;            // setBudget
+    uint32_t timeLimit;
+    uint32_t numStackWords;     // setStacks
+    uint32_t stackWords[VMX20_MAX_PROCESSORS];
+    int32_t stackGuard;
+} snapshot_header_t;
+
+typedef struct SnapshotCore {
+    int32_t reg[16];
+    uint32_t stack;
+    uint32_t suspended;         // 0 if the core has terminated
+    int64_t budget;             // instructions left
+} snapshot_core_t;
+
+typedef struct SnapshotSymbol {
+    char name[16];              // not terminated if all 16 are used
+    int32_t address;
+} snapshot_symbol_t;
+
+// file offset of the first page
+static long pagesOffset(const snapshot_header_t *header)
+{
+    long offset = sizeof(snapshot_header_t)
+        + header->numProcessors * sizeof(snapshot_core_t)
+        + header->numSymbols * sizeof(snapshot_symbol_t)
+        + header->numPages * sizeof(uint32_t);
+    return (offset + PAGE_BYTES - 1) / PAGE_BYTES * PAGE_BYTES;
+}
+
+static int pageIsZero(const int32_t *page)
+{
+    int32_t any = 0;
+    for (int i = 0; i < PAGE_WORDS; i++) any |= page[i];
+    return any == 0;
+}
+
+int32_t snapshotVm(void *handle, char *filename, int32_t *errorNumber)
+{
+    struct VM *vm = handle;
+    if (!vm) return (*errorNumber = -99) & 0;
+    // next to the file it replaces, so that rename can move it there
+    size_t length = strlen(filename);
+    char *temporary = malloc(length + sizeof(".XXXXXX"));
+    if (!temporary) return (*errorNumber = VMX20_INITIALIZE_FAILURE) & 0;
+    memcpy(temporary, filename, length);
+    memcpy(temporary + length, ".XXXXXX", sizeof(".XXXXXX"));
+    int fd = mkstemp(temporary);
+    // mkstemp leaves the file to its owner; give it the mode of the old one
+    struct stat old;
+    if (fd >= 0) fchmod(fd, stat(filename, &old) == 0 ? old.st_mode & 07777 : 0644);
+    FILE *fp = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (!fp)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(temporary);
+        }
+        free(temporary);
+        return (*errorNumber = VMX20_FILE_NOT_FOUND) & 0;
+    }
+
+    snapshot_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.memSize = vm->memSize;
+    header.progEnd = vm->progEnd;
+    header.entryPoint = vm->entryPoint;
+    header.numProcessors = vm->numProcessors;
+    header.engine = vm->engine;
+    header.memoryModel = vm->memoryModel;
+    header.siMask = vm->siMask;
+    memcpy(header.status, vm->status, sizeof(header.status));
+    header.budget = vm->budget;
+    header.timeLimit = vm->timeLimit;
+    header.numStackWords = vm->numStackWords;
+    memcpy(header.stackWords, vm->stackWords, sizeof(header.stackWords));
+    header.stackGuard = vm->stackGuard;
+    for (sym_t *cur = vm->symbols; cur; cur = cur->next) header.numSymbols++;
+
+    // pages that are not all zero; guard pages are memory like any other here
+    liftGuards(vm, 1);
+    uint32_t pages = (vm->memSize + PAGE_WORDS - 1) / PAGE_WORDS;
+    uint32_t *index = malloc(sizeof(uint32_t) * pages);
+    if (!index)
+    {
+        liftGuards(vm, 0);
+        fclose(fp);
+        unlink(temporary);
+        free(temporary);
+        return (*errorNumber = VMX20_INITIALIZE_FAILURE) & 0;
+    }
+    for (uint32_t p = 0; p < pages; p++)
+    {
+        if (!pageIsZero(&vm->memory[p * PAGE_WORDS])) index[header.numPages++] = p;
+    }
+
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    for (int i = 0; i < vm->numProcessors; i++)
+    {
+        snapshot_core_t core;
+        memset(&core, 0, sizeof(core));
+        if (vm->cores[i])
+        {
+            memcpy(core.reg, vm->cores[i]->reg, sizeof(core.reg));
+            core.stack = vm->cores[i]->stack;
+            core.suspended = 1;
+            core.budget = vm->cores[i]->budget;
+        }
+        ok = ok && fwrite(&core, sizeof(core), 1, fp) == 1;
+    }
+    for (sym_t *cur = vm->symbols; cur; cur = cur->next)
+    {
+        snapshot_symbol_t symbol;
+        memset(&symbol, 0, sizeof(symbol));
+        memcpy(symbol.name, cur->name, strnlen(cur->name, sizeof(symbol.name)));
+        symbol.address = cur->address;
+        ok = ok && fwrite(&symbol, sizeof(symbol), 1, fp) == 1;
+    }
+    ok = ok && fwrite(index, sizeof(uint32_t), header.numPages, fp) == header.numPages;
+    ok = ok && fseek(fp, pagesOffset(&header), SEEK_SET) == 0;
+    for (uint32_t i = 0; i < header.numPages && ok; i++)
+    {
+        ok = fwrite(&vm->memory[index[i] * PAGE_WORDS], PAGE_BYTES, 1, fp) == 1;
+    }
+    free(index);
+    liftGuards(vm, 0);
+    if (fclose(fp) != 0) ok = 0;
+    // vms restored from the old file keep its pages
+    ok = ok && rename(temporary, filename) == 0;
+    if (!ok) unlink(temporary);
+    free(temporary);
+    if (!ok) return (*errorNumber = VMX20_FILE_NOT_FOUND) & 0;
+    *errorNumber = VMX20_NORMAL_TERMINATION;
+    return 1;
+}
+
+// map count pages starting at page first from the file at offset
+static int mapPages(struct VM *vm, int fd, uint32_t first, uint32_t count, long offset)
+{
+    int32_t *at = &vm->memory[first * PAGE_WORDS];
+    if (sysconf(_SC_PAGESIZE) == PAGE_BYTES)
+    {
+        return mmap(at, count * PAGE_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                fd, offset) != MAP_FAILED;
+    }
+    // pages of another size can not be mapped one by one; copy them
+    return pread(fd, at, count * PAGE_BYTES, offset) == (ssize_t)(count * PAGE_BYTES);
+}
+
+void *restoreVm(char *filename, int32_t *errorNumber)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {*errorNumber = VMX20_FILE_NOT_FOUND; return NULL;}
+    FILE *fp = fdopen(fd, "rb");
+    if (!fp) {close(fd); *errorNumber = VMX20_INITIALIZE_FAILURE; return NULL;}
+
+    snapshot_header_t header;
+    if (fread(&header, sizeof(header), 1, fp) != 1
+            || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0
+            || header.numProcessors > VMX20_MAX_PROCESSORS
+            || header.progEnd > header.memSize)
+    {
+        fclose(fp);
+        *errorNumber = VMX20_FILE_IS_NOT_VALID;
+        return NULL;
+    }
+    struct VM *vm = initVmEx(header.memSize, errorNumber);
+    if (!vm) {fclose(fp); return NULL;}
+    vm->progEnd = header.progEnd;
+    vm->entryPoint = header.entryPoint;
+    vm->numProcessors = header.numProcessors;
+    vm->memoryModel = header.memoryModel;
+    vm->siMask = header.siMask;
+    setEngine(vm, header.engine);
+    memcpy(vm->status, header.status, sizeof(vm->status));
+    setBudget(vm, header.budget, header.timeLimit);
+    // before the cores, whose stacks are bounded by them
+    setStacks(vm, header.stackWords, header.numStackWords < VMX20_MAX_PROCESSORS
+            ? header.numStackWords : VMX20_MAX_PROCESSORS, header.stackGuard);
+
+    *errorNumber = VMX20_FILE_IS_NOT_VALID;
+    for (int i = 0; i < header.numProcessors; i++)
+    {
+        snapshot_core_t core;
+        if (fread(&core, sizeof(core), 1, fp) != 1) goto fail;
+        if (!core.suspended) continue;
+        vm->cores[i] = createCore(vm, i, core.stack);
+        if (!vm->cores[i]) {*errorNumber = VMX20_INITIALIZE_FAILURE; goto fail;}
+        memcpy(vm->cores[i]->reg, core.reg, sizeof(core.reg));
+        vm->cores[i]->budget = core.budget;
+    }
+    // keep the order of the list the snapshot was taken from
+    sym_t **tail = &vm->symbols;
+    for (uint32_t i = 0; i < header.numSymbols; i++)
+    {
+        snapshot_symbol_t symbol;
+        if (fread(&symbol, sizeof(symbol), 1, fp) != 1) goto fail;
+        sym_t *sym = malloc(sizeof(sym_t));
+        char *name = calloc(17, sizeof(char));
+        if (!sym || !name)
+        {
+            free(sym);
+            free(name);
+            *errorNumber = VMX20_INITIALIZE_FAILURE;
+            goto fail;
+        }
+        sym->name = name;
+        memcpy(sym->name, symbol.name, sizeof(symbol.name));
+        sym->address = symbol.address;
+        sym->next = NULL;
+        *tail = sym;
+        tail = (sym_t **)&sym->next;
+    }
+
+    if (!symbolsBuild(vm)) {*errorNumber = VMX20_INITIALIZE_FAILURE; goto fail;}
+
+    uint32_t pages = (header.memSize + PAGE_WORDS - 1) / PAGE_WORDS;
+    uint32_t *index = malloc(sizeof(uint32_t) * (header.numPages ? header.numPages : 1));
+    if (!index) {*errorNumber = VMX20_INITIALIZE_FAILURE; goto fail;}
+    if (fread(index, sizeof(uint32_t), header.numPages, fp) != header.numPages) {free(index); goto fail;}
+    long offset = pagesOffset(&header);
+    for (uint32_t i = 0; i < header.numPages; )
+    {
+        // runs of consecutive pages are mapped at once
+        uint32_t n = 1;
+        while (i + n < header.numPages && index[i + n] == index[i] + n) n++;
+        if (index[i] + n > pages || !mapPages(vm, fd, index[i], n, offset + (long)i * PAGE_BYTES))
+        {
+            free(index);
+            goto fail;
+        }
+        i += n;
+    }
+    free(index);
+    fclose(fp);
+
+    vm->code = decodeProgram(vm->memory, vm->progEnd, vm->entryPoint, vm->siMask);
+    if (!vm->code) {*errorNumber = VMX20_INITIALIZE_FAILURE; cleanup(vm); return NULL;}
+    vm->codeEnd = vm->progEnd;
+    *errorNumber = VMX20_NORMAL_TERMINATION;
+    return vm;
+
+fail:
+    fclose(fp);
+    cleanup(vm);
+    return NULL;
+}
@@ -0,0 +1,182 @@
+//
+// vmx20_stacks.c
+//
+// stack sizes and guard pages
+//   a core whose stack starts and ends on page boundaries can have the
+//   page below and the page above it made inaccessible. call, ret, push
+//   and pop of the threaded engine then skip their bounds checks: running
+//   off the stack faults on a guard page, and the SIGSEGV handler jumps
+//   back into runGuarded, which stops the core with
+//   VMX20_ADDRESS_OUT_OF_RANGE. every core of a vm with guard pages runs
+//   under runGuarded, since any of them may touch one.
+//
+
+#include "vmx20.h"
+#include "vmx20_internal.h"
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static pthread_once_t handlerOnce = PTHREAD_ONCE_INIT;
+static int handlerInstalled;
+static struct sigaction previousHandler;
+
+// the core running under runGuarded on this thread, and where to go back to
+static __thread core_t *guardedCore;
+static __thread sigjmp_buf *guardedJump;
+
+static void onFault(int sig, siginfo_t *info, void *context)
+{
+    core_t *cpu = guardedCore;
+    if (cpu)
+    {
+        const char *addr = info->si_addr;
+        const char *memory = (const char *)cpu->vm->memory;
+        // a fault anywhere else in memory is a bug of the vm, not the program
+        if (addr >= memory && addr < memory + sizeof(int32_t) * (size_t)cpu->vm->memSize
+                && inGuard(cpu->vm, (uint32_t)((addr - memory) / sizeof(int32_t)), 1))
+        {
+            siglongjmp(*guardedJump, 1);
+        }
+    }
+    // not a guard page; hand it to whoever had the signal before
+    if (previousHandler.sa_flags & SA_SIGINFO)
+    {
+        previousHandler.sa_sigaction(sig, info, context);
+    }
+    else if (previousHandler.sa_handler != SIG_DFL && previousHandler.sa_handler != SIG_IGN)
+    {
+        previousHandler.sa_handler(sig);
+    }
+    else
+    {
+        // the fault repeats on return and takes the process down
+        signal(SIGSEGV, SIG_DFL);
+    }
+}
+
+static void installHandler(void)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = onFault;
+    // the handler never returns to a guard fault, so it must not stay blocked
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    handlerInstalled = sigaction(SIGSEGV, &action, &previousHandler) == 0;
+}
+
+int32_t setStacks(void *handle, const uint32_t sizes[], uint32_t n, int32_t guard)
+{
+    struct VM *vm = handle;
+    if (!vm || n > VMX20_MAX_PROCESSORS) return 0;
+    memcpy(vm->stackWords, sizes, sizeof(uint32_t) * n);
+    vm->numStackWords = n;
+    vm->stackGuard = guard != 0;
+    return 1;
+}
+
+// lowest word of the stack of core pid
+uint32_t stackLowest(struct VM *vm, int pid, uint32_t initialSP)
+{
+    uint32_t size = vm->numStackWords ? vm->stackWords[pid % vm->numStackWords] : 0;
+    if (size == 0 || initialSP < vm->progEnd || size > initialSP + 1 - vm->progEnd)
+    {
+        return vm->progEnd;
+    }
+    return initialSP + 1 - size;
+}
+
+static int overlapsStack(core_t *cores[], int numCores, uint32_t first, uint32_t words)
+{
+    for (int i = 0; i < numCores; i++)
+    {
+        if (first <= cores[i]->stack && cores[i]->stackLow < first + words) return 1;
+    }
+    return 0;
+}
+
+static int addGuard(struct VM *vm, uint32_t first, uint32_t words)
+{
+    for (uint32_t i = 0; i < vm->numGuards; i++) if (vm->guards[i] == first) return 1;
+    if (mprotect(&vm->memory[first], sizeof(int32_t) * words, PROT_NONE) != 0) return 0;
+    vm->guards[vm->numGuards++] = first;
+    return 1;
+}
+
+// put guard pages around the stacks of the cores that allow them
+//   not while a core can fault holding a lock: memLock in the strict model,
+//   or its turn in the sequence of a recorded or replayed execution
+void guardStacks(struct VM *vm, core_t *cores[], int numCores)
+{
+    if (!vm->stackGuard || !vm->numStackWords || vm->memoryModel != VMX20_MEMORY_RELAXED
+            || vm->replay)
+    {
+        return;
+    }
+    pthread_once(&handlerOnce, installHandler);
+    if (!handlerInstalled) return;
+    uint32_t page = sysconf(_SC_PAGESIZE) / sizeof(int32_t);
+    uint32_t progPages = (vm->progEnd + page - 1) / page * page;
+    for (int i = 0; i < numCores; i++)
+    {
+        core_t *cpu = cores[i];
+        uint32_t low = cpu->stackLow, end = cpu->stack + 1;
+        if (low % page || end % page || end <= low) continue;
+        if (low < progPages + page || (uint64_t)end + page > vm->memSize) continue;
+        if (overlapsStack(cores, numCores, low - page, page)) continue;
+        if (overlapsStack(cores, numCores, end, page)) continue;
+        cpu->guarded = addGuard(vm, low - page, page) && addGuard(vm, end, page);
+    }
+}
+
+// make the guard pages memory again
+void unguardStacks(struct VM *vm)
+{
+    liftGuards(vm, 1);
+    vm->numGuards = 0;
+}
+
+// make the guard pages accessible for a while, or inaccessible again
+void liftGuards(struct VM *vm, int lift)
+{
+    uint32_t page = sysconf(_SC_PAGESIZE) / sizeof(int32_t);
+    for (uint32_t i = 0; i < vm->numGuards; i++)
+    {
+        mprotect(&vm->memory[vm->guards[i]], sizeof(int32_t) * page,
+                lift ? PROT_READ | PROT_WRITE : PROT_NONE);
+    }
+}
+
+// whether any of n words from addr is on a guard page
+int inGuard(struct VM *vm, uint32_t addr, uint32_t n)
+{
+    if (!vm->numGuards) return 0;
+    uint32_t page = sysconf(_SC_PAGESIZE) / sizeof(int32_t);
+    for (uint32_t i = 0; i < vm->numGuards; i++)
+    {
+        if (addr < vm->guards[i] + page && vm->guards[i] < (uint64_t)addr + n) return 1;
+    }
+    return 0;
+}
+
+// run the core with run, stopping it if it faults on a guard page
+int runGuarded(core_t *cpu, int (*run)(core_t *cpu))
+{
+    sigjmp_buf jump;
+    if (sigsetjmp(jump, 0))
+    {
+        guardedCore = NULL;
+        cpu->status = VMX20_ADDRESS_OUT_OF_RANGE;
+        return 0;
+    }
+    guardedJump = &jump;
+    guardedCore = cpu;
+    int running = run(cpu);
+    guardedCore = NULL;
+    return running;
+}
@@ -0,0 +1,149 @@
+//
+// vmx20_symbols.c
+//
+// index over the insymbols of a vm
+//   an open-addressing hash table keyed on the 16-byte name for getAddress
+//   and the symbols sorted by address for finding the symbol of a pc. both
+//   hold pointers into vm->symbols and are rebuilt whenever it changes.
+//
+
+#include "vmx20.h"
+#include "vmx20_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define NAME_BYTES 16   // names are at most 16 bytes, zero padded
+
+typedef struct Located {
+    sym_t *sym;
+    uint32_t order;         // position in vm->symbols
+} located_t;
+
+struct SymbolIndex {
+    uint32_t mask;          // hash slots - 1
+    sym_t **slots;          // NULL where empty
+    uint32_t count;
+    located_t *byAddress;   // sorted by address, then by list order
+};
+
+// FNV-1a over the padded name
+static uint32_t hashName(const char key[NAME_BYTES])
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < NAME_BYTES; i++)
+    {
+        h = (h ^ (uint8_t)key[i]) * 16777619u;
+    }
+    return h;
+}
+
+// names may have junk after their terminator, so only the part up to it
+//   is hashed and compared
+static void padName(const char *name, char key[NAME_BYTES])
+{
+    memset(key, 0, NAME_BYTES);
+    memcpy(key, name, strnlen(name, NAME_BYTES));
+}
+
+static int byAddress(const void *a, const void *b)
+{
+    const located_t *x = a, *y = b;
+    uint32_t ax = x->sym->address, ay = y->sym->address;
+    if (ax != ay) return ax < ay ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+void symbolsClear(struct VM *vm)
+{
+    struct SymbolIndex *index = vm->symbolIndex;
+    if (!index) return;
+    free(index->slots);
+    free(index->byAddress);
+    free(index);
+    vm->symbolIndex = NULL;
+}
+
+int symbolsBuild(struct VM *vm)
+{
+    symbolsClear(vm);
+    struct SymbolIndex *index = calloc(1, sizeof(struct SymbolIndex));
+    if (!index) return 0;
+    for (sym_t *cur = vm->symbols; cur; cur = cur->next) index->count++;
+    uint32_t slots = 8;
+    while (slots < 2 * index->count) slots <<= 1;
+    index->mask = slots - 1;
+    index->slots = calloc(slots, sizeof(sym_t *));
+    index->byAddress = malloc(sizeof(located_t) * (index->count ? index->count : 1));
+    if (!index->slots || !index->byAddress)
+    {
+        free(index->slots);
+        free(index->byAddress);
+        free(index);
+        return 0;
+    }
+
+    uint32_t n = 0;
+    for (sym_t *cur = vm->symbols; cur; cur = cur->next)
+    {
+        // the first of two equal names in the list wins, as it always did
+        char key[NAME_BYTES];
+        padName(cur->name, key);
+        uint32_t i = hashName(key) & index->mask;
+        while (index->slots[i] && strncmp(index->slots[i]->name, key, NAME_BYTES) != 0)
+        {
+            i = (i + 1) & index->mask;
+        }
+        if (!index->slots[i]) index->slots[i] = cur;
+        index->byAddress[n] = (located_t){cur, n};
+        n++;
+    }
+    qsort(index->byAddress, n, sizeof(located_t), byAddress);
+    vm->symbolIndex = index;
+    return 1;
+}
+
+sym_t *symbolsFind(struct VM *vm, const char *label)
+{
+    struct SymbolIndex *index = vm->symbolIndex;
+    if (!index || strlen(label) > NAME_BYTES) return NULL;
+    char key[NAME_BYTES];
+    padName(label, key);
+    uint32_t i = hashName(key) & index->mask;
+    while (index->slots[i])
+    {
+        if (strncmp(index->slots[i]->name, key, NAME_BYTES) == 0) return index->slots[i];
+        i = (i + 1) & index->mask;
+    }
+    return NULL;
+}
+
+sym_t *symbolsAt(struct VM *vm, uint32_t addr)
+{
+    struct SymbolIndex *index = vm->symbolIndex;
+    if (!index) return NULL;
+    // last symbol with an address at or below addr
+    uint32_t lo = 0, hi = index->count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if ((uint32_t)index->byAddress[mid].sym->address <= addr) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) return NULL;
+    // the first one in list order among those at the same address
+    int32_t address = index->byAddress[lo - 1].sym->address;
+    while (lo > 1 && index->byAddress[lo - 2].sym->address == address) lo--;
+    return index->byAddress[lo - 1].sym;
+}
+
+int32_t getSymbol(void *handle, uint32_t addr, char **name, uint32_t *offset)
+{
+    struct VM *vm = handle;
+    if (!vm) return 0;
+    sym_t *sym = symbolsAt(vm, addr);
+    if (!sym) return 0;
+    *name = sym->name;
+    *offset = addr - sym->address;
+    return 1;
+}
@@ -0,0 +1,195 @@
+//
+// vmx20_trace.c
+//
+// binary instruction trace
+//   every traced core appends fixed-size records to its own ring buffer
+//   without taking a lock; a writer thread drains the rings into the trace
+//   file. a core only waits when the writer has fallen a full ring behind.
+//
+
+#include "vmx20.h"
+#include "vmx20_macros.h"
+#include "vmx20_internal.h"
+#include "vmx20_trace.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_RING 65536    // records per core; a power of two
+#define TRACE_BATCH 4096    // most records written by one fwrite
+
+// single producer (the core), single consumer (the writer)
+typedef struct TraceRing {
+    trace_record_t records[TRACE_RING];
+    uint64_t head;      // records produced
+    uint64_t tail;      // records consumed
+} trace_ring_t;
+
+struct Tracer {
+    FILE *file;
+    int numCores;
+    trace_ring_t *rings[VMX20_MAX_PROCESSORS];
+    int done;           // set once all cores have stopped
+    pthread_t writer;
+};
+
+int32_t setTraceFile(void *handle, char *filename)
+{
+    struct VM *vm = handle;
+    if (!vm) return 0;
+    if (vm->traceFile) fclose(vm->traceFile);
+    vm->traceFile = NULL;
+    if (!filename) return 1;
+    vm->traceFile = fopen(filename, "wb");
+    return vm->traceFile != NULL;
+}
+
+// write out what the cores have produced so far; returns the record count
+static uint64_t drain(struct Tracer *tracer)
+{
+    uint64_t written = 0;
+    for (int i = 0; i < tracer->numCores; i++)
+    {
+        trace_ring_t *ring = tracer->rings[i];
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+        while (tail != head)
+        {
+            // contiguous part of the ring
+            uint64_t n = head - tail;
+            uint64_t first = tail & (TRACE_RING - 1);
+            if (n > TRACE_RING - first) n = TRACE_RING - first;
+            if (n > TRACE_BATCH) n = TRACE_BATCH;
+            fwrite(&ring->records[first], sizeof(trace_record_t), n, tracer->file);
+            tail += n;
+            written += n;
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        }
+    }
+    return written;
+}
+
+static void *writerThread(void *arg)
+{
+    struct Tracer *tracer = arg;
+    struct timespec pause = {0, 1000000};   // 1ms
+    while (!__atomic_load_n(&tracer->done, __ATOMIC_ACQUIRE))
+    {
+        if (!drain(tracer)) nanosleep(&pause, NULL);
+    }
+    drain(tracer);
+    return NULL;
+}
+
+// start a section of the trace file; cores must not run yet
+int traceStart(struct VM *vm, core_t **cores, int numCores)
+{
+    struct Tracer *tracer = calloc(1, sizeof(struct Tracer));
+    if (!tracer) return 0;
+    tracer->file = vm->traceFile;
+    tracer->numCores = numCores;
+
+    trace_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.numProcessors = numCores;
+    header.recordSize = sizeof(trace_record_t);
+    for (int i = 0; i < numCores; i++)
+    {
+        memcpy(header.reg[i], cores[i]->reg, sizeof(header.reg[i]));
+        header.reg[i][PC] = vm->entryPoint;
+        tracer->rings[i] = calloc(1, sizeof(trace_ring_t));
+        if (!tracer->rings[i])
+        {
+            for (int j = 0; j < i; j++) free(tracer->rings[j]);
+            free(tracer);
+            return 0;
+        }
+        cores[i]->ring = tracer->rings[i];
+    }
+    fwrite(&header, sizeof(header), 1, tracer->file);
+
+    if (pthread_create(&tracer->writer, NULL, &writerThread, tracer))
+    {
+        for (int i = 0; i < numCores; i++)
+        {
+            cores[i]->ring = NULL;
+            free(tracer->rings[i]);
+        }
+        free(tracer);
+        return 0;
+    }
+    vm->tracer = tracer;
+    return 1;
+}
+
+// end the section once every core has stopped
+void traceStop(struct VM *vm)
+{
+    struct Tracer *tracer = vm->tracer;
+    if (!tracer) return;
+    __atomic_store_n(&tracer->done, 1, __ATOMIC_RELEASE);
+    pthread_join(tracer->writer, NULL);
+
+    trace_record_t end;
+    memset(&end, 0, sizeof(end));
+    end.core = TRACE_END;
+    fwrite(&end, sizeof(end), 1, tracer->file);
+    fflush(tracer->file);
+
+    for (int i = 0; i < tracer->numCores; i++) free(tracer->rings[i]);
+    free(tracer);
+    vm->tracer = NULL;
+}
+
+// first memory word the instruction accessed, from the registers before it
+static uint32_t accessedAddress(const dop_t *ins, uint8_t op, const int32_t before[16])
+{
+    switch (op)
+    {
+        case INS_LOAD:
+        case INS_STORE:
+        case INS_CMPXCHG:   return ins->arg;
+        case INS_LDIND:
+        case INS_STIND:     return before[ins->r2] + ins->arg;
+        case INS_CALL:
+        case INS_PUSH:      return before[SP] - 1;
+        case INS_RET:
+        case INS_POP:       return before[SP];
+        default:            return TRACE_NO_ADDR;
+    }
+}
+
+// record the instruction the core has just executed
+void traceStep(core_t *cpu, uint32_t pc, const dop_t *ins, uint8_t op, const int32_t before[16])
+{
+    trace_ring_t *ring = cpu->ring;
+    uint64_t head = ring->head;
+    while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_RING)
+    {
+        sched_yield();  // full; the writer is behind
+    }
+
+    trace_record_t *rec = &ring->records[head & (TRACE_RING - 1)];
+    rec->pc = pc;
+    rec->word = 0;
+    memLoad(cpu->vm, pc, &rec->word);
+    rec->addr = accessedAddress(ins, op, before);
+    rec->reg[0] = rec->reg[1] = TRACE_NO_REG;
+    rec->value[0] = rec->value[1] = 0;
+    int changed = 0;
+    for (int r = 0; r < 16 && changed < 2; r++)
+    {
+        if (cpu->reg[r] == before[r]) continue;
+        rec->reg[changed] = r;
+        rec->value[changed] = cpu->reg[r];
+        changed++;
+    }
+    rec->core = cpu->pid;
+    rec->op = op;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,43 @@
+//
+// vmx20_trace.h
+//
+// layout of the binary trace files written by vmx20 (see setTraceFile) and
+//   read by tracex20
+//
+// a trace file is a sequence of sections, one per traced call to execute.
+//   a section is a trace_header_t, followed by the trace_record_t of every
+//   instruction executed and a trace_record_t with core TRACE_END. the
+//   records of one core are in the order the core executed them; records
+//   of different cores are interleaved in no particular order.
+//
+
+#ifndef VMX20_TRACE_H
+#define VMX20_TRACE_H
+
+#include "vmx20.h"
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "VMX20TR1"
+#define TRACE_NO_ADDR 0xffffffffu   // instruction did not touch memory
+#define TRACE_NO_REG 0xff           // unused register slot
+#define TRACE_END 0xff              // core of the record ending a section
+
+typedef struct TraceHeader {
+    char magic[8];              // TRACE_MAGIC, not terminated
+    uint32_t numProcessors;
+    uint32_t recordSize;        // sizeof(trace_record_t)
+    int32_t reg[VMX20_MAX_PROCESSORS][16];  // registers of each core at start
+} trace_header_t;
+
+typedef struct TraceRecord {
+    uint32_t pc;                // address of the instruction
+    int32_t word;               // the instruction word that was executed
+    uint32_t addr;              // first memory word accessed, or TRACE_NO_ADDR
+    int32_t value[2];           // new values of the registers in reg
+    uint8_t reg[2];             // registers written, or TRACE_NO_REG
+    uint8_t core;               // pid of the core, or TRACE_END
+    uint8_t op;                 // opcode executed (0xfe: pc outside memory)
+} trace_record_t;
+
+#endif
@@ -0,0 +1,198 @@
+//
+// vmx20_watch.c
+//
+// watchpoints on ranges of memory
+//   a bitmap with a bit per page of memory marks the pages that hold a
+//   watched word. while a vm has watches its cores run on a variant of
+//   the switch engine that passes every instruction to watchStep, which
+//   only searches the watches for accesses to a marked page. a vm without
+//   watches has no bitmap, and its engines never look.
+//
+
+#include "vmx20.h"
+#include "vmx20_macros.h"
+#include "vmx20_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define WATCH_PAGE_SHIFT 8      // 256 words per bit of the bitmap
+
+typedef struct Watch {
+    uint32_t id;
+    uint32_t addr;
+    uint32_t n;             // words watched from addr
+    int32_t access;         // VMX20_WATCH_* caught
+    vmx20_watch_t callback; // NULL for a data breakpoint
+    void *arg;
+} watch_t;
+
+// mark the pages of the watches in a new bitmap
+//   the old one stays if there is no memory for it; while watches are
+//   only removed it covers them all the same
+static int buildPages(struct VM *vm)
+{
+    if (!vm->numWatches)
+    {
+        free(vm->watchPages);
+        vm->watchPages = NULL;
+        return 1;
+    }
+    uint32_t pages = (vm->memSize >> WATCH_PAGE_SHIFT) + 1;
+    uint64_t *bits = calloc((pages + 63) / 64, sizeof(uint64_t));
+    if (!bits) return 0;
+    for (uint32_t i = 0; i < vm->numWatches; i++)
+    {
+        const watch_t *w = &vm->watches[i];
+        uint32_t last = (w->addr + w->n - 1) >> WATCH_PAGE_SHIFT;
+        for (uint32_t p = w->addr >> WATCH_PAGE_SHIFT; p <= last; p++)
+        {
+            bits[p / 64] |= 1ull << (p % 64);
+        }
+    }
+    free(vm->watchPages);
+    vm->watchPages = bits;
+    return 1;
+}
+
+int32_t addWatch(void *handle, uint32_t addr, uint32_t n, int32_t access,
+        vmx20_watch_t callback, void *arg, uint32_t *id)
+{
+    struct VM *vm = handle;
+    if (!vm || n == 0 || (uint64_t)addr + n > vm->memSize) return 0;
+    access &= VMX20_WATCH_READ | VMX20_WATCH_WRITE | VMX20_WATCH_CMPXCHG;
+    if (!access) return 0;
+    watch_t *watches = realloc(vm->watches, sizeof(watch_t) * (vm->numWatches + 1));
+    if (!watches) return 0;
+    vm->watches = watches;
+    watches[vm->numWatches++] = (watch_t){vm->nextWatch, addr, n, access, callback, arg};
+    if (!buildPages(vm))
+    {
+        vm->numWatches--;
+        return 0;
+    }
+    *id = vm->nextWatch++;
+    return 1;
+}
+
+int32_t removeWatch(void *handle, uint32_t id)
+{
+    struct VM *vm = handle;
+    if (!vm) return 0;
+    for (uint32_t i = 0; i < vm->numWatches; i++)
+    {
+        if (vm->watches[i].id != id) continue;
+        memmove(&vm->watches[i], &vm->watches[i + 1], sizeof(watch_t) * (vm->numWatches - i - 1));
+        vm->numWatches--;
+        buildPages(vm);
+        return 1;
+    }
+    return 0;
+}
+
+int32_t getWatchHit(void *handle, uint32_t *id, uint32_t *pid, uint32_t *pc,
+        uint32_t *addr)
+{
+    struct VM *vm = handle;
+    if (!vm || !vm->watchHit) return 0;
+    *id = vm->hitWatch;
+    *pid = vm->hitPid;
+    *pc = vm->hitPc;
+    *addr = vm->hitAddr;
+    return 1;
+}
+
+void watchClear(struct VM *vm)
+{
+    free(vm->watches);
+    free(vm->watchPages);
+    vm->watches = NULL;
+    vm->watchPages = NULL;
+    vm->numWatches = 0;
+}
+
+// pass an access of the instruction at pc to the watches that catch it
+//   returns 0 if one of them suspended the vm and 1 otherwise
+static int watchAccess(core_t *cpu, uint32_t pc, uint32_t addr, int32_t access)
+{
+    struct VM *vm = cpu->vm;
+    if (addr >= vm->memSize) return 1;     // nothing was accessed
+    uint32_t page = addr >> WATCH_PAGE_SHIFT;
+    if (!(vm->watchPages[page / 64] >> (page % 64) & 1)) return 1;
+    for (uint32_t i = 0; i < vm->numWatches; i++)
+    {
+        const watch_t *w = &vm->watches[i];
+        if (!(w->access & access) || addr - w->addr >= w->n) continue;
+        int32_t word = __atomic_load_n(&vm->memory[addr], __ATOMIC_ACQUIRE);
+        if (w->callback && w->callback(vm, cpu->pid, pc, addr, access, word, w->arg)) continue;
+        // the first core to stop the vm is the one getWatchHit reports
+        if (!__atomic_exchange_n(&vm->watchHit, 1, __ATOMIC_ACQ_REL))
+        {
+            vm->hitWatch = w->id;
+            vm->hitPid = cpu->pid;
+            vm->hitPc = pc;
+            vm->hitAddr = addr;
+        }
+        __atomic_store_n(&vm->suspendRequested, 1, __ATOMIC_RELAXED);
+        // the core stops after this instruction; the rest of its slice is
+        //   not charged
+        cpu->forfeited += cpu->slice;
+        cpu->slice = 0;
+        return 0;
+    }
+    return 1;
+}
+
+// pass the accesses of the instruction at pc, which has just executed
+//   with the registers in before, to the watches
+void watchStep(core_t *cpu, uint32_t pc, uint8_t op, const dop_t *ins, const int32_t before[16],
+        int32_t success)
+{
+    uint32_t sp = before[SP];
+    switch (op)
+    {
+        case INS_LOAD:
+            watchAccess(cpu, pc, ins->arg, VMX20_WATCH_READ);
+            break;
+        case INS_STORE:
+            watchAccess(cpu, pc, ins->arg, VMX20_WATCH_WRITE);
+            break;
+        case INS_LDIND:
+            if (success) watchAccess(cpu, pc, before[ins->r2] + ins->arg, VMX20_WATCH_READ);
+            break;
+        case INS_STIND:
+            if (success) watchAccess(cpu, pc, before[ins->r2] + ins->arg, VMX20_WATCH_WRITE);
+            break;
+        case INS_CMPXCHG:
+            watchAccess(cpu, pc, ins->arg, VMX20_WATCH_CMPXCHG);
+            break;
+        case INS_CALL:
+            // return address, saved FP and the return value slot
+            if (success && watchAccess(cpu, pc, sp - 1, VMX20_WATCH_WRITE)
+                    && watchAccess(cpu, pc, sp - 2, VMX20_WATCH_WRITE))
+            {
+                watchAccess(cpu, pc, sp - 3, VMX20_WATCH_WRITE);
+            }
+            break;
+        case INS_RET:
+            // the same three words, then the return value into the caller
+            if (success && watchAccess(cpu, pc, sp, VMX20_WATCH_READ)
+                    && watchAccess(cpu, pc, sp + 1, VMX20_WATCH_READ)
+                    && watchAccess(cpu, pc, sp + 2, VMX20_WATCH_READ))
+            {
+                watchAccess(cpu, pc, cpu->reg[FP] - 1, VMX20_WATCH_WRITE);
+            }
+            break;
+        case INS_PUSH:
+            if (success) watchAccess(cpu, pc, sp - 1, VMX20_WATCH_WRITE);
+            break;
+        case INS_POP:
+            // pop always stops the core, but reads the word first if sp is
+            //   on the stack
+            if (sp <= cpu->stack && sp >= cpu->stackLow)
+            {
+                watchAccess(cpu, pc, sp, VMX20_WATCH_READ);
+            }
+            break;
+    }
+}